@@ -6,4 +6,5 @@ if [ ! -d $T ]; then
 fi
 mkdir $T/in $T/out $T/log $T/tmp $T/bin
 cp bin/* $T/bin
+cp telive_rec $T/bin
 touch $T/log/telive.log
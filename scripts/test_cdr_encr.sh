@@ -0,0 +1,44 @@
+#!/bin/bash
+#
+# the call records must say which calls were encrypted: an encrypted
+# call and a clear one are sent to telive, telive is stopped (which
+# ends the calls), and telive_cdr has to show ENCR only for the first.
+# run from the top directory with make test
+#
+PORT=${PORT:-7399}
+DIR=$(mktemp -d)
+trap 'rm -rf $DIR' EXIT
+
+send() {
+	printf '%s' "$1" > /dev/udp/127.0.0.1/$PORT
+}
+
+# a traffic frame: the 6 byte header and 1380 bytes of voice, in one datagram
+sendframe() {
+	{ printf 'TRA%02x\0' $1; dd if=testfile.acelp bs=1380 skip=$2 count=1 2>/dev/null; } > $DIR/frame
+	dd if=$DIR/frame bs=2048 2>/dev/null > /dev/udp/127.0.0.1/$PORT
+}
+
+TETRA_HEADLESS=1 TETRA_KEYS= TETRA_PORT=$PORT TETRA_OUTDIR=$DIR TETRA_CDR_DIR=$DIR/cdr ./telive >/dev/null 2>&1 &
+PID=$!
+sleep 1
+
+send "TETMON_begin FUNC:DSETUPDEC IDX:5 SSI:1000 ENCR:1 TETMON_end"
+send "TETMON_begin FUNC:DSETUPDEC IDX:6 SSI:2000 ENCR:0 TETMON_end"
+for k in 0 1 2 3 4 5 6 7 8 9; do
+	sendframe 5 $k
+	sendframe 6 $k
+	sleep 0.06
+done
+sleep 0.5
+kill -TERM $PID
+wait $PID
+
+./telive_cdr -d $DIR/cdr > $DIR/out
+cat $DIR/out
+if grep -q "usage:5 ENCR .*ssi:1000 " $DIR/out && grep -q "usage:6 frames:.*ssi:2000 " $DIR/out; then
+	echo "ok"
+	exit 0
+fi
+echo "FAILED: the encrypted call must have ENCR, the clear one not"
+exit 1
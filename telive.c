@@ -23,12 +23,15 @@
  */
 
 
+#define _GNU_SOURCE
 #include <fnmatch.h>
+#include <stdarg.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <ncurses.h>
 #include <sys/types.h>
@@ -36,12 +39,28 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <sys/select.h>
 #include <sys/time.h>
 #include <time.h>
 #include <signal.h>
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "telive.h"
 
@@ -49,6 +68,9 @@
 
 #define BUFLEN 8192
 #define PORT 7379
+#define RECV_MAXBATCH 256 /* upper limit of datagrams drained by one recvmmsg() */
+#define MAXNETS 8 /* how many networks (listening ports) one telive can serve */
+#define MAXTRANSCODERS 16 /* max number of transcoding threads */
 
 /******* definitions *******/
 int rec_timeout=30; /* after how long we stop to record a usage identifier */
@@ -57,32 +79,40 @@ int idx_timeout=8; /* after how long we disable the active flag */
 int curplaying_timeout=5; /* after how long we stop playing the current usage identifier */
 int freq_timeout=600; /* how long we remember frequency info */
 int receiver_timeout=60; /* how long we remember receiver info */
+int rec_batch=16; /* how many voice frames we collect before handing them to the recording thread */
+int rec_maxopen=32; /* max number of recording files kept open */
+int rec_queue_max=1024; /* max number of pending recording writes */
+int rec_raw=0; /* write the recordings as bare voice frames instead of the container */
+off_t rec_extent=4<<20; /* recordings are preallocated in chunks this big, 0 - don't */
+int log_queue_max=4096; /* max number of log lines waiting to be written */
+int log_sync=1; /* log durability: 0 - flush once a second, 1 - flush every batch, 2 - fdatasync every batch */
+int recv_batch=32; /* how many datagrams we try to get with one recvmmsg() */
+int recv_rcvbuf=0; /* SO_RCVBUF size, 0 - leave the kernel default */
+int recv_queue_size=4096; /* datagrams waiting between the receive thread and the main loop */
+int recv_block=0; /* full receive queue: 0 - drop the datagram, 1 - wait and leave it in the kernel */
+int transcode_workers=0; /* number of transcoding threads, 0 - leave it to tetrad */
+int mix_channels=1; /* how many calls are played at the same time, more than 1 mixes them */
 
 
-char *outdir;
 char def_outdir[BUFLEN]="/tetra/in";
-char *logfile;
 char def_logfile[BUFLEN]="telive.log";
+char transcode_dir[BUFLEN]="/tetra/out";
+char *cdr_dir=NULL; /* where the call records are stored, NULL - nowhere */
+char transcode_cmd[BUFLEN]="PATH=$PATH:/tetra/bin; telive_rec \"$1\" | cdecoder /dev/stdin /dev/stdout | sdecoder /dev/stdin /dev/stdout | oggenc -Q -r -B 16 -C 1 -R 8000 -o \"$2\" -";
+char mix_decoder[BUFLEN]="PATH=$PATH:/tetra/bin; cdecoder /dev/stdin /dev/stdout | sdecoder /dev/stdin /dev/stdout";
+char mix_player[BUFLEN]="aplay -q -fS16_LE -r8000 -c1";
 char *ssifile;
 char def_ssifile[BUFLEN]="ssi_descriptions";
 char ssi_filter[BUFLEN];
 int use_filter=0;
 
-char *kml_file=NULL;
-char *kml_tmp_file=NULL;
 int kml_interval;
-int last_kml_save=0;
-int kml_changed=0;
-int freq_changed=0;
+int loc_timeout=0; /* after how long we forget locations, 0 - never */
+unsigned int loc_gen=0; /* bumped when all cached placemarks have to be rebuilt */
 
 char *lock_file=NULL;
-int lockfd=0;
 int locked=0;
 
-/* various times for scheduling in tickf() */
-time_t last_1s_event=0;
-time_t last_10s_event=0;
-time_t last_1min_event=0;
 
 #define max(a,b) \
 	({ __typeof__ (a) _a = (a); \
@@ -98,12 +128,10 @@ WINDOW *mainwin=0; /* main window */
 WINDOW *freqwin=0; /* frequency window */
 WINDOW *ssiwin=0; /* SSI window */
 WINDOW *locwin=0; /* Location window */
-WINDOW *displayedwin=0; /* the window currently displayed */
+WINDOW *displayedwin=0; /* the window currently displayed, used only by the screen thread */
 int ref; /* window refresh flag, set to refresh all windows */
 
-char prevtmsg[BUFLEN]; /* contents of previous message */
-
-struct {
+struct netinfo {
 	uint16_t mcc;
 	uint16_t mnc;
 	uint8_t colour_code;
@@ -112,7 +140,30 @@ struct {
 	uint16_t la;
 	time_t last_change;
 	uint32_t changes;
-} netinfo;
+};
+
+/* 
+ * timer wheel with a resolution of 1/TICKS_PER_SEC seconds. a timer sits 
+ * in the slot of its expiry time modulo WHEEL_SLOTS, timers further away 
+ * just survive a few turns of the wheel. the bitmap of used slots tells 
+ * the main loop when the next timer is due
+ */
+#define WHEEL_SLOTS 4096 /* must be a power of 2 */
+#define TICKS_PER_SEC 10
+
+struct wtimer {
+	time_t expires; /* in ticks */
+	struct wtimer *next;
+	struct wtimer **pprev;
+	time_t (*fn)(struct wtimer *t,time_t now); /* returns the new expiry time, or 0 */
+	void *ctx; /* the network the timer belongs to */
+};
+
+struct wheel {
+	struct wtimer *slots[WHEEL_SLOTS];
+	uint64_t used[WHEEL_SLOTS/64];
+	time_t now; /* everything up to this tick was processed */
+};
 
 /* this structure is used to describe all known frequencies */
 struct freqinfo {
@@ -126,8 +177,12 @@ struct freqinfo {
 	int rx;
 	void *next;
 	void *prev;
+	struct freqinfo *ulnext; /* hash chains */
+	struct freqinfo *dlnext;
+	struct wtimer timer;
 };
 
+/* what is looked at for every message and traffic frame of an usage identifier */
 struct usi {
 	unsigned int ssi[3];
 	time_t ssi_time[3];
@@ -136,8 +191,31 @@ struct usi {
 	int timeout;
 	int active;
 	int play;
-	char curfile[BUFLEN];
+	uint32_t seq; /* sequence number of the last traffic frame */
+	int seq_rx; /* from which RX (plus 1), 0 if none yet */
+	unsigned int filter_gen; /* filter_match is valid for this filter_gen, 0 - the SSIs changed */
+	int filter_match;
+};
+
+/* the recording and the statistics, kept apart so that the table above stays small */
+struct usi_rec {
+	int idx; /* the slot of this usage identifier */
+	char *curfile; /* the recording, NULL if there is none */
 	char curfiletime[32];
+	unsigned char *recdata; /* voice frames not yet handed to the recording thread */
+	int reclen;
+	time_t recstart; /* when the first of them came */
+	struct wtimer timer; /* for all the timeouts of this usage identifier */
+	unsigned long frames; /* traffic frames received, for the statistics */
+	unsigned long lost; /* traffic frames missing according to the sequence numbers */
+	/* for the call record */
+	time_t callstart;
+	unsigned long callframes; /* frames and lost when the call started */
+	unsigned long calllost;
+	unsigned int callssi[CDR_MAXSSI]; /* all SSIs seen during the call */
+	int ncallssi;
+	int recorded; /* something was written to the recording */
+	int encr; /* the call was encrypted */
 };
 
 struct opisy {
@@ -153,11 +231,18 @@ struct locations {
 	float longtitude;
 	char *description;
 	time_t lastseen;
-	void *next;
+	void *next; /* the list is ordered by lastseen, oldest first */
 	void *prev;
-
+	struct locations *hnext; /* hash chain */
+	char *kml; /* cached placemarks, rebuilt when the location or loc_gen changes */
+	int kmllen;
+	char *geojson;
+	int geojsonlen;
+	unsigned int gen;
 };
 
+#define LOC_HASHSIZE 1024 /* must be a power of 2 */
+
 /* reeciver info */
 struct receiver {
 	unsigned int rxid;
@@ -166,874 +251,4126 @@ struct receiver {
 	time_t lastseen;
 	void *next;
 	void *prev;
+	struct receiver *hnext; /* hash chain */
+	struct wtimer timer;
 };
 
+#define FREQ_HASHSIZE 256 /* must be a power of 2 */
+#define RX_HASHSIZE 64 /* must be a power of 2 */
+
 
 
-struct receiver *receivers=NULL;
 struct opisy *opisssi;
-struct locations *kml_locations=NULL;
-struct freqinfo *frequencies=NULL;
 
-int curplayingidx=0;
-time_t curplayingtime=0;
-int curplayingticks=0; 
-FILE *playingfp=NULL;
+#define MAXUS 64 /* usage identifiers in one cell */
+#define MAXCELLS 256 /* receivers in one network */
+
+/* 
+ * the usage identifiers are only unique within one cell, so each RX gets 
+ * its own table. they are allocated when the RX is first seen, and are 
+ * numbered (slots) as cell*MAXUS+usage within the network
+ */
+struct usage_cell {
+	int rxid;
+	struct netinfo netinfo; /* what this RX says about its cell */
+	struct usi us[MAXUS];
+	struct usi_rec rec[MAXUS];
+};
+
+/* sequence numbers of the signalling messages from one RX */
+#define MAXRXSEQ 32
+
+struct rxseq {
+	int rxid;
+	uint32_t seq;
+	int seq_valid; /* got a SEQ: from it already */
+	unsigned long lost; /* signalling messages and traffic frames missing */
+	unsigned long lost_shown;
+};
+
+/* 
+ * everything that we know about one monitored network. every listening 
+ * port gets its own context, so that one telive process can follow 
+ * several networks without mixing up their usage identifiers etc.
+ */
+struct tetra_net {
+	int id;
+	int port;
+	int sock;
+	char *outdir;
+	char *logfile;
+	char *kml_file;
+	char *kml_tmp_file;
+	char *geojson_file;
+	char *geojson_tmp_file;
+	int last_kml_save;
+	int kml_changed;
+	int freq_changed;
+	int last_burst;
+	time_t last_burst_tick;
+	struct wtimer burst_timer;
+	struct wtimer kml_timer;
+	struct wtimer loc_timer;
+	struct netinfo netinfo;
+	struct usage_cell **cells;
+	int ncells;
+	int maxcells; /* allocated room in cells */
+	int cells_full; /* already complained about MAXCELLS */
+	struct rxseq rxseq[MAXRXSEQ];
+	int nrxseq;
+	uint32_t kernel_dropped; /* SO_RXQ_OVFL: datagrams dropped by the kernel since the socket was opened */
+	uint32_t kernel_dropped_shown;
+	struct freqinfo *frequencies;
+	struct freqinfo *frequencies_last;
+	struct freqinfo *freq_ulhash[FREQ_HASHSIZE];
+	struct freqinfo *freq_dlhash[FREQ_HASHSIZE];
+	struct receiver *receivers;
+	struct receiver *receivers_last;
+	struct receiver *rx_hash[RX_HASHSIZE];
+	struct locations *kml_locations; /* oldest */
+	struct locations *kml_locations_last; /* newest */
+	struct locations *loc_hash[LOC_HASHSIZE];
+	int nlocations;
+	char prevtmsg[BUFLEN]; /* contents of previous message */
+};
+
+struct tetra_net nets[MAXNETS];
+int nnets=0;
+struct tetra_net *net=&nets[0]; /* the network which is being processed right now */
+struct tetra_net *dispnet=&nets[0]; /* the network which is shown on the screen */
+int dispcell=0; /* and its cell */
+
+static inline struct usi *getusi(struct tetra_net *n,int idx)
+{
+	return(&n->cells[idx/MAXUS]->us[idx%MAXUS]);
+}
+
+static inline struct usi_rec *getusr(struct tetra_net *n,int idx)
+{
+	return(&n->cells[idx/MAXUS]->rec[idx%MAXUS]);
+}
+
+static inline int nslots(struct tetra_net *n)
+{
+	return(n->ncells*MAXUS);
+}
+
+/* the calls which are played now, one per channel of the mixer */
+#define MAXMIX 8
+
+struct play_chan {
+	struct tetra_net *net; /* NULL if the channel is free */
+	int idx;
+	int prio;
+	float gain;
+	time_t time; /* when it played the last frame */
+	unsigned int call; /* play_call when it got the channel */
+};
+
+struct play_chan playchans[MAXMIX];
+unsigned int play_call=0; /* bumped every time another call gets played */
 int mutessi=0;
 int alldump=0;
 int ps_record=0;
 int ps_mute=0;
 int do_log=0;
-int last_burst=0;
 
 enum telive_screen { DISPLAY_IDX, DISPLAY_FREQ, DISPLAY_END };
 int display_state=DISPLAY_IDX;
 
-void appendlog(char *msg) {
-	FILE *f;
-	f=fopen(logfile,"ab");
-	if (f) {
-		fprintf(f,"%s\n",msg);
-		fclose(f);
+/*************** screen output ****************/
+
+/* 
+ * the main loop never calls ncurses. it marks what has changed, and 
+ * refresh_scr() copies that into a snapshot, from which the screen 
+ * thread draws at most ui_fps times a second. in headless mode there 
+ * is no screen at all, the status and message window texts go to 
+ * stderr and stdout
+ */
+int headless=0;
+int ui_fps=10; /* max screen updates per second */
+
+#define UI_TITLE 1
+#define UI_MAIN 2 /* redraw the whole main window */
+#define UI_FREQ 4
+#define UI_TEXT 8
+#define UI_REDRAW 16 /* redraw everything, even what didn't change */
+
+#define UI_TEXTLEN 16384
+
+struct ui_usage {
+	int active;
+	int encr;
+	int play;
+	unsigned int ssi[3];
+	char opis[3][21];
+};
+
+struct ui_text {
+	char buf[UI_TEXTLEN];
+	int len;
+	int lost; /* text didn't fit, the screen thread was too slow */
+};
+
+struct ui_snapshot {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int dirty;
+	uint64_t dirty_idx; /* usage identifiers that changed */
+	int screen;
+	struct ui_usage idx[MAXUS];
+	char title_net[BUFLEN];
+	char title_rest[BUFLEN];
+	char *freqtext;
+	struct ui_text status;
+	struct ui_text msg;
+	int quit; /* put the terminal back and stop */
+};
+
+struct ui_snapshot ui={ .mutex=PTHREAD_MUTEX_INITIALIZER, .cond=PTHREAD_COND_INITIALIZER };
+int ui_pending=0; /* what changed since the last snapshot */
+uint64_t ui_pending_idx=0;
+
+void ui_vprintf(struct ui_text *t,FILE *f,const char *fmt,va_list ap)
+{
+	int len;
+
+	if (headless) {
+		vfprintf(f,fmt,ap);
+		return;
 	}
+	pthread_mutex_lock(&ui.mutex);
+	len=vsnprintf(t->buf+t->len,UI_TEXTLEN-t->len,fmt,ap);
+	if (t->len+len>=UI_TEXTLEN) {
+		t->buf[t->len]=0;
+		t->lost=1;
+	} else {
+		t->len+=len;
+	}
+	ui.dirty|=UI_TEXT;
+	pthread_mutex_unlock(&ui.mutex);
+	ref=1;
 }
 
+/* print to the status window */
+void status_printf(const char *fmt,...)
+{
+	va_list ap;
+	va_start(ap,fmt);
+	ui_vprintf(&ui.status,stderr,fmt,ap);
+	va_end(ap);
+}
 
-void clearopisy()
+/* print to the message window */
+void msg_printf(const char *fmt,...)
 {
-	struct opisy *ptr,*ptr2;
-	ptr=opisssi;
+	va_list ap;
+	va_start(ap,fmt);
+	ui_vprintf(&ui.msg,stdout,fmt,ap);
+	va_end(ap);
+	if (headless) fflush(stdout);
+}
 
-	while(ptr)
-	{
-		ptr2=ptr->next;
-		free((void *)ptr->opis);
-		free(ptr);
-		ptr=ptr2;
-	}
-	opisssi=0;
+/*************** timers ****************/
+
+struct wheel sched; /* all the timers of the main loop */
+struct wtimer housekeeping_timer;
+struct wtimer curplaying_timer;
+
+time_t now_tick()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME,&ts);
+	return((time_t)ts.tv_sec*TICKS_PER_SEC+ts.tv_nsec/(1000000000/TICKS_PER_SEC));
 }
 
-time_t ostopis=0;
+static inline time_t sec_tick(time_t t)
+{
+	return(t*TICKS_PER_SEC);
+}
 
-int newopis()
+void timer_init(struct wtimer *t,time_t (*fn)(struct wtimer *t,time_t now),void *ctx)
 {
-	struct stat st;
-	if (stat(ssifile,&st)) return(0);
+	memset(t,0,sizeof(struct wtimer));
+	t->fn=fn;
+	t->ctx=ctx;
+}
 
-	if (st.st_mtime>ostopis) {
-		ostopis=st.st_mtime;
-		return(1);
-	}
-	return(0);
+void wheel_add(struct wheel *w,struct wtimer *t,time_t expires)
+{
+	struct wtimer **slot;
+	unsigned int i;
+
+	if (expires<=w->now) expires=w->now+1;
+	t->expires=expires;
+	i=expires&(WHEEL_SLOTS-1);
+	slot=&w->slots[i];
+	t->next=*slot;
+	if (t->next) t->next->pprev=&t->next;
+	t->pprev=slot;
+	*slot=t;
+	w->used[i/64]|=1ULL<<(i%64);
 }
 
-int initopis()
+void wheel_del(struct wheel *w,struct wtimer *t)
 {
-	FILE *g;
-	char str[100];
-	struct opisy *ptr,*prevptr;
-	char *c;
+	unsigned int i;
+
+	if (!t->pprev) return;
+	*t->pprev=t->next;
+	if (t->next) t->next->pprev=t->pprev;
+	t->next=NULL;
+	t->pprev=NULL;
+	i=t->expires&(WHEEL_SLOTS-1);
+	if (!w->slots[i]) w->used[i/64]&=~(1ULL<<(i%64));
+}
 
-	prevptr=NULL;
-	clearopisy();
-	g=fopen(ssifile,"r");
-	if (!g) return(0);
-	str[sizeof(str)-1]=0;
-	while(!feof(g))
-	{
-		if (!fgets(str,sizeof(str)-1,g)) break;
-		c=strchr(str,' ');
-		if (c==NULL) continue;
-		*c=0;
-		c++;
-		ptr=malloc(sizeof(struct opisy));
-		if (prevptr) {
-			prevptr->next=ptr;
-			ptr->prev=prevptr;
-			ptr->next=NULL;
-		} else
-		{
-			opisssi=ptr;
+/* 
+ * run the timers that expired up to now. a timer whose object was 
+ * refreshed in the meantime is just put back with the new expiry time, 
+ * so a refresh costs nothing more than storing the time. the timers of 
+ * a slot are taken off into a list of their own, which stays properly 
+ * linked, so a callback can stop or arm any timer, its own included
+ */
+void wheel_run(struct wheel *w,time_t now)
+{
+	struct wtimer *t,*list;
+	time_t tick;
+	time_t r;
+	unsigned int i;
+	int n=0;
+
+	if (!w->now) w->now=now;
+	for (tick=w->now+1;(tick<=now)&&(n<WHEEL_SLOTS);tick++,n++) {
+		i=tick&(WHEEL_SLOTS-1);
+		if (!(w->used[i/64]&(1ULL<<(i%64)))) continue;
+		list=w->slots[i];
+		if (list) list->pprev=&list;
+		w->slots[i]=NULL;
+		w->used[i/64]&=~(1ULL<<(i%64));
+		w->now=tick;
+		while((t=list)) {
+			list=t->next;
+			if (list) list->pprev=&list;
+			t->next=NULL;
+			t->pprev=NULL;
+			if (t->expires>now) {
+				/* not this turn of the wheel */
+				wheel_add(w,t,t->expires);
+				continue;
+			}
+			r=t->fn(t,now);
+			if (t->pprev) {
+				/* the callback armed it already, the earlier time wins */
+				if ((r)&&(r<t->expires)) {
+					wheel_del(w,t);
+					wheel_add(w,t,r);
+				}
+			} else if (r) {
+				wheel_add(w,t,r);
+			}
 		}
-		ptr->ssi=atoi(str);
-		ptr->opis=strdup(c);
-		prevptr=ptr;
 	}
-	fclose(g);
-	return(1);
+	w->now=now;
 }
 
-const char nop[2]="-\0";
-char *lookupssi(int ssi)
+/* when the next timer might be due, 0 - no timers at all */
+time_t wheel_next(struct wheel *w)
 {
-	struct opisy *ptr=opisssi;
+	unsigned int start=(w->now+1)&(WHEEL_SLOTS-1);
+	unsigned int s=start;
+	unsigned int word,slot;
+	uint64_t bits;
+	int i;
 
-	while(ptr)
-	{
-		if (ptr->ssi==ssi) return(ptr->opis);
-		ptr=ptr->next;
+	for (i=0;i<WHEEL_SLOTS/64+1;i++) {
+		word=(s/64)&(WHEEL_SLOTS/64-1);
+		bits=w->used[word];
+		if (!i) bits&=~0ULL<<(s%64);
+		if (bits) {
+			slot=word*64+__builtin_ctzll(bits);
+			return(w->now+1+((slot-start)&(WHEEL_SLOTS-1)));
+		}
+		s=(word+1)*64;
 	}
-	return((char *)&nop);
+	return(0);
 }
 
+/* make sure the timer fires at expires at the latest */
+void timer_arm(struct wtimer *t,time_t expires)
+{
+	if ((t->pprev)&&(t->expires<=expires)) return;
+	wheel_del(&sched,t);
+	wheel_add(&sched,t,expires);
+}
 
-void add_location(int ssi,float lattitude,float longtitude,char *description)
+void timer_stop(struct wtimer *t)
 {
-	struct locations *ptr=kml_locations;
-	struct locations *prevptr=NULL;
-	char *c;
+	wheel_del(&sched,t);
+}
 
-	if (ptr) {
-		/* maybe we already know this ssi? */
-		while(ptr) {
-			if (ptr->ssi==ssi) break;
-			prevptr=ptr;
-			ptr=ptr->next;
-		}
-	}
+/* the structure in which the timer t is embedded as the member "timer" */
+#define timer_entry(t,type) ((type *)((char *)(t)-offsetof(type,timer)))
 
-	if (!ptr) {
-		ptr=calloc(1,sizeof(struct locations));
-		if (!kml_locations) kml_locations=ptr;
-		if (prevptr) { 
-			ptr->prev=prevptr; 
-			prevptr->next=ptr; 
-		} 
-		ptr->ssi=ssi;
-	} else {
-		free(ptr->description);
+/* append to a malloc()ed string */
+void strappend(char **s,int *len,int *size,char *a)
+{
+	int l=strlen(a);
+	if (*len+l+1>*size) {
+		*size=(*len+l+1)*2;
+		*s=realloc(*s,*size);
 	}
+	memcpy(*s+*len,a,l+1);
+	*len+=l;
+}
 
-	ptr->lastseen=time(0);
-	ptr->lattitude=lattitude;
-	ptr->longtitude=longtitude;
-	ptr->description=strdup(description);
-	c=ptr->description;
-	/* ugly hack so that we don't get <> there, which would break the xml */
-	while(*c) { if (*c=='>') *c='G';  if (*c=='<') *c='L'; c++; } 
-	kml_changed=1;
+/* 
+ * statistics, for sizing the hardware and load testing. the counters 
+ * which are bumped by the worker threads are updated atomically, the 
+ * rest belongs to the main loop. the histograms have power of 2 buckets 
+ * starting at 1us. they are written out in the prometheus text format 
+ * by format_stats()
+ */
+#define HIST_BUCKETS 24
 
+struct histogram {
+	unsigned long count;
+	unsigned long long sum_ns;
+	unsigned long bucket[HIST_BUCKETS+1]; /* the last one is +Inf */
+};
+
+char *stats_file=NULL;
+char *stats_tmp_file=NULL;
+char *stats_socket=NULL;
+int stats_sock=-1;
+time_t stats_start;
+unsigned long stats_datagrams=0;
+unsigned long stats_messages=0; /* TETMON messages, text or binary */
+unsigned long stats_frames=0; /* traffic frames */
+unsigned long stats_bad_lines=0; /* TETMON_begin without TETMON_end, broken binary records */
+unsigned long stats_small_frames=0;
+unsigned long stats_play_errors=0; /* playback thread */
+unsigned long stats_rec_bytes=0; /* recording thread */
+unsigned long stats_rec_dropped=0; /* bytes */
+unsigned long stats_log_lines=0; /* log thread */
+unsigned long stats_capture_bytes=0; /* log thread */
+unsigned long stats_kml_dumps=0;
+unsigned long stats_recvq_dropped=0; /* receive thread */
+unsigned long stats_api_requests=0; /* API thread */
+unsigned long recvq_dropped_shown=0;
+unsigned int stats_recvq_depth=0; /* datagrams left in the receive queue after the last pass */
+struct histogram stats_datagram_time; /* how long handling one datagram took */
+struct histogram stats_queue_time; /* from the receive thread taking a datagram until the main loop gets to it */
+struct histogram stats_loop_time; /* one pass of the main loop, without the waiting */
+struct histogram stats_kml_time; /* putting the KML/GeoJSON files together */
+struct histogram stats_api_time; /* putting an API snapshot together */
+
+static inline void hist_add(struct histogram *h,unsigned long ns)
+{
+	int b=0;
+	while((b<HIST_BUCKETS)&&(ns>(1000UL<<b))) b++;
+	h->bucket[b]++;
+	h->count++;
+	h->sum_ns+=ns;
 }
 
-void dump_kml_file() {
-	FILE *f;
-	struct locations *ptr=kml_locations;
-	if (verbose>1) wprintw(statuswin,"called dump_kml_file()\n");
+static inline unsigned long ts_diff_ns(struct timespec *a,struct timespec *b)
+{
+	return((b->tv_sec-a->tv_sec)*1000000000L+b->tv_nsec-a->tv_nsec);
+}
 
-	if (!kml_tmp_file) return;
-	f=fopen(kml_tmp_file,"w");
-	if (!f) return;
-	if (verbose>1) wprintw(statuswin,"dump_kml_file(%s)\n",kml_tmp_file);
-	fprintf(f,"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<kml xmlns=\"http://www.opengis.net/kml/2.2\">\n<Folder>\n<name>");
-	fprintf(f,"Telive MCC:%5i MNC:%5i ColourCode:%3i Down:%3.4fMHz Up:%3.4fMHz LA:%5i",netinfo.mcc,netinfo.mnc,netinfo.colour_code,netinfo.dl_freq/1000000.0,netinfo.ul_freq/1000000.0,netinfo.la);
-	fprintf(f,"</name>\n<open>1</open>\n");
+static inline void stats_add(unsigned long *c,unsigned long n)
+{
+	__atomic_fetch_add(c,n,__ATOMIC_RELAXED);
+}
 
-	while(ptr)
-	{
-		fprintf(f,"<Placemark> <name>%i</name> <description>%s %s</description> <Point> <coordinates>%f,%f,0</coordinates></Point></Placemark>\n",ptr->ssi,lookupssi(ptr->ssi),ptr->description,ptr->longtitude,ptr->lattitude);
-		ptr=ptr->next;
-	}
+/*************** background workers ****************/
 
-	fprintf(f,"</Folder></kml>\n");
-	fclose(f);
-	rename(kml_tmp_file,kml_file);
-	last_kml_save=time(0);
-	kml_changed=0;
+/* 
+ * a simple job queue, the main loop puts jobs there, and worker threads 
+ * take them out and do the slow stuff (mostly disk I/O). 
+ * the queue is bounded, jobs which don't fit are dropped (and counted) 
+ * unless they are forced in
+ */
+#define JOB_STOP 0 /* the worker stops, after what was queued before */
+
+struct job {
+	int type;
+	char *path;
+	char *path2;
+	unsigned char *data;
+	int len;
+	struct job *next;
+};
+
+struct jobqueue {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct job *head;
+	struct job *tail;
+	int n;
+	int max;
+	unsigned long dropped;
+};
+
+void jq_init(struct jobqueue *q,int max)
+{
+	memset(q,0,sizeof(struct jobqueue));
+	pthread_mutex_init(&q->mutex,NULL);
+	pthread_cond_init(&q->cond,NULL);
+	q->max=max;
 }
 
-/* delete the whole location info */
-void clear_locations() {
-	struct locations *ptr=kml_locations;
-	struct locations *nextptr;
-	while(ptr) {
-		nextptr=ptr->next;
-		free(ptr->description);
-		free(ptr);
-		ptr=nextptr;
-	}
-	kml_locations=NULL;
+struct job *job_new(int type,char *path,char *path2,unsigned char *data,int len)
+{
+	struct job *j=calloc(1,sizeof(struct job));
+	j->type=type;
+	if (path) j->path=strdup(path);
+	if (path2) j->path2=strdup(path2);
+	j->data=data;
+	j->len=len;
+	return(j);
 }
 
-#define MAXUS 64
-struct usi ssis[MAXUS];
+void job_free(struct job *j)
+{
+	free(j->path);
+	free(j->path2);
+	free(j->data);
+	free(j);
+}
 
-void diep(char *s)
+/* put a job into the queue, returns 0 if it was dropped (and freed) */
+int jq_put(struct jobqueue *q,struct job *j,int force)
 {
-	wprintw(statuswin,"DIE: %s\n",s);
-	wrefresh(statuswin);
-	sleep(1);
-	perror(s);
-	exit(1);
+	pthread_mutex_lock(&q->mutex);
+	if ((!force)&&(q->n>=q->max)) {
+		q->dropped++;
+		pthread_mutex_unlock(&q->mutex);
+		job_free(j);
+		return(0);
+	}
+	j->next=NULL;
+	if (q->tail) {
+		q->tail->next=j;
+	} else {
+		q->head=j;
+	}
+	q->tail=j;
+	q->n++;
+	pthread_cond_signal(&q->cond);
+	pthread_mutex_unlock(&q->mutex);
+	return(1);
 }
-#define RR 13
-int getr(int idx) {
-	return((idx%RR)*4);
+
+/* get a job from the queue, waits until there is one */
+struct job *jq_get(struct jobqueue *q)
+{
+	struct job *j;
+	pthread_mutex_lock(&q->mutex);
+	while(!q->head) pthread_cond_wait(&q->cond,&q->mutex);
+	j=q->head;
+	q->head=j->next;
+	if (!q->head) q->tail=NULL;
+	q->n--;
+	pthread_mutex_unlock(&q->mutex);
+	return(j);
 }
 
-int getcl(int idx)
+/* get a job from the queue, waits at most ms milliseconds, returns NULL if there was none */
+struct job *jq_get_timeout(struct jobqueue *q,int ms)
 {
-	return ((idx/RR)*40);
+	struct job *j;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME,&ts);
+	ts.tv_sec+=ms/1000;
+	ts.tv_nsec+=(ms%1000)*1000000L;
+	if (ts.tv_nsec>=1000000000L) { ts.tv_sec++; ts.tv_nsec-=1000000000L; }
+
+	pthread_mutex_lock(&q->mutex);
+	while(!q->head) {
+		if ((!ms)||(pthread_cond_timedwait(&q->cond,&q->mutex,&ts))) {
+			if (q->head) break;
+			pthread_mutex_unlock(&q->mutex);
+			return(NULL);
+		}
+	}
+	j=q->head;
+	q->head=j->next;
+	if (!q->head) q->tail=NULL;
+	q->n--;
+	pthread_mutex_unlock(&q->mutex);
+	return(j);
 }
 
-/* update usage identifier display */
-void updidx(int idx) {
-	char opis[40];
-	int i;
-	int row=getr(idx);
-	int col=getcl(idx);
-	int bold=0;
+/* 
+ * recording thread: keeps the recording files open (at most rec_maxopen, 
+ * the least recently used one is closed when we need more), and writes 
+ * batches of voice frames collected by the main loop. the files are 
+ * containers (see telive.h), the seek index and the overs are collected 
+ * here while writing, and appended when the call ends. the space is 
+ * preallocated in rec_extent chunks, so that long recordings written 
+ * side by side don't end up in small pieces all over the disk
+ */
+#define JOB_REC_WRITE 1
+#define JOB_REC_CLOSE 2 /* finish, close and rename path to path2 */
+#define JOB_TRANSCODE 4 /* transcode the finished recording in path */
+#define JOB_CDR 7 /* append the call record in data to the store in path */
+
+struct recwriter {
+	char *path;
+	int fd;
+	unsigned long lastuse;
+	off_t len; /* written so far */
+	off_t alloc; /* preallocated up to here */
+	uint32_t frames;
+	int64_t first; /* arrival time of the first frame, ms */
+	int64_t last; /* and of the last one */
+	int rx; /* the RX of the last one */
+	unsigned char *index; /* the index entries */
+	int ixlen;
+	int ixmax;
+	unsigned char *overs; /* the over entries, the last one is still growing */
+	int overslen;
+	int oversmax;
+};
 
-	if ((idx<0)||(idx>=MAXUS)) { wprintw(statuswin,"BUG! updidx(%i)\n",idx); wrefresh(statuswin); return; }
+struct jobqueue recq;
+pthread_t rec_thread;
+struct recwriter *recwriters;
+unsigned long rec_usecnt=0;
+unsigned long rec_failed=0; /* batches which couldn't be written */
+unsigned long rec_failed_shown=0;
 
-	opis[0]=0;
-	wmove(mainwin,row,col+5);
-	if (ssis[idx].active) strcat(opis,"OK ");
-	//	if (ssis[idx].timeout) strcat(opis,"timeout ");
-	if (ssis[idx].encr) strcat(opis,"ENCR ");
-	if ((ssis[idx].play)&&(ssis[idx].active)) { bold=1; strcat(opis,"*PLAY*"); }
-	if (bold) wattron(mainwin,A_BOLD|COLOR_PAIR(1));
-	wprintw(mainwin,"%-30s",opis);
-	if (bold) wattroff(mainwin,COLOR_PAIR(1));
-	for (i=0;i<3;i++) {
-		wmove(mainwin,row+i+1,col+5);
-		if (ssis[idx].ssi[i]) {
-			wprintw(mainwin,"%8i %20s",ssis[idx].ssi[i],lookupssi(ssis[idx].ssi[i]));
-		}
-		else 
-		{
-			wprintw(mainwin,"                              ");
+struct jobqueue tcq;
 
-		}
+void rec_closewriter(struct recwriter *w);
+void rec_frames(struct recwriter *w,unsigned char *data,int len);
+
+void rec_grow(unsigned char **buf,int *len,int *max,int n)
+{
+	if (*len+n>*max) {
+		*max=*max?*max*2:64*n;
+		*buf=realloc(*buf,*max);
 	}
-	if (bold) wattroff(mainwin,A_BOLD);
-	ref=1;
+	*len+=n;
 }
 
-void draw_idx() {
-	int idx;
-	for (idx=0;idx<MAXUS;idx++)
-	{
-		wmove(mainwin,getr(idx),getcl(idx));
-		wprintw(mainwin,"%2i:",idx);
+/* 
+ * a recording we write to again after it was closed: cut off a half 
+ * written frame and read the frames back for the index. this only 
+ * happens when more than rec_maxopen are recorded at the same time
+ */
+int rec_reopen(struct recwriter *w)
+{
+	unsigned char buf[REC_RECLEN];
+	off_t n;
+
+	/* a leftover of another format starts over, a finished one loses its trailer */
+	if ((w->len>=REC_HDRLEN)&&((pread(w->fd,buf,REC_HDRLEN,0)!=REC_HDRLEN)||(memcmp(buf,REC_MAGIC,5)))) w->len=0;
+	if ((w->len>=REC_HDRLEN+REC_FOOTLEN)&&(pread(w->fd,buf,REC_FOOTLEN,w->len-REC_FOOTLEN)==REC_FOOTLEN)&&
+			(!memcmp(buf,REC_FOOT_MAGIC,5))&&(REC_HDRLEN+rec_getbe(buf+8,4)*REC_RECLEN<w->len)) w->len=REC_HDRLEN+rec_getbe(buf+8,4)*REC_RECLEN;
+	if (w->len<REC_HDRLEN) {
+		memset(buf,0,REC_HDRLEN);
+		memcpy(buf,REC_MAGIC,5);
+		buf[5]=REC_VERSION;
+		if ((ftruncate(w->fd,0)==-1)||(write(w->fd,buf,REC_HDRLEN)!=REC_HDRLEN)) return(0);
+		w->len=REC_HDRLEN;
+		return(1);
+	}
+	n=(w->len-REC_HDRLEN)/REC_RECLEN;
+	w->len=REC_HDRLEN+n*REC_RECLEN;
+	if (ftruncate(w->fd,w->len)==-1) return(0);
+	for (n=0;n<(w->len-REC_HDRLEN)/REC_RECLEN;n++) {
+		if (pread(w->fd,buf,REC_RECLEN,REC_HDRLEN+n*REC_RECLEN)!=REC_RECLEN) return(0);
+		rec_frames(w,buf,REC_RECLEN);
 	}
+	return(1);
 }
 
-/* refresh the main window */
-void display_mainwin() {
-	int idx;
-	wclear(mainwin);
-	draw_idx();
-	for (idx=0;idx<MAXUS;idx++) updidx(idx);
-	ref=1;
+/* find the open writer for a file, or open it (possibly closing the LRU one) */
+struct recwriter *rec_getwriter(char *path,int create)
+{
+	int i;
+	int lru=0;
+	int fd;
+
+	for (i=0;i<rec_maxopen;i++) {
+		if ((recwriters[i].path)&&(!strcmp(recwriters[i].path,path))) {
+			recwriters[i].lastuse=++rec_usecnt;
+			return(&recwriters[i]);
+		}
+		if (recwriters[i].lastuse<recwriters[lru].lastuse) lru=i;
+	}
+	if (!create) return(NULL);
+	fd=open(path,O_RDWR|O_CREAT|O_APPEND|O_CLOEXEC,0644);
+	if (fd==-1) return(NULL);
+	if (recwriters[lru].path) rec_closewriter(&recwriters[lru]);
+	recwriters[lru].path=strdup(path);
+	recwriters[lru].fd=fd;
+	recwriters[lru].lastuse=++rec_usecnt;
+	recwriters[lru].len=lseek(fd,0,SEEK_END);
+	recwriters[lru].alloc=0;
+	if ((!rec_raw)&&(!rec_reopen(&recwriters[lru]))) {
+		rec_closewriter(&recwriters[lru]);
+		return(NULL);
+	}
+	return(&recwriters[lru]);
 }
 
-#define STATUSLINES 7
-int initcur() {
-	int maxx,maxy;
-	initscr();
-	start_color();
-	cbreak();
-	init_pair(1, COLOR_RED, COLOR_BLUE);
-	init_pair(2, COLOR_YELLOW, COLOR_BLUE);
-	init_pair(3, COLOR_RED, COLOR_GREEN);
-	init_pair(4, COLOR_WHITE, COLOR_GREEN);
-	init_pair(5, COLOR_BLACK, COLOR_YELLOW);
-	clear();
-	titlewin=newwin(1,COLS,0,0);
-	mainwin=newwin(LINES-STATUSLINES-1,COLS,1,0);
-	freqwin=newwin(LINES-STATUSLINES-1,COLS,1,0);
-	locwin=newwin(LINES-STATUSLINES-1,COLS,1,0);
-	ssiwin=newwin(LINES-STATUSLINES-1,COLS,1,0);
-	displayedwin=mainwin;
-	msgwin=newwin(STATUSLINES,COLS/2,LINES-STATUSLINES,0);
-	wattron(msgwin,COLOR_PAIR(2));
-	wbkgdset(msgwin,COLOR_PAIR(2));
-	wclear(msgwin);
-	wprintw(msgwin,"Message window\n");
-	scrollok(msgwin,TRUE);
-
-	statuswin=newwin(STATUSLINES,COLS/2,LINES-STATUSLINES,COLS/2+1);
-	wattron(statuswin,COLOR_PAIR(3));
-	wbkgdset(statuswin,COLOR_PAIR(3));
-	wclear(statuswin);
-	wprintw(statuswin,"####  Press ? for keystroke help  ####\n");
-	getmaxyx(stdscr,maxy,maxx);
-	if ((maxx!=203)||(maxy!=60)) {
-		wprintw(statuswin,"\nWARNING: The terminal size is %ix%i, but it should be 203x60\nThe program will still work, but the display may be mangled\n\n",maxx,maxy);
-	}
-	scrollok(statuswin,TRUE);
+void rec_closewriter(struct recwriter *w)
+{
+	close(w->fd);
+	free(w->path);
+	free(w->index);
+	free(w->overs);
+	memset(w,0,sizeof(struct recwriter));
+	w->fd=-1;
+}
 
-	wattron(titlewin,A_BOLD);
-	wprintw(titlewin,"** SQ5BPF TETRA Monitor %s **",TELIVE_VERSION);
-	wattroff(titlewin,A_BOLD);
+/* note the frames which are about to be written in the index, and mark where the overs start */
+void rec_frames(struct recwriter *w,unsigned char *data,int len)
+{
+	unsigned char *p;
+	int64_t t,ms;
+	int rx;
 
-	draw_idx();
-	ref=1;
-	return(1);
+	for (p=data;p+REC_RECLEN<=data+len;p+=REC_RECLEN) {
+		t=rec_getbe(p+4,8);
+		rx=rec_getbe(p+2,2);
+		if (!w->frames) w->first=t;
+		ms=(t>w->first)?t-w->first:0;
+		if (!(w->frames%REC_INDEX_STEP)) {
+			rec_grow(&w->index,&w->ixlen,&w->ixmax,REC_IXLEN);
+			rec_putbe(w->index+w->ixlen-REC_IXLEN,w->frames,4);
+			rec_putbe(w->index+w->ixlen-REC_IXLEN+4,ms,4);
+		}
+		if ((!w->frames)||(t-w->last>=REC_OVER_GAP)||(rx!=w->rx)) {
+			p[1]|=REC_OVER;
+			rec_grow(&w->overs,&w->overslen,&w->oversmax,REC_OVERLEN);
+			memset(w->overs+w->overslen-REC_OVERLEN,0,REC_OVERLEN);
+			rec_putbe(w->overs+w->overslen-REC_OVERLEN,w->frames,4);
+			rec_putbe(w->overs+w->overslen-REC_OVERLEN+8,ms,4);
+			rec_putbe(w->overs+w->overslen-REC_OVERLEN+12,rx,2);
+		}
+		rec_putbe(w->overs+w->overslen-REC_OVERLEN+4,rec_getbe(w->overs+w->overslen-REC_OVERLEN+4,4)+1,4);
+		w->frames++;
+		w->last=t;
+		w->rx=rx;
+	}
 }
 
-void updopis()
+/* returns -1 if not everything could be written */
+int rec_append(struct recwriter *w,unsigned char *data,int len)
 {
-	wmove(titlewin,0,32);
-	wattron(titlewin,COLOR_PAIR(4)|A_BOLD);
-	wprintw(titlewin,"MCC:%5i MNC:%5i ColourCode:%3i Down:%3.4fMHz Up:%3.4fMHz LA:%5i %c",netinfo.mcc,netinfo.mnc,netinfo.colour_code,netinfo.dl_freq/1000000.0,netinfo.ul_freq/1000000.0,netinfo.la,last_burst?'*':' ');
-	wattroff(titlewin,COLOR_PAIR(4)|A_BOLD);
-	wprintw(titlewin," mutessi:%i alldump:%i mute:%i record:%i log:%i verbose:%i lock:%i",mutessi,alldump,ps_mute,ps_record,do_log,verbose,locked);
-	switch(use_filter)
-	{
-		case 0:	wprintw(titlewin," no filter"); break;
-		case  1:	wprintw(titlewin," Filter ON"); break;
-		case -1:	wprintw(titlewin," Inv. Filt"); break;
-	}
-	wprintw(titlewin," [%s] ",ssi_filter); 
+	struct recwriter saved=*w;
+	unsigned char lastover[REC_OVERLEN];
+	int r;
 
-	ref=1;
+	/* the frames get their over marks before they are written, but only count when they are all on the disk */
+	if (w->overslen) memcpy(lastover,w->overs+w->overslen-REC_OVERLEN,REC_OVERLEN);
+	if (!rec_raw) rec_frames(w,data,len);
+	if ((rec_extent)&&(w->len+len>w->alloc)) {
+		/* the file size stays as it is, the blocks after it are given back by rec_finish() */
+		while (w->alloc<w->len+len) w->alloc+=rec_extent;
+		if ((fallocate(w->fd,FALLOC_FL_KEEP_SIZE,w->len,w->alloc-w->len)==-1)&&(errno==EOPNOTSUPP)) rec_extent=0;
+	}
+	r=write(w->fd,data,len);
+	if (r!=len) {
+		/* cut off a part of the batch, so that the file and the trailer stay in step */
+		if (r>0) ftruncate(w->fd,w->len);
+		w->frames=saved.frames;
+		w->first=saved.first;
+		w->last=saved.last;
+		w->rx=saved.rx;
+		w->ixlen=saved.ixlen;
+		w->overslen=saved.overslen;
+		if (w->overslen) memcpy(w->overs+w->overslen-REC_OVERLEN,lastover,REC_OVERLEN);
+		return(-1);
+	}
+	w->len+=r;
+	stats_add(&stats_rec_bytes,r);
+	return(0);
 }
 
-int addssi(int idx,int ssi)
+/* 
+ * append the index, the overs and the footer, give back the preallocated 
+ * space, and get it all on the disk before the file is renamed, so that 
+ * a finished recording is always complete
+ */
+void rec_finish(struct recwriter *w)
 {
-	int i;
+	unsigned char foot[REC_FOOTLEN];
+	struct iovec iov[3];
 
-	if (!ssi) return(0);
-	if ((idx<0)||(idx>=MAXUS)) { wprintw(statuswin,"BUG! addssi(%i,%i)\n",idx,ssi); wrefresh(statuswin); return(0); }
-	for(i=0;i<3;i++) {
-		if (ssis[idx].ssi[i]==ssi) {
-			ssis[idx].ssi_time[i]=time(0);
-			return(1);
-		}
+	if (rec_raw) {
+		ftruncate(w->fd,w->len);
+		return;
 	}
-	for(i=0;i<3;i++) {
-		if (!ssis[idx].ssi[i]) {
-			ssis[idx].ssi[i]=ssi;
-			ssis[idx].ssi_time[i]=time(0);
-			return(1);
-		}
-	}	
+	memset(foot,0,sizeof(foot));
+	memcpy(foot,REC_FOOT_MAGIC,5);
+	foot[5]=REC_VERSION;
+	rec_putbe(foot+8,w->frames,4);
+	rec_putbe(foot+12,w->ixlen/REC_IXLEN,4);
+	rec_putbe(foot+16,w->overslen/REC_OVERLEN,4);
+	iov[0].iov_base=w->index;
+	iov[0].iov_len=w->ixlen;
+	iov[1].iov_base=w->overs;
+	iov[1].iov_len=w->overslen;
+	iov[2].iov_base=foot;
+	iov[2].iov_len=REC_FOOTLEN;
+	if (writev(w->fd,iov,3)!=w->ixlen+w->overslen+REC_FOOTLEN) return;
+	w->len+=w->ixlen+w->overslen+REC_FOOTLEN;
+	ftruncate(w->fd,w->len);
+	fdatasync(w->fd);
+}
 
+/* 
+ * the call record store, see telive.h. the files of the current day are 
+ * kept open, only the recording thread writes to them
+ */
+int cdr_fd=-1;
+int cdr_ssifd=-1;
+uint32_t cdr_nrec; /* records in cdr_fd */
+char cdr_day[16];
 
+/* open a file of the store for appending, cut off what a crash left half written */
+int cdr_open(char *dir,char *day,char *ext,int hdrlen,int reclen,uint32_t *nrec)
+{
+	char path[BUFLEN];
+	char hdr[CDR_HDRLEN];
+	off_t len;
+	int fd;
+
+	snprintf(path,sizeof(path),"%s/%s.%s",dir,day,ext);
+	fd=open(path,O_RDWR|O_CREAT|O_APPEND|O_CLOEXEC,0644);
+	if (fd==-1) return(-1);
+	len=lseek(fd,0,SEEK_END);
+	if (len<hdrlen) {
+		len=0;
+		if (ftruncate(fd,0)==-1) { close(fd); return(-1); }
+		if (hdrlen) {
+			memset(hdr,0,sizeof(hdr));
+			memcpy(hdr,CDR_MAGIC,5);
+			hdr[5]=CDR_VERSION;
+			write(fd,hdr,hdrlen);
+		}
+	} else if ((len-hdrlen)%reclen) {
+		len-=(len-hdrlen)%reclen;
+		if (ftruncate(fd,len)==-1) { close(fd); return(-1); }
+	}
+	if (nrec) *nrec=(len>hdrlen)?(len-hdrlen)/reclen:0;
+	return(fd);
+}
 
-	/* no room to add, forget one ssi */
-	ssis[idx].ssi[0]=ssis[idx].ssi[1];
-	ssis[idx].ssi[1]=ssis[idx].ssi[2];
-	ssis[idx].ssi[2]=ssi;
-	ssis[idx].ssi_time[2]=time(0);
-	ssis[idx].active=1;
-	return(1);
+/* append a file of struct cdr_ssi to ix */
+void cdr_readssi(char *path,struct cdr_ssi **ix,size_t *n,size_t *max)
+{
+	struct stat st;
+	ssize_t r;
+	int fd;
+
+	fd=open(path,O_RDONLY|O_CLOEXEC);
+	if (fd==-1) return;
+	if (fstat(fd,&st)==0) {
+		if (*n+st.st_size/sizeof(struct cdr_ssi)>*max) {
+			*max=*n+st.st_size/sizeof(struct cdr_ssi);
+			*ix=realloc(*ix,*max*sizeof(struct cdr_ssi));
+		}
+		r=read(fd,*ix+*n,(*max-*n)*sizeof(struct cdr_ssi));
+		if (r>0) *n+=r/sizeof(struct cdr_ssi);
+	}
+	close(fd);
 }
 
-int addssi2(int idx,int ssi,int i)
+int cdr_cmpssi(const void *a,const void *b)
 {
-	if (!ssi) return(0);
-	ssis[idx].ssi[i]=ssi;
-	ssis[idx].ssi_time[i]=time(0);
-	ssis[idx].active=1;
+	const struct cdr_ssi *x=a,*y=b;
+	if (x->ssi!=y->ssi) return((x->ssi<y->ssi)?-1:1);
+	if (x->rec!=y->rec) return((x->rec<y->rec)?-1:1);
 	return(0);
 }
 
+/* 
+ * sort the SSI log of a day into its index, together with what the index 
+ * has already (records can come a bit out of order around midnight). the 
+ * new index replaces the old one by a rename, the log goes away after that
+ */
+void cdr_sort(char *dir,char *day)
+{
+	char log[BUFLEN];
+	char idx[BUFLEN];
+	char tmp[BUFLEN];
+	struct cdr_ssi *ix=NULL;
+	size_t n=0,max=0;
+	int fd,ok;
+
+	snprintf(log,sizeof(log),"%s/%s.ssi",dir,day);
+	snprintf(idx,sizeof(idx),"%s/%s.idx",dir,day);
+	snprintf(tmp,sizeof(tmp),"%s/%s.idx.tmp",dir,day);
+	cdr_readssi(idx,&ix,&n,&max);
+	cdr_readssi(log,&ix,&n,&max);
+	qsort(ix,n,sizeof(struct cdr_ssi),cdr_cmpssi);
+	fd=open(tmp,O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,0644);
+	if (fd!=-1) {
+		ok=(write(fd,ix,n*sizeof(struct cdr_ssi))==n*sizeof(struct cdr_ssi))&&(fdatasync(fd)==0);
+		close(fd);
+		if ((ok)&&(!rename(tmp,idx))) unlink(log); else unlink(tmp);
+	}
+	free(ix);
+}
 
-int releasessi(int ssi)
+/* sort the logs of the other days, left when telive was stopped before the day was over */
+void cdr_sort_old(char *dir,char *day)
 {
-	int i,j;
-	for (i=0;i<MAXUS;i++) {
-		for (j=0;j<3;j++) {
-			if ((ssis[i].active)&&(ssis[i].ssi[j]==ssi)) {
-				ssis[i].active=0;
-				ssis[i].play=0;
-				updidx(i);
-				ref=1;
-			}
-		}
+	struct dirent *de;
+	char d[16];
+	DIR *dp;
+
+	dp=opendir(dir);
+	if (!dp) return;
+	while((de=readdir(dp))) {
+		if ((strlen(de->d_name)!=12)||(strcmp(de->d_name+8,".ssi"))||(!strncmp(de->d_name,day,8))) continue;
+		snprintf(d,sizeof(d),"%.8s",de->d_name);
+		cdr_sort(dir,d);
 	}
-	return(0);
+	closedir(dp);
 }
 
-/* check if an SSI matches the filter expression */
-int matchssi(int ssi) 
+void cdr_write(char *dir,struct cdr_record *c)
 {
-	int r;
-	char ssistr[16];
-	if (!ssi) return(0);
-	sprintf(ssistr,"%i",ssi);
-	if (strlen(ssi_filter)==0) return(1); 
+	struct cdr_ssi ix[CDR_MAXSSI];
+	struct tm tm;
+	time_t t=c->end;
+	char day[16];
+	int i;
 
-#ifdef FNM_EXTMATCH
-	r=fnmatch((char *)&ssi_filter,(char *)&ssistr,FNM_EXTMATCH);
-#else
-	/* FNM_EXTMATCH is a GNU libc extension, not present in other libcs, like the MacOS X one */
-#warning -----------    Extended match patterns for fnmatch are not supported by your libc. You will have to live with that.    ------------
-	r=fnmatch((char *)&ssi_filter,(char *)&ssistr,0); 
-#endif
-	return(!r);
+	localtime_r(&t,&tm);
+	strftime(day,sizeof(day),"%Y%m%d",&tm);
+	if (strcmp(day,cdr_day)) {
+		if (cdr_fd!=-1) close(cdr_fd);
+		if (cdr_ssifd!=-1) close(cdr_ssifd);
+		mkdir(dir,0755);
+		if (cdr_day[0]) cdr_sort(dir,cdr_day); else cdr_sort_old(dir,day);
+		cdr_fd=cdr_open(dir,day,"cdr",CDR_HDRLEN,sizeof(struct cdr_record),&cdr_nrec);
+		cdr_ssifd=cdr_open(dir,day,"ssi",0,sizeof(struct cdr_ssi),NULL);
+		strcpy(cdr_day,day);
+		if ((cdr_fd==-1)||(cdr_ssifd==-1)) cdr_day[0]=0;
+	}
+	if (!cdr_day[0]) return;
+	if (write(cdr_fd,c,sizeof(struct cdr_record))!=sizeof(struct cdr_record)) return;
+	for (i=0;i<c->nssi;i++) {
+		ix[i].ssi=c->ssi[i];
+		ix[i].rec=cdr_nrec;
+	}
+	cdr_nrec++;
+	if (c->nssi) write(cdr_ssifd,ix,c->nssi*sizeof(struct cdr_ssi));
 }
 
-/* check if any SSIs for this usage identifier match the filter expression */
-int matchidx(int idx)
+void *rec_worker(void *arg)
 {
-	int i;
-	int j=0;
-	if (!use_filter) return (1);
-	for(i=0;i<3;i++) {
-		if (matchssi(ssis[idx].ssi[i])) { 
-			j=1; 
-			break; 
+	struct job *j;
+	struct recwriter *w;
+
+	while(1) {
+		j=jq_get(&recq);
+		switch(j->type) {
+			case JOB_REC_WRITE:
+				w=rec_getwriter(j->path,1);
+				if ((!w)||(rec_append(w,j->data,j->len))) stats_add(&rec_failed,1);
+				break;
+			case JOB_REC_CLOSE:
+				w=rec_getwriter(j->path,0);
+				if ((!w)&&(!access(j->path,F_OK))) w=rec_getwriter(j->path,1);
+				if (w) {
+					rec_finish(w);
+					rec_closewriter(w);
+				}
+				if ((!rename(j->path,j->path2))&&(transcode_workers)) {
+					/* the recording is finished, hand it over for transcoding */
+					jq_put(&tcq,job_new(JOB_TRANSCODE,j->path2,NULL,NULL,0),1);
+				}
+				break;
+			case JOB_CDR:
+				cdr_write(j->path,(struct cdr_record *)j->data);
+				break;
+			case JOB_STOP:
+				job_free(j);
+				return(NULL);
 		}
+		job_free(j);
 	}
-	if (use_filter==-1) j=!j;
-	return(j);
+	return(NULL);
 }
 
-/* locking functions */
-int trylock() {
-	int i;
-	if (!lockfd) return(1);
-	i=flock(lockfd,LOCK_EX|LOCK_NB);
-	if (!i) { locked=1; updopis(); return(1); }
-	return(0);
+void init_rec_worker()
+{
+	recwriters=calloc(rec_maxopen,sizeof(struct recwriter));
+	jq_init(&recq,rec_queue_max);
+	pthread_create(&rec_thread,NULL,rec_worker,NULL);
 }
 
-void releaselock() {
-	int i=locked;
-	locked=0;
-	if (i) updopis();
-	if (!lockfd) return;
-	flock(lockfd,LOCK_UN);
+/* 
+ * transcoding threads: this does what tetrad does, but right after the 
+ * recording is finished, and with transcode_workers files at a time. 
+ * the recording is piped through the decoders into an ogg file in a 
+ * per-day directory in transcode_dir, without intermediate files. 
+ * don't run tetrad on the same directory when this is enabled
+ */
+pthread_t tc_threads[MAXTRANSCODERS];
+unsigned long tc_failed=0; /* recordings that couldn't be transcoded, left in place */
+unsigned long tc_failed_shown=0;
+
+/* run transcode_cmd with $1=in $2=out, returns 1 if it went well */
+int tc_run(char *in,char *out)
+{
+	char *argv[]={ "sh","-c",transcode_cmd,"sh",in,out,NULL };
+	extern char **environ;
+	posix_spawnattr_t attr;
+	sigset_t sigs;
+	pid_t pid;
+	int status;
+	int r;
+
+	/* SIGPIPE is ignored by us, but the pipeline needs it */
+	sigemptyset(&sigs);
+	sigaddset(&sigs,SIGPIPE);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigdefault(&attr,&sigs);
+	posix_spawnattr_setflags(&attr,POSIX_SPAWN_SETSIGDEF);
+	r=posix_spawn(&pid,"/bin/sh",NULL,&attr,argv,environ);
+	posix_spawnattr_destroy(&attr);
+	if (r) return(0);
+	while ((waitpid(pid,&status,0)==-1)&&(errno==EINTR));
+	return((WIFEXITED(status))&&(WEXITSTATUS(status)==0));
 }
 
-/* receiver table functions */
-void update_receivers(int rx,int afc,uint32_t freq)
+/* where the ogg file for a finished recording goes, into daydir and out */
+void tc_outpath(char *path,char *daydir,char *out)
 {
-	struct receiver *ptr=receivers;
-	struct receiver *prevptr;
+	char *base;
+	char *c;
 
-	/* do we know this rx? */
-	while(ptr)
-	{
-		if (ptr->rxid==rx) break;
-		prevptr=ptr;
-		ptr=ptr->next;
+	base=strrchr(path,'/');
+	base=base?base+1:path;
+	/* traffic_YYYYMMDD_HHMMSS_... */
+	snprintf(daydir,BUFLEN,"%s/%.8s",transcode_dir,base+strlen("traffic_"));
+	snprintf(out,BUFLEN,"%s/%s",daydir,base);
+	c=strrchr(out,'.');
+	if (c) *c=0;
+	strncat(out,".ogg",BUFLEN-strlen(out)-1);
+}
+
+void transcode(char *path)
+{
+	char daydir[BUFLEN];
+	char out[BUFLEN];
+	char tmp[BUFLEN];
+
+	tc_outpath(path,daydir,out);
+	mkdir(transcode_dir,0755);
+	mkdir(daydir,0755);
+	snprintf(tmp,sizeof(tmp),"%s.part",out);
+
+	if ((tc_run(path,tmp))&&(!rename(tmp,out))) {
+		unlink(path);
+	} else {
+		unlink(tmp);
+		__atomic_add_fetch(&tc_failed,1,__ATOMIC_RELAXED);
 	}
-	/* nope, new one */
-	if (!ptr) {
-		ptr=calloc(1,sizeof(struct receiver));
-		if (!receivers) {
+}
 
-			receivers=ptr;
-		} else {
-			prevptr->next=ptr;
-			ptr->prev=prevptr;
-		}
-		ptr->rxid=rx;
+void *tc_worker(void *arg)
+{
+	struct job *j;
+
+	while(1) {
+		j=jq_get(&tcq);
+		transcode(j->path);
+		job_free(j);
 	}
-	ptr->afc=afc;
-	if (freq)	ptr->freq=freq;
-	ptr->lastseen=time(0);
+	return(NULL);
+}
+
+void init_transcoders()
+{
+	int i;
+	jq_init(&tcq,0);
+	for (i=0;i<transcode_workers;i++) pthread_create(&tc_threads[i],NULL,tc_worker,NULL);
 }
 
-/* time out old receivers */
-void timeout_receivers() {
-	struct receiver *ptr=receivers;
-	struct receiver *prevptr,*nextptr;
-	if (!ptr) return;
+/* 
+ * log thread: keeps the log files open and writes the lines queued by 
+ * appendlog() in batches. how hard we try to get them on the disk 
+ * depends on log_sync
+ */
+#define JOB_LOG 3
+#define JOB_CAPTURE 6 /* a buffer of capture records, written just like log lines */
+#define MAXLOGFILES (MAXNETS+1) /* the log files and the capture file */
+
+struct logwriter {
+	char *path;
+	FILE *f;
+	int dirty;
+};
 
-	time_t timenow=time(0);
+struct jobqueue logq;
+pthread_t log_thread;
+struct logwriter logwriters[MAXLOGFILES];
+unsigned long log_dropped_shown=0;
 
-	while(ptr) {
-		if ((timenow-ptr->lastseen)>receiver_timeout) 
-		{
-			prevptr=ptr->prev;
-			nextptr=ptr->next;
-			free(ptr);
-			if (prevptr) {
-				prevptr->next=nextptr;
-				if (nextptr) nextptr->prev=prevptr;
-			} else {
-				receivers=nextptr;
-				if (nextptr) nextptr->prev=NULL;
+FILE *log_getfile(char *path)
+{
+	int i;
+	for (i=0;i<MAXLOGFILES;i++) {
+		if (!logwriters[i].path) {
+			logwriters[i].f=fopen(path,"ab");
+			if (!logwriters[i].f) return(NULL);
+			logwriters[i].path=strdup(path);
+		}
+		if (!strcmp(logwriters[i].path,path)) {
+			logwriters[i].dirty=1;
+			return(logwriters[i].f);
+		}
+	}
+	return(NULL);
+}
+
+void log_sync_files(int how)
+{
+	int i;
+	for (i=0;i<MAXLOGFILES;i++) {
+		if ((!logwriters[i].path)||(!logwriters[i].dirty)) continue;
+		fflush(logwriters[i].f);
+		if (how>1) fdatasync(fileno(logwriters[i].f));
+		logwriters[i].dirty=0;
+	}
+}
+
+void *log_worker(void *arg)
+{
+	struct job *j;
+	FILE *f;
+	time_t lastsync=0;
+	time_t t;
+
+	while(1) {
+		/* wait for the first line, then take everything that is queued */
+		j=jq_get_timeout(&logq,1000);
+		while(j) {
+			if (j->type==JOB_STOP) {
+				job_free(j);
+				log_sync_files(log_sync?log_sync:1);
+				return(NULL);
+			}
+			f=log_getfile(j->path);
+			if ((f)&&(fwrite(j->data,1,j->len,f)==j->len)) {
+				if (j->type==JOB_CAPTURE) {
+					stats_add(&stats_capture_bytes,j->len);
+				} else {
+					stats_add(&stats_log_lines,1);
+				}
 			}
+			job_free(j);
+			j=jq_get_timeout(&logq,0);
+		}
+		t=time(0);
+		if (log_sync) {
+			log_sync_files(log_sync);
+		} else if (t!=lastsync) {
+			log_sync_files(1);
+			lastsync=t;
 		}
-		ptr=ptr->next;
 	}
+	return(NULL);
 }
 
-/* clear all known receivers */
-void clear_all_receivers() {
-	struct receiver *ptr=receivers;
-	struct receiver *ptr2;
+void init_log_worker()
+{
+	jq_init(&logq,log_queue_max);
+	pthread_create(&log_thread,NULL,log_worker,NULL);
+}
 
-	while(ptr) {
-		ptr2=ptr;
-		ptr=ptr->next;
-		free(ptr2);
+/* queue a line for the log, never blocks */
+void appendlog(char *msg) {
+	int len=strlen(msg);
+	unsigned char *line=malloc(len+1);
+	memcpy(line,msg,len);
+	line[len]='\n';
+	jq_put(&logq,job_new(JOB_LOG,net->logfile,NULL,line,len+1),0);
+}
 
-	}
-	receivers=0;
+unsigned long log_dropped()
+{
+	unsigned long d;
+	pthread_mutex_lock(&logq.mutex);
+	d=logq.dropped;
+	pthread_mutex_unlock(&logq.mutex);
+	return(d);
 }
 
+/* 
+ * capture: every received datagram is stored in capture_file with the 
+ * time when it was received (the format is in telive.h), so that a busy 
+ * evening can be replayed later with tetmon_replay. the records are 
+ * collected in a buffer which goes to the log thread when it is full, 
+ * and once a second
+ */
+#define CAPTURE_BUFLEN 65536
+
+char *capture_file=NULL;
+unsigned char *capture_buf=NULL;
+int capture_len=0;
+int capture_nrec=0;
+unsigned long capture_dropped=0; /* datagrams lost because the log queue was full, or without memory */
 
-/* frequency table functions */
-#define REASON_NETINFO 1<<0
-#define REASON_FREQINFO 1<<1
-#define REASON_DLFREQ 1<<2
-/* insert frequency into the freq table */
-insert_freq(int reason,uint16_t mnc,uint16_t mcc,uint32_t ulf,uint32_t dlf,uint16_t la, int rx)
+void capture_flush()
 {
+	if (!capture_len) return;
+	if (!jq_put(&logq,job_new(JOB_CAPTURE,capture_file,NULL,capture_buf,capture_len),0)) capture_dropped+=capture_nrec;
+	capture_buf=malloc(CAPTURE_BUFLEN);
+	capture_len=0;
+	capture_nrec=0;
+}
 
-	struct freqinfo *ptr=frequencies;
-	struct freqinfo *prevptr=NULL;
-	char *c;
+void capture_datagram(unsigned char *buf,int len,struct timespec *ts)
+{
+	unsigned long long t=ts->tv_sec*1000000000ULL+ts->tv_nsec;
+	unsigned char *c;
+	int i;
 
-	/* maybe we already know the uplink or downlink frequency */
-	while(ptr) {
-		if ((ulf)&&(ulf==ptr->ul_freq)) break;
-		if ((dlf)&&(dlf==ptr->dl_freq)) break;
-		prevptr=ptr;
-		ptr=ptr->next;
+	if (capture_len+CAP_RECHDRLEN+len>CAPTURE_BUFLEN) capture_flush();
+	/* there was no memory for a new buffer, try again */
+	if (!capture_buf) capture_buf=malloc(CAPTURE_BUFLEN);
+	if (!capture_buf) {
+		capture_dropped++;
+		return;
 	}
+	c=capture_buf+capture_len;
+	for (i=0;i<8;i++) c[i]=t>>(56-i*8);
+	c[8]=len>>8;
+	c[9]=len&0xff;
+	c[10]=net->id;
+	c[11]=0;
+	memcpy(c+CAP_RECHDRLEN,buf,len);
+	capture_len+=CAP_RECHDRLEN+len;
+	capture_nrec++;
+}
 
-	if (!ptr) {
-		ptr=calloc(1,sizeof(struct freqinfo));
-		if (!frequencies) frequencies=ptr;
-		if (prevptr) { 
-			ptr->prev=prevptr; 
-			prevptr->next=ptr; 
-		}
-	} else {
-
-	}	
-	if ((verbose)&&(reason!=REASON_NETINFO)) {
-		wprintw(statuswin,"Down:%3.4fMHz Up:%3.4fMHz LA:%i MCC:%i MNC:%i reason:%i RX:%i\n",dlf/1000000.0,ulf/1000000.0,la,mcc,mnc,reason,rx);
-		wrefresh(statuswin);
+/* write the header if the capture file is new, we append to an old one */
+void init_capture()
+{
+	unsigned char hdr[CAP_HDRLEN]={ 'T','L','C','A','P',CAP_VERSION,0,0 };
+	struct stat st;
+	int fd;
+
+	if (!capture_file) return;
+	fd=open(capture_file,O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC,0644);
+	if ((fd==-1)||(fstat(fd,&st))) {
+		status_printf("can't open capture file %s: %s\n",capture_file,strerror(errno));
+		if (fd!=-1) close(fd);
+		capture_file=NULL;
+		return;
 	}
-	ptr->last_change=time(0);
-	ptr->ul_freq=ulf;
-	ptr->dl_freq=dlf;
-	ptr->la=la;
-	ptr->mcc=mcc;
-	ptr->mnc=mnc;
-	ptr->reason=ptr->reason|reason;
-	ptr->rx=rx;
-	freq_changed=1;
+	if (st.st_size==0) write(fd,hdr,sizeof(hdr));
+	close(fd);
+	capture_buf=malloc(CAPTURE_BUFLEN);
 }
 
-/* clear the freq table, delete old frequencies */
-void clear_freqtable() {
-	struct freqinfo *ptr=frequencies;
-	struct freqinfo *prevptr,*nextptr;
-	int del;
-	if (!ptr) return;
+/* 
+ * file thread: writes whole files (KML, GeoJSON) prepared by the main 
+ * loop to path2, and renames them to path. when the same file is queued 
+ * several times only the newest version gets written
+ */
+#define JOB_FILE_WRITE 5
 
-	time_t timenow=time(0);
+struct jobqueue fileq;
+pthread_t file_thread;
 
-	while(ptr) {
-		del=0;
-		if ((timenow-ptr->last_change)>freq_timeout) del=1; /* timed out */
-		if ((!ptr->ul_freq)&&(!ptr->dl_freq)) del=1; /* no frequency info */
-		if (del) {
-			prevptr=ptr->prev;
-			nextptr=ptr->next;
-			free(ptr);
-			if (prevptr) {
-				prevptr->next=nextptr;
-				if (nextptr) nextptr->prev=prevptr;
-			} else {
-				frequencies=nextptr;
-				if (nextptr) nextptr->prev=NULL;
+void *file_worker(void *arg)
+{
+	struct job *j,*k;
+	struct job *batch;
+	int fd;
+
+	while(1) {
+		j=jq_get(&fileq);
+		/* take the whole queue */
+		pthread_mutex_lock(&fileq.mutex);
+		j->next=fileq.head;
+		fileq.head=NULL;
+		fileq.tail=NULL;
+		fileq.n=0;
+		pthread_mutex_unlock(&fileq.mutex);
+
+		for (batch=j;batch;batch=k) {
+			k=batch->next;
+			for (j=k;j;j=j->next) if (!strcmp(j->path,batch->path)) break;
+			if (!j) {
+				fd=open(batch->path2,O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,0644);
+				if (fd!=-1) {
+					write(fd,batch->data,batch->len);
+					close(fd);
+					rename(batch->path2,batch->path);
+				}
 			}
-			freq_changed=1;
+			job_free(batch);
 		}
-		ptr=ptr->next;
 	}
+	return(NULL);
 }
 
-/* delete the whole frequency table */
-void clear_all_freqtable() {
-	struct freqinfo *ptr=frequencies;
-	struct freqinfo *nextptr;
+void init_file_worker()
+{
+	jq_init(&fileq,0);
+	pthread_create(&file_thread,NULL,file_worker,NULL);
+}
 
-	while(ptr) {
-		nextptr=ptr->next;
+
+
+void clearopisy(struct opisy *ptr)
+{
+	struct opisy *ptr2;
+
+	while(ptr)
+	{
+		ptr2=ptr->next;
+		free((void *)ptr->opis);
 		free(ptr);
-		ptr=nextptr;
+		ptr=ptr2;
 	}
-	frequencies=NULL;
 }
 
-void display_freq() {
-	char tmpstr2[64];
-	char tmpstr[256];
-	struct freqinfo *ptr=frequencies;
-	struct receiver *rptr=receivers;
-	wclear(freqwin);
-	wprintw(freqwin,"\n***  Known frequencies:  ***\n");
-	while(ptr) {
-		tmpstr[0]=0;
-		if (ptr->dl_freq) {
-			sprintf(tmpstr2,"Downlink:%3.4fMHz\t",ptr->dl_freq/1000000.0);
-			strcat(tmpstr,tmpstr2);
-		}  else {
-			strcat(tmpstr,"                    \t");
-		}
+/* read a SSI description file, returns a new list (or NULL) */
+struct opisy *load_opisy(char *file)
+{
+	FILE *g;
+	char str[100];
+	struct opisy *ptr,*prevptr,*head;
+	char *c;
 
-		if (ptr->ul_freq) {
-			sprintf(tmpstr2,"Uplink:%3.4fMHz\t",ptr->ul_freq/1000000.0);
-			strcat(tmpstr,tmpstr2);
-		} else {
-			strcat(tmpstr,"                  \t");
+	prevptr=NULL;
+	head=NULL;
+	g=fopen(file,"r");
+	if (!g) return(NULL);
+	str[sizeof(str)-1]=0;
+	while(!feof(g))
+	{
+		if (!fgets(str,sizeof(str)-1,g)) break;
+		c=strchr(str,' ');
+		if (c==NULL) continue;
+		*c=0;
+		c++;
+		c[strcspn(c,"\r\n")]=0;
+		ptr=calloc(1,sizeof(struct opisy));
+		if (prevptr) {
+			prevptr->next=ptr;
+			ptr->prev=prevptr;
+		} else
+		{
+			head=ptr;
 		}
+		ptr->ssi=atoi(str);
+		ptr->opis=strdup(c);
+		prevptr=ptr;
+	}
+	fclose(g);
+	return(head);
+}
 
-		if (ptr->mcc) {
-			sprintf(tmpstr2,"MCC:%5i\t",ptr->mcc);
-			strcat(tmpstr,tmpstr2);
-		} else {
-			strcat(tmpstr,"         \t");
-		}
+char *basename_of(char *file)
+{
+	char *c=strrchr(file,'/');
+	return(c?c+1:file);
+}
 
+/* 
+ * the SSI filter is compiled once, when it is set. the alternatives which 
+ * are made only of digits, ?, [...] and ranges like 1000-1999 (an 
+ * extension, a - outside of [] never matches an SSI) are expanded into a 
+ * bitmap over the 24 bit SSI space, so that checking an SSI against a 
+ * watchlist of thousands of entries is a single bit test. the rest (*, 
+ * nested extended patterns) is left to fnmatch(). matchidx() also caches 
+ * the result for every usage identifier until its SSIs or the filter change
+ */
+#define SSI_BITS 24
+#define MAXSSIDIGITS 8 /* 2^24 has 8 digits */
+
+struct ssi_matcher {
+	int n; /* alternatives */
+	unsigned char *bitmap; /* 1<<SSI_BITS bits, NULL if nothing could be expanded */
+	char **slow; /* the alternatives left to fnmatch() */
+	int nslow;
+	char *text; /* what is shown on the top line */
+};
 
-		if (ptr->mnc) {
-			sprintf(tmpstr2,"MNC:%5i\t",ptr->mnc);
-			strcat(tmpstr,tmpstr2);
-		} else {
-			strcat(tmpstr,"         \t");
-		}
+struct ssi_matcher *compiled_filter=NULL;
+unsigned int filter_gen=1; /* changed with the filter, struct usi caches the match for one generation */
 
+void free_filter(struct ssi_matcher *f)
+{
+	int i;
 
-		if (ptr->la) {
-			sprintf(tmpstr2,"LA:%5i\t",ptr->la);
-			strcat(tmpstr,tmpstr2);
+	if (!f) return;
+	for (i=0;i<f->nslow;i++) free(f->slow[i]);
+	free(f->slow);
+	free(f->bitmap);
+	free(f->text);
+	free(f);
+}
+
+/* the digits allowed at one position of a pattern as a bit mask, -1 if it is something else */
+int filter_digits(char **p)
+{
+	char *c=*p;
+	int mask=0;
+	int neg=0;
+	int a;
+
+	if ((*c>='0')&&(*c<='9')) { *p=c+1; return(1<<(*c-'0')); }
+	if (*c=='?') { *p=c+1; return(0x3ff); }
+	if (*c!='[') return(-1);
+	c++;
+	if ((*c=='!')||(*c=='^')) { neg=1; c++; }
+	if (*c==']') c++; /* a ] first is a plain character */
+	while(*c!=']') {
+		if ((!*c)||(*c=='[')||(*c=='\\')) return(-1); /* [:digit:] and escapes are left to fnmatch() */
+		if ((c[1]=='-')&&(c[2])&&(c[2]!=']')) {
+			for (a=c[0];a<=c[2];a++) if ((a>='0')&&(a<='9')) mask|=1<<(a-'0');
+			c+=3;
 		} else {
-			strcat(tmpstr,"        \t");
+			if ((*c>='0')&&(*c<='9')) mask|=1<<(*c-'0');
+			c++;
 		}
-
-		strcat(tmpstr,"reason:[");
-		if (ptr->reason&REASON_NETINFO) strcat(tmpstr,"S");
-		if (ptr->reason&REASON_FREQINFO) strcat(tmpstr,"N");
-		if (ptr->reason&REASON_DLFREQ) strcat(tmpstr,"A");
-		strcat(tmpstr,"]\t");
-		sprintf(tmpstr2,"RX:%i",ptr->rx);
-		strcat(tmpstr,tmpstr2);
-		wprintw(freqwin,"%s\n",tmpstr);
-		ptr=ptr->next;
 	}
+	*p=c+1;
+	if (neg) mask=~mask&0x3ff;
+	return(mask);
+}
 
-	wprintw(freqwin,"\n\n***    Receiver info:    ***\n\n");
-	wprintw(freqwin,"RX:\tAFC:\t\t\t\tFREQUENCY\n");
-
-	while(rptr) {
+static inline void filter_set(struct ssi_matcher *f,unsigned int ssi)
+{
+	/* only filters with numeric alternatives pay for the bitmap */
+	if (!f->bitmap) f->bitmap=calloc(1,(1<<SSI_BITS)/8);
+	f->bitmap[ssi>>3]|=1<<(ssi&7);
+}
 
-		char buf[24]="[..........:..........]";
-		int i;
-		i=(11+rptr->afc/10);
-		if (i<2) { buf[2]='<'; } 
-		else  if (i>21) { buf[21]='>'; } else { buf[i]='|';  }
+/* set all numbers with len digits allowed by masks, as printed with %i (no leading zeros) */
+void filter_expand(struct ssi_matcher *f,int *masks,int len,int pos,unsigned int val)
+{
+	static const unsigned int pow10[MAXSSIDIGITS]={1,10,100,1000,10000,100000,1000000,10000000};
+	int d;
 
-		sprintf(tmpstr,"%i\t%+3.3i %s",rptr->rxid,rptr->afc,buf);
-		if (rptr->freq) {
-			sprintf(tmpstr2,"%3.4fMHz",rptr->freq/1000000.0);
-			strcat(tmpstr,tmpstr2);
-		} 
-		wprintw(freqwin,"%s\n",tmpstr);
-		rptr=rptr->next;
+	if (pos==len) {
+		filter_set(f,val);
+		return;
+	}
+	for (d=((pos==0)&&(len>1));d<10;d++) {
+		if (!(masks[pos]&(1<<d))) continue;
+		if ((val*10+d)*pow10[len-pos-1]>=(1<<SSI_BITS)) break;
+		filter_expand(f,masks,len,pos+1,val*10+d);
 	}
-
-
-	wattron(freqwin,A_BOLD);
-	wmove(freqwin,1,170);
-	wprintw(freqwin,"reasons: N:D-NWRK-BROADCAST");
-	wmove(freqwin,2,170);
-	wprintw(freqwin,"S:SYSINFO A:ChanAlloc");
-	wattroff(freqwin,A_BOLD);
-
-	ref=1;
-	freq_changed=0;
 }
 
-/* find an usage identifier with live audio so that we can play it */
-int findtoplay(int first)
+/* expand one alternative into the bitmap, 0 if it needs fnmatch() */
+int filter_numeric(struct ssi_matcher *f,char *alt)
 {
-	int i;
-	if (curplayingidx) return(0);
-	releaselock();
+	int masks[MAXSSIDIGITS];
+	int len=0;
+	int m;
+	unsigned long a,b;
+	char *c;
 
-	for (i=first;i<MAXUS;i++) {
-		if ((ssis[i].active)&&(!ssis[i].encr)&&(matchidx(i)&&(trylock()))) {
-			curplayingidx=i;
-			if (verbose>0) wprintw(statuswin,"NOW PLAYING %i\n",i);
-			ref=1;
+	if ((*alt>='0')&&(*alt<='9')) {
+		a=strtoul(alt,&c,10);
+		if ((*c=='-')&&(c[1]>='0')&&(c[1]<='9')) {
+			b=strtoul(c+1,&c,10);
+			if (*c) return(0);
+			if (b>=(1<<SSI_BITS)) b=(1<<SSI_BITS)-1;
+			for (;a<=b;a++) filter_set(f,a);
 			return(1);
 		}
 	}
-	for (i=0;i<first;i++) {
-		if ((ssis[i].active)&&(!ssis[i].encr)&&(matchidx(i)&&(trylock()))) {
-			curplayingidx=i;
-			if (verbose>0) wprintw(statuswin,"NOW PLAYING %i\n",i);
-			ref=1;
-			return(1);
-		}
+	c=alt;
+	while(*c) {
+		m=filter_digits(&c);
+		if (m==-1) return(0);
+		if (len==MAXSSIDIGITS) len++; /* too long for any SSI, matches nothing */
+		if (len>MAXSSIDIGITS) continue;
+		masks[len++]=m;
 	}
-	curplayingidx=0;
-	return(0); 
+	if ((len)&&(len<=MAXSSIDIGITS)) filter_expand(f,masks,len,0,0);
+	return(1);
 }
 
-void timeout_ssis(time_t t)
+/* add one alternative of len characters */
+void filter_add(struct ssi_matcher *f,char *alt,int len)
 {
-	int i,j;
-	for (i=0;i<MAXUS;i++) {
-		for (j=0;j<3;j++) {
-			if ((ssis[i].ssi[j])&&(ssis[i].ssi_time[j]+ssi_timeout<t)) {
-				ssis[i].ssi[j]=0;
-				ssis[i].ssi_time[j]=0;
-				updidx(i);
-				ref=1;
-			}
+	char *a=strndup(alt,len);
 
-		}
-		/* move the array elements so that the indexes start at 0 */
-		for (j=0;j<2;j++) {
-			if (!ssis[i].ssi[j]) {
-				ssis[i].ssi[j]=ssis[i].ssi[j+1];
-				ssis[i].ssi_time[j]=ssis[i].ssi_time[j+1];
-				ssis[i].ssi[j+1]=0;
-				ssis[i].ssi_time[j+1]=0;
+	f->n++;
+	if (filter_numeric(f,a)) {
+		free(a);
+		return;
+	}
+	if (!(f->nslow&(f->nslow-1))) f->slow=realloc(f->slow,sizeof(char *)*(f->nslow?f->nslow*2:1));
+	f->slow[f->nslow++]=a;
+}
+
+/* 
+ * compile a filter expression, +(a|b|...) and @(a|b|...) are split into 
+ * their alternatives. returns NULL for an empty expression (everything 
+ * matches)
+ */
+struct ssi_matcher *compile_filter(char *expr)
+{
+	struct ssi_matcher *f;
+	char *c,*start;
+	int len=strlen(expr);
+	int depth=0;
+
+	if (!len) return(NULL);
+	f=calloc(1,sizeof(struct ssi_matcher));
+	f->text=strdup(expr);
+#ifdef FNM_EXTMATCH
+	if ((len>3)&&((expr[0]=='+')||(expr[0]=='@'))&&(expr[1]=='(')&&(expr[len-1]==')')) {
+		start=expr+2;
+		for (c=start;c<expr+len;c++) {
+			if (*c=='[') {
+				/* a class can contain | and ) */
+				if ((c[1]=='!')||(c[1]=='^')) c++;
+				if (c[1]==']') c++;
+				while((c[1])&&(c[1]!=']')) c++;
+				if (c[1]) c++;
+			} else if (*c=='(') {
+				depth++;
+			} else if ((*c==')')&&(depth)) {
+				depth--;
+			} else if ((*c==')')&&(c!=expr+len-1)) {
+				depth=-1;
+				break;
+			} else if (((*c=='|')||(*c==')'))&&(!depth)) {
+				filter_add(f,start,c-start);
+				start=c+1;
 			}
 		}
+		/* the parentheses didn't match up after all */
+		if ((depth)||(start!=expr+len)) {
+			free_filter(f);
+			f=calloc(1,sizeof(struct ssi_matcher));
+			f->text=strdup(expr);
+			filter_add(f,expr,len);
+		}
+		return(f);
 	}
+#endif
+	filter_add(f,expr,len);
+	return(f);
 }
 
-void timeout_idx(time_t t)
+/* 
+ * read a filter file: every line that is not empty and doesn't start 
+ * with # is one alternative. there is no limit on the number of lines 
+ */
+struct ssi_matcher *load_filter(char *file)
 {
-	int i;
-	for (i=0;i<MAXUS;i++) {
-		if ((ssis[i].active)&&(ssis[i].timeout+idx_timeout<t)) {
-			ssis[i].active=0;
-			ssis[i].play=0;
-			updidx(i);
-			ref=1;
+	FILE *g;
+	struct ssi_matcher *f;
+	char str[BUFLEN];
+	char text[BUFLEN];
+	char *c;
+	int len=3;
+
+	g=fopen(file,"r");
+	if (!g) return(NULL);
+	f=calloc(1,sizeof(struct ssi_matcher));
+	strcpy(text,"+(");
+	while(fgets(str,sizeof(str),g))
+	{
+		str[strcspn(str,"\r\n")]=0;
+		c=str;
+		while(*c==' ') c++;
+		if ((*c==0)||(*c=='#')) continue;
+		c[strcspn(c," \t")]=0;
+		if (len+strlen(c)+1<BUFLEN) {
+			if (f->n) strcat(text,"|");
+			strcat(text,c);
 		}
+		len+=strlen(c)+1;
+		filter_add(f,c,strlen(c));
+	}
+	fclose(g);
+	if (len>=BUFLEN) {
+		snprintf(text,sizeof(text),"%s: %i entries",basename_of(file),f->n);
+	} else if (f->n==1) {
+		memmove(text,text+2,strlen(text+2)+1);
+	} else {
+		strcat(text,")");
 	}
+	if (!f->n) text[0]=0;
+	f->text=strdup(text);
+	return(f);
+}
+
+/* check if an SSI matches a compiled filter */
+int matchpattern(char *pattern,int ssi);
+int filter_match(struct ssi_matcher *f,unsigned int ssi)
+{
+	int i;
 
+	if ((ssi<(1<<SSI_BITS))&&(f->bitmap)&&(f->bitmap[ssi>>3]&(1<<(ssi&7)))) return(1);
+	for (i=0;i<f->nslow;i++) if (matchpattern(f->slow[i],ssi)) return(1);
+	return(0);
 }
 
-void timeout_curplaying(time_t t)
+/* install a new filter, NULL (or one without alternatives) matches everything */
+void set_filter(struct ssi_matcher *f)
 {
-	if ((curplayingidx)&&(curplayingtime+curplaying_timeout<t)) {
-		//wprintw(statuswin,"STOP PLAYING %i\n",curplayingidx);
-		ssis[curplayingidx].active=0;
-		ssis[curplayingidx].play=0;
-		updidx(curplayingidx);
-		ref=1;
-		/* find another to play */
-		curplayingidx=0;
-		findtoplay(curplayingidx);
+	free_filter(compiled_filter);
+	if ((f)&&(!f->n)) {
+		free_filter(f);
+		f=NULL;
 	}
+	compiled_filter=f;
+	strncpy(ssi_filter,f?f->text:"",sizeof(ssi_filter)-1);
+	if (!++filter_gen) filter_gen=1;
 }
 
-/* timing out the recording */
-void timeout_rec(time_t t)
+/* 
+ * reloading of the SSI descriptions and the filter file is done in a 
+ * separate thread, so that saving the file never stalls voice ingest. 
+ * the new data is handed over via an atomic pointer swap and installed 
+ * by the main loop in install_reloaded(). changes are noticed with 
+ * inotify, if that doesn't work then the files are stat()ed once a second 
+ */
+#define RELOAD_OPIS (1<<0)
+#define RELOAD_FILTER (1<<1)
+pthread_t reload_thread;
+pthread_mutex_t reload_mutex=PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t reload_cond=PTHREAD_COND_INITIALIZER;
+int reload_request=0; /* RELOAD_* flags, protected by reload_mutex */
+struct opisy *opis_pending=NULL; /* new descriptions waiting for install_reloaded() */
+struct ssi_matcher *filter_pending=NULL; /* new filter waiting for install_reloaded() */
+int reload_evfd=-1; /* eventfd to wake up the main loop */
+int inotify_fd=-1;
+char *filterfile=NULL;
+time_t ostopis=0;
+time_t ostfilter=0;
+
+void *reload_worker(void *arg)
 {
-	char tmpfile[256];
-	int i;
-	for (i=0;i<MAXUS;i++) {
-		if ((strlen(ssis[i].curfile))&&(ssis[i].ssi_time_rec+rec_timeout<t)) {
-			snprintf(tmpfile,sizeof(tmpfile),"%s/traffic_%s_%i_%i_%i_%i.out",outdir,ssis[i].curfiletime,i,ssis[i].ssi[0],ssis[i].ssi[1],ssis[i].ssi[2]);
-			rename(ssis[i].curfile,tmpfile);
-			ssis[i].curfile[0]=0;
-			ssis[i].active=0;
-			updidx(i);
-			if(verbose>1) wprintw(statuswin,"timeout rec %s\n",tmpfile);
-			ref=1;
+	int req;
+	struct opisy *newopis;
+	struct ssi_matcher *newfilter;
+	uint64_t one=1;
+
+	while(1) {
+		pthread_mutex_lock(&reload_mutex);
+		while(!reload_request) pthread_cond_wait(&reload_cond,&reload_mutex);
+		req=reload_request;
+		reload_request=0;
+		pthread_mutex_unlock(&reload_mutex);
+
+		if (req&RELOAD_OPIS) {
+			newopis=load_opisy(ssifile);
+			/* if the previous one wasn't picked up yet, nobody has seen it, so free it */
+			clearopisy(__atomic_exchange_n(&opis_pending,newopis,__ATOMIC_ACQ_REL));
+		}
+		if ((req&RELOAD_FILTER)&&(filterfile)) {
+			newfilter=load_filter(filterfile);
+			if (newfilter) free_filter(__atomic_exchange_n(&filter_pending,newfilter,__ATOMIC_ACQ_REL));
 		}
+		if (reload_evfd!=-1) write(reload_evfd,&one,sizeof(one));
 	}
+	return(NULL);
 }
 
-void refresh_scr()
+void request_reload(int what)
 {
-	ref=0;
-	wrefresh(titlewin);
-	wrefresh(displayedwin);
-	wrefresh(statuswin);
-	wrefresh(msgwin);
+	pthread_mutex_lock(&reload_mutex);
+	reload_request|=what;
+	pthread_cond_signal(&reload_cond);
+	pthread_mutex_unlock(&reload_mutex);
 }
 
-/* reopen a pipe to tplay */
-void do_popen() {
-	if (playingfp) pclose(playingfp);
-	playingfp=popen("tplay >/dev/null 2>&1","w");
-	if (!playingfp) {
-		wprintw(statuswin,"PLAYBACK PROBLEM!! (fix tplay)\n");
-		playingfp=NULL;
-		curplayingidx=0;
+/* watch the directory, so that we also see editors which write a new file and rename it */
+void watch_file(char *file)
+{
+	char *dir,*c;
+
+	if ((inotify_fd==-1)||(!file)) return;
+	dir=strdup(file);
+	c=strrchr(dir,'/');
+	if (c) {
+		if (c==dir) c++;
+		*c=0;
+	} else {
+		strcpy(dir,".");
 	}
+	if (inotify_add_watch(inotify_fd,dir,IN_CLOSE_WRITE|IN_MOVED_TO|IN_CREATE|IN_DELETE)==-1) {
+		close(inotify_fd);
+		inotify_fd=-1;
+	}
+	free(dir);
 }
 
+void init_reload()
+{
+	struct stat st;
+
+	opisssi=load_opisy(ssifile);
+	if (!stat(ssifile,&st)) ostopis=st.st_mtime;
+	if (filterfile) {
+		struct ssi_matcher *f=load_filter(filterfile);
+		if (f) set_filter(f);
+		if (!stat(filterfile,&st)) ostfilter=st.st_mtime;
+	}
+
+	reload_evfd=eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+	inotify_fd=inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	watch_file(ssifile);
+	watch_file(filterfile);
+	pthread_create(&reload_thread,NULL,reload_worker,NULL);
+}
 
-void tickf ()
+/* read the inotify events, ask for a reload if our files changed */
+void handle_inotify()
 {
-	time_t t=time(0);
-	if (curplayingidx) {
-		/* crude hack to hack around buffering, i know this should be done better */
-		if (curplayingticks==2) do_popen();
+	char evbuf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	int len;
+	char *p;
+	int what=0;
+
+	while((len=read(inotify_fd,evbuf,sizeof(evbuf)))>0) {
+		for (p=evbuf;p<evbuf+len;p+=sizeof(struct inotify_event)+ev->len) {
+			ev=(struct inotify_event *)p;
+			if (!ev->len) continue;
+			if (!strcmp(ev->name,basename_of(ssifile))) what|=RELOAD_OPIS;
+			if ((filterfile)&&(!strcmp(ev->name,basename_of(filterfile)))) what|=RELOAD_FILTER;
+		}
+	}
+	if (what) request_reload(what);
+}
+
+/* fallback if there is no inotify, called once a second */
+void poll_reload()
+{
+	struct stat st;
+	int what=0;
 
-		curplayingticks++;
+	if (inotify_fd!=-1) return;
+	if ((!stat(ssifile,&st))&&(st.st_mtime!=ostopis)) {
+		ostopis=st.st_mtime;
+		what|=RELOAD_OPIS;
 	}
+	if ((filterfile)&&(!stat(filterfile,&st))&&(st.st_mtime!=ostfilter)) {
+		ostfilter=st.st_mtime;
+		what|=RELOAD_FILTER;
+	}
+	if (what) request_reload(what);
+}
 
-	if ((t-last_1s_event)>0) {
-		/* this gets executed every second */
-		clear_freqtable();
-		timeout_ssis(t);
-		timeout_idx(t);
-		last_1s_event=t;
-		if (displayedwin==freqwin) display_freq();
+void display_mainwin();
+void updopis();
+
+/* install data prepared by reload_worker(), called from the main loop */
+void install_reloaded()
+{
+	struct opisy *newopis;
+	struct ssi_matcher *newfilter;
+	uint64_t cnt;
+
+	if (reload_evfd!=-1) read(reload_evfd,&cnt,sizeof(cnt));
+	newopis=__atomic_exchange_n(&opis_pending,NULL,__ATOMIC_ACQ_REL);
+	if (newopis) {
+		clearopisy(opisssi);
+		opisssi=newopis;
+		loc_gen++; /* the placemarks contain the descriptions */
+		if (verbose>0) status_printf("reloaded SSI descriptions\n");
+		if (display_state==DISPLAY_IDX) display_mainwin();
 	}
-	if ((t-last_10s_event)>9) {
-		/* this gets executed every 10 seconds */
-		timeout_receivers();
-		//if ((freq_changed)&&(displayedwin==freqwin)) display_freq();
-		last_10s_event=t;
+	newfilter=__atomic_exchange_n(&filter_pending,NULL,__ATOMIC_ACQ_REL);
+	if (newfilter) {
+		status_printf("reloaded filter from %s (%i entries)\n",filterfile,newfilter->n);
+		set_filter(newfilter);
+		updopis();
 	}
-	if ((t-last_1min_event)>59) {
-		/* this gets executed every minute */
-		ref=1;
-		last_1min_event=t;
+}
+
+const char nop[2]="-\0";
+char *lookupssi(int ssi)
+{
+	struct opisy *ptr=opisssi;
+
+	while(ptr)
+	{
+		if (ptr->ssi==ssi) return(ptr->opis);
+		ptr=ptr->next;
 	}
+	return((char *)&nop);
+}
 
-	timeout_curplaying(t);
-	timeout_rec(t);
-	if (ref) refresh_scr();
-	if (last_burst) { 
-		if (last_burst==1) {
-			last_burst--; 
-			wprintw(statuswin,"Signal lost\n");
-			updopis(); 
-		} else {
-			last_burst--; 
-		}
+
+static inline unsigned int loc_hashfn(unsigned int ssi)
+{
+	return((ssi*2654435761U)>>22)&(LOC_HASHSIZE-1);
+}
+
+/* unlink a location from the lastseen ordered list */
+void loc_unlink(struct locations *ptr)
+{
+	struct locations *prevptr=ptr->prev;
+	struct locations *nextptr=ptr->next;
+
+	if (prevptr) prevptr->next=nextptr; else net->kml_locations=nextptr;
+	if (nextptr) nextptr->prev=prevptr; else net->kml_locations_last=prevptr;
+	ptr->next=NULL;
+	ptr->prev=NULL;
+}
+
+void loc_append(struct locations *ptr)
+{
+	ptr->prev=net->kml_locations_last;
+	ptr->next=NULL;
+	if (net->kml_locations_last) net->kml_locations_last->next=ptr; else net->kml_locations=ptr;
+	net->kml_locations_last=ptr;
+}
+
+void loc_free(struct locations *ptr)
+{
+	free(ptr->description);
+	free(ptr->kml);
+	free(ptr->geojson);
+	free(ptr);
+}
+
+/* write the location files when kml_interval has passed since the last time */
+void kml_arm()
+{
+	if (!kml_interval) return;
+	timer_arm(&net->kml_timer,sec_tick(max(time(0),net->last_kml_save+kml_interval+1)));
+}
+
+void add_location(int ssi,float lattitude,float longtitude,char *description)
+{
+	struct locations *ptr;
+	unsigned int h=loc_hashfn(ssi);
+	char *c;
+
+	/* maybe we already know this ssi? */
+	for (ptr=net->loc_hash[h];ptr;ptr=ptr->hnext) if (ptr->ssi==ssi) break;
+
+	if (!ptr) {
+		ptr=calloc(1,sizeof(struct locations));
+		ptr->ssi=ssi;
+		ptr->hnext=net->loc_hash[h];
+		net->loc_hash[h]=ptr;
+		net->nlocations++;
+	} else {
+		free(ptr->description);
+		loc_unlink(ptr);
 	}
-	if ((kml_changed)&&(kml_interval)&&((t-last_kml_save)>kml_interval)) dump_kml_file();
+	loc_append(ptr);
 
+	ptr->lastseen=time(0);
+	ptr->lattitude=lattitude;
+	ptr->longtitude=longtitude;
+	ptr->description=strdup(description);
+	c=ptr->description;
+	/* ugly hack so that we don't get <> there, which would break the xml */
+	while(*c) { if (*c=='>') *c='G';  if (*c=='<') *c='L'; c++; } 
+	ptr->gen=loc_gen-1; /* rebuild the cached placemarks */
+	net->kml_changed=1;
+	kml_arm();
+	if (loc_timeout) timer_arm(&net->loc_timer,sec_tick(net->kml_locations->lastseen+loc_timeout+1));
 
 }
 
-void keyf(unsigned char r)
+/* forget the locations which weren't updated for loc_timeout seconds */
+void timeout_locations(time_t t)
 {
-	time_t tp;
-	char tmpstr[40];
-	char tmpstr2[80];
-	switch (r) {
-		case 'l':
-			do_log=!do_log;
-			updopis();
+	struct locations *ptr;
+	struct locations **pp;
+
+	if (!loc_timeout) return;
+	while((ptr=net->kml_locations)&&(ptr->lastseen+loc_timeout<t)) {
+		loc_unlink(ptr);
+		for (pp=&net->loc_hash[loc_hashfn(ptr->ssi)];*pp!=ptr;pp=&(*pp)->hnext);
+		*pp=ptr->hnext;
+		loc_free(ptr);
+		net->nlocations--;
+		net->kml_changed=1;
+		kml_arm();
+	}
+}
 
-			tp=time(0);
-			strftime(tmpstr,sizeof(tmpstr),"%Y%m%d %H:%M:%S",localtime(&tp));
-			if (do_log)
-			{
-				sprintf(tmpstr2,"%s **** log start ****",tmpstr);
-			} else {
+time_t expire_locations(struct wtimer *tm,time_t now)
+{
+	net=tm->ctx;
+	timeout_locations(now/TICKS_PER_SEC);
+	if ((!loc_timeout)||(!net->kml_locations)) return(0);
+	return(sec_tick(net->kml_locations->lastseen+loc_timeout+1));
+}
 
-				sprintf(tmpstr2,"%s **** log end ****",tmpstr);
-			}
-			appendlog(tmpstr2);
+/* copy src to dst as the inside of a JSON string */
+void json_escape(char *dst,int dstlen,char *src)
+{
+	char *end=dst+dstlen-7;
+	while((*src)&&(dst<end)) {
+		if ((*src=='"')||(*src=='\\')) {
+			*dst++='\\';
+			*dst++=*src;
+		} else if ((unsigned char)*src<' ') {
+			dst+=sprintf(dst,"\\u%4.4x",*src);
+		} else {
+			*dst++=*src;
+		}
+		src++;
+	}
+	*dst=0;
+}
+
+/* format the placemarks of one location, unless the cached ones are still good */
+void loc_format(struct locations *ptr)
+{
+	char buf[BUFLEN];
+	char opis[BUFLEN];
+	char desc[BUFLEN];
+	int len;
+
+	if (ptr->gen==loc_gen) return;
+
+	len=snprintf(buf,sizeof(buf),"<Placemark> <name>%i</name> <description>%s %s</description> <Point> <coordinates>%f,%f,0</coordinates></Point></Placemark>\n",ptr->ssi,lookupssi(ptr->ssi),ptr->description,ptr->longtitude,ptr->lattitude);
+	if (len>=sizeof(buf)) len=sizeof(buf)-1;
+	free(ptr->kml);
+	ptr->kml=malloc(len);
+	memcpy(ptr->kml,buf,len);
+	ptr->kmllen=len;
+
+	json_escape(opis,sizeof(opis)/2,lookupssi(ptr->ssi));
+	json_escape(desc,sizeof(desc)/2,ptr->description);
+	len=snprintf(buf,sizeof(buf),"{\"type\":\"Feature\",\"geometry\":{\"type\":\"Point\",\"coordinates\":[%f,%f]},\"properties\":{\"ssi\":%i,\"name\":\"%s\",\"description\":\"%s\",\"lastseen\":%li}}",ptr->longtitude,ptr->lattitude,ptr->ssi,opis,desc,(long)ptr->lastseen);
+	if (len>=sizeof(buf)) len=sizeof(buf)-1;
+	free(ptr->geojson);
+	ptr->geojson=malloc(len);
+	memcpy(ptr->geojson,buf,len);
+	ptr->geojsonlen=len;
+
+	ptr->gen=loc_gen;
+}
+
+/* 
+ * put the KML and GeoJSON files together from the cached placemarks, 
+ * the file thread writes them 
+ */
+void dump_kml_file() {
+	struct locations *ptr;
+	char head[BUFLEN];
+	char tail[]="</Folder></kml>\n";
+	unsigned char *buf;
+	int headlen;
+	int len,kmllen=0,geojsonlen=0;
+	struct timespec t0,t1;
+
+	if (verbose>1) status_printf("called dump_kml_file()\n");
+	if ((!net->kml_tmp_file)&&(!net->geojson_tmp_file)) return;
+	clock_gettime(CLOCK_MONOTONIC,&t0);
+
+	for (ptr=net->kml_locations;ptr;ptr=ptr->next) {
+		loc_format(ptr);
+		kmllen+=ptr->kmllen;
+		geojsonlen+=ptr->geojsonlen+2;
+	}
+
+	if (net->kml_tmp_file) {
+		if (verbose>1) status_printf("dump_kml_file(%s)\n",net->kml_tmp_file);
+		headlen=snprintf(head,sizeof(head),"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<kml xmlns=\"http://www.opengis.net/kml/2.2\">\n<Folder>\n<name>Telive MCC:%5i MNC:%5i ColourCode:%3i Down:%3.4fMHz Up:%3.4fMHz LA:%5i</name>\n<open>1</open>\n",net->netinfo.mcc,net->netinfo.mnc,net->netinfo.colour_code,net->netinfo.dl_freq/1000000.0,net->netinfo.ul_freq/1000000.0,net->netinfo.la);
+		buf=malloc(headlen+kmllen+sizeof(tail));
+		memcpy(buf,head,headlen);
+		len=headlen;
+		for (ptr=net->kml_locations;ptr;ptr=ptr->next) {
+			memcpy(buf+len,ptr->kml,ptr->kmllen);
+			len+=ptr->kmllen;
+		}
+		memcpy(buf+len,tail,sizeof(tail)-1);
+		len+=sizeof(tail)-1;
+		jq_put(&fileq,job_new(JOB_FILE_WRITE,net->kml_file,net->kml_tmp_file,buf,len),1);
+	}
+
+	if (net->geojson_tmp_file) {
+		headlen=snprintf(head,sizeof(head),"{\"type\":\"FeatureCollection\",\"properties\":{\"mcc\":%i,\"mnc\":%i,\"colour_code\":%i,\"dl_freq\":%i,\"ul_freq\":%i,\"la\":%i},\"features\":[\n",net->netinfo.mcc,net->netinfo.mnc,net->netinfo.colour_code,net->netinfo.dl_freq,net->netinfo.ul_freq,net->netinfo.la);
+		buf=malloc(headlen+geojsonlen+4);
+		memcpy(buf,head,headlen);
+		len=headlen;
+		for (ptr=net->kml_locations;ptr;ptr=ptr->next) {
+			memcpy(buf+len,ptr->geojson,ptr->geojsonlen);
+			len+=ptr->geojsonlen;
+			if (ptr->next) buf[len++]=',';
+			buf[len++]='\n';
+		}
+		memcpy(buf+len,"]}\n",3);
+		len+=3;
+		jq_put(&fileq,job_new(JOB_FILE_WRITE,net->geojson_file,net->geojson_tmp_file,buf,len),1);
+	}
+
+	net->last_kml_save=time(0);
+	net->kml_changed=0;
+	clock_gettime(CLOCK_MONOTONIC,&t1);
+	stats_kml_dumps++;
+	hist_add(&stats_kml_time,ts_diff_ns(&t0,&t1));
+}
+
+time_t expire_kml(struct wtimer *tm,time_t now)
+{
+	time_t t=now/TICKS_PER_SEC;
+
+	net=tm->ctx;
+	if (!net->kml_changed) return(0);
+	if ((t-net->last_kml_save)>kml_interval) {
+		dump_kml_file();
+		return(0);
+	}
+	return(sec_tick(net->last_kml_save+kml_interval+1));
+}
+
+/* delete the whole location info */
+void clear_locations() {
+	struct locations *ptr=net->kml_locations;
+	struct locations *nextptr;
+	while(ptr) {
+		nextptr=ptr->next;
+		loc_free(ptr);
+		ptr=nextptr;
+	}
+	net->kml_locations=NULL;
+	net->kml_locations_last=NULL;
+	memset(net->loc_hash,0,sizeof(net->loc_hash));
+	net->nlocations=0;
+}
+
+void refresh_scr();
+
+void diep(char *s)
+{
+	status_printf("DIE: %s\n",s);
+	refresh_scr();
+	sleep(1);
+	perror(s);
+	exit(1);
+}
+#define RR 13
+int getr(int idx) {
+	return((idx%RR)*4);
+}
+
+int getcl(int idx)
+{
+	return ((idx/RR)*40);
+}
+
+/* usage identifier display changed */
+void updidx(int idx) {
+	if ((idx<0)||(idx>=nslots(net))) { status_printf("BUG! updidx(%i)\n",idx); return; }
+	if ((net!=dispnet)||(idx/MAXUS!=dispcell)) return; /* not on the screen now */
+	ui_pending_idx|=1ULL<<(idx%MAXUS);
+	ref=1;
+}
+
+/* refresh the main window */
+void display_mainwin() {
+	ui_pending|=UI_MAIN;
+	ui_pending_idx=~0ULL;
+	ref=1;
+}
+
+/* title line changed */
+void updopis()
+{
+	ui_pending|=UI_TITLE;
+	ref=1;
+}
+
+void format_title(char *netpart,char *rest,int len)
+{
+	int l;
+
+	struct netinfo *ni=&dispnet->netinfo;
+
+	/* with several cells show the one on the screen */
+	if (dispnet->ncells>1) ni=&dispnet->cells[dispcell]->netinfo;
+	snprintf(netpart,len,"MCC:%5i MNC:%5i ColourCode:%3i Down:%3.4fMHz Up:%3.4fMHz LA:%5i %c",ni->mcc,ni->mnc,ni->colour_code,ni->dl_freq/1000000.0,ni->ul_freq/1000000.0,ni->la,dispnet->last_burst?'*':' ');
+	rest[0]=0;
+	if (nnets>1) snprintf(rest,len," NET:%i/%i port:%i",dispnet->id+1,nnets,dispnet->port);
+	l=strlen(rest);
+	if ((dispnet->ncells>1)&&(l<len)) l+=snprintf(rest+l,len-l," RX:%i cell:%i/%i",dispnet->cells[dispcell]->rxid,dispcell+1,dispnet->ncells);
+	l+=snprintf(rest+l,len-l," mutessi:%i alldump:%i mute:%i record:%i log:%i verbose:%i lock:%i",mutessi,alldump,ps_mute,ps_record,do_log,verbose,locked);
+	if ((log_dropped_shown)&&(l<len)) l+=snprintf(rest+l,len-l," logdrop:%lu",log_dropped_shown);
+	if ((tc_failed_shown)&&(l<len)) l+=snprintf(rest+l,len-l," tcfail:%lu",tc_failed_shown);
+	if (l<len) switch(use_filter)
+	{
+		case 0:	l+=snprintf(rest+l,len-l," no filter"); break;
+		case  1:	l+=snprintf(rest+l,len-l," Filter ON"); break;
+		case -1:	l+=snprintf(rest+l,len-l," Inv. Filt"); break;
+	}
+	if (l<len) snprintf(rest+l,len-l," [%s] ",ssi_filter); 
+}
+
+char *format_freq();
+
+/* copy what changed into the snapshot and wake up the screen thread */
+void refresh_scr()
+{
+	struct usi *u;
+	char *freqtext=NULL;
+	int i,j;
+
+	ref=0;
+	if (headless) return;
+	/* this is formatted outside of the lock, it can take a while */
+	if ((ui_pending&UI_FREQ)&&(display_state==DISPLAY_FREQ)) freqtext=format_freq();
+
+	pthread_mutex_lock(&ui.mutex);
+	for (i=0;i<MAXUS;i++) {
+		if (!(ui_pending_idx&(1ULL<<i))) continue;
+		if (dispcell>=dispnet->ncells) {
+			memset(&ui.idx[i],0,sizeof(struct ui_usage));
+			continue;
+		}
+		u=getusi(dispnet,dispcell*MAXUS+i);
+		ui.idx[i].active=u->active;
+		ui.idx[i].encr=u->encr;
+		ui.idx[i].play=u->play;
+		for (j=0;j<3;j++) {
+			ui.idx[i].ssi[j]=u->ssi[j];
+			if (u->ssi[j]) snprintf(ui.idx[i].opis[j],sizeof(ui.idx[i].opis[j]),"%s",lookupssi(u->ssi[j]));
+		}
+	}
+	if (ui_pending&UI_TITLE) format_title(ui.title_net,ui.title_rest,sizeof(ui.title_net));
+	if (freqtext) {
+		free(ui.freqtext);
+		ui.freqtext=freqtext;
+	}
+	ui.screen=display_state;
+	ui.dirty|=ui_pending;
+	ui.dirty_idx|=ui_pending_idx;
+	if ((ui.dirty)||(ui.dirty_idx)) pthread_cond_signal(&ui.cond);
+	pthread_mutex_unlock(&ui.mutex);
+	ui_pending=0;
+	ui_pending_idx=0;
+}
+
+/* the screen thread, the only one which touches ncurses after initcur() */
+pthread_t ui_thread;
+
+void draw_idx() {
+	int idx;
+	for (idx=0;idx<MAXUS;idx++)
+	{
+		wmove(mainwin,getr(idx),getcl(idx));
+		wprintw(mainwin,"%2i:",idx);
+	}
+}
+
+void draw_usage(int idx,struct ui_usage *u)
+{
+	char opis[40];
+	int i;
+	int row=getr(idx);
+	int col=getcl(idx);
+	int bold=0;
+
+	opis[0]=0;
+	wmove(mainwin,row,col+5);
+	if (u->active) strcat(opis,"OK ");
+	if (u->encr) strcat(opis,"ENCR ");
+	if ((u->play)&&(u->active)) { bold=1; strcat(opis,"*PLAY*"); }
+	if (bold) wattron(mainwin,A_BOLD|COLOR_PAIR(1));
+	wprintw(mainwin,"%-30s",opis);
+	if (bold) wattroff(mainwin,COLOR_PAIR(1));
+	for (i=0;i<3;i++) {
+		wmove(mainwin,row+i+1,col+5);
+		if (u->ssi[i]) {
+			wprintw(mainwin,"%8i %20s",u->ssi[i],u->opis[i]);
+		}
+		else 
+		{
+			wprintw(mainwin,"                              ");
+
+		}
+	}
+	if (bold) wattroff(mainwin,A_BOLD);
+}
+
+void draw_title(char *netpart,char *rest)
+{
+	wmove(titlewin,0,32);
+	wattron(titlewin,COLOR_PAIR(4)|A_BOLD);
+	wprintw(titlewin,"%s",netpart);
+	wattroff(titlewin,COLOR_PAIR(4)|A_BOLD);
+	wprintw(titlewin,"%s",rest);
+	wclrtoeol(titlewin);
+}
+
+void draw_freq(char *text)
+{
+	wclear(freqwin);
+	if (text) wprintw(freqwin,"%s",text);
+	wattron(freqwin,A_BOLD);
+	wmove(freqwin,1,170);
+	wprintw(freqwin,"reasons: N:D-NWRK-BROADCAST");
+	wmove(freqwin,2,170);
+	wprintw(freqwin,"S:SYSINFO A:ChanAlloc");
+	wattroff(freqwin,A_BOLD);
+}
+
+void draw_text(WINDOW *w,struct ui_text *t)
+{
+	if (!t->len) return;
+	wprintw(w,"%s",t->buf);
+	if (t->lost) wprintw(w,"[...]\n");
+	wnoutrefresh(w);
+}
+
+void *ui_worker(void *arg)
+{
+	static struct ui_usage idx[MAXUS];
+	static struct ui_text status,msg;
+	static char title_net[BUFLEN],title_rest[BUFLEN];
+	char *freqtext=NULL;
+	struct timespec next,now;
+	uint64_t bits;
+	int dirty;
+	int screen=DISPLAY_IDX;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC,&next);
+	while(1) {
+		pthread_mutex_lock(&ui.mutex);
+		while((!ui.dirty)&&(!ui.dirty_idx)&&(!ui.quit)) pthread_cond_wait(&ui.cond,&ui.mutex);
+		if (ui.quit) {
+			pthread_mutex_unlock(&ui.mutex);
+			endwin();
+			return(NULL);
+		}
+		dirty=ui.dirty;
+		bits=ui.dirty_idx;
+		for (i=0;i<MAXUS;i++) if (bits&(1ULL<<i)) idx[i]=ui.idx[i];
+		if (dirty&UI_TITLE) {
+			strcpy(title_net,ui.title_net);
+			strcpy(title_rest,ui.title_rest);
+		}
+		if (ui.freqtext) {
+			free(freqtext);
+			freqtext=ui.freqtext;
+			ui.freqtext=NULL;
+		}
+		if (screen!=ui.screen) {
+			screen=ui.screen;
+			dirty|=(screen==DISPLAY_FREQ)?UI_FREQ:UI_MAIN;
+			if (screen==DISPLAY_IDX) bits=~0ULL;
+		}
+		memcpy(status.buf,ui.status.buf,ui.status.len+1);
+		status.len=ui.status.len;
+		status.lost=ui.status.lost;
+		memcpy(msg.buf,ui.msg.buf,ui.msg.len+1);
+		msg.len=ui.msg.len;
+		msg.lost=ui.msg.lost;
+		ui.status.len=0;
+		ui.status.lost=0;
+		ui.msg.len=0;
+		ui.msg.lost=0;
+		ui.dirty=0;
+		ui.dirty_idx=0;
+		pthread_mutex_unlock(&ui.mutex);
+
+		if (dirty&UI_TITLE) {
+			draw_title(title_net,title_rest);
+			wnoutrefresh(titlewin);
+		}
+		if (screen==DISPLAY_FREQ) {
+			displayedwin=freqwin;
+			if (dirty&UI_FREQ) {
+				draw_freq(freqtext);
+				wnoutrefresh(freqwin);
+			}
+		} else {
+			displayedwin=mainwin;
+			if (dirty&UI_MAIN) {
+				wclear(mainwin);
+				draw_idx();
+				bits=~0ULL;
+			}
+			for (i=0;i<MAXUS;i++) if (bits&(1ULL<<i)) draw_usage(i,&idx[i]);
+			if ((dirty&UI_MAIN)||(bits)) wnoutrefresh(mainwin);
+		}
+		draw_text(statuswin,&status);
+		draw_text(msgwin,&msg);
+		if (dirty&UI_REDRAW) {
+			redrawwin(titlewin);
+			redrawwin(displayedwin);
+			redrawwin(statuswin);
+			redrawwin(msgwin);
+			wnoutrefresh(titlewin);
+			wnoutrefresh(displayedwin);
+			wnoutrefresh(statuswin);
+			wnoutrefresh(msgwin);
+		}
+		doupdate();
+
+		/* don't draw more often than ui_fps times a second */
+		next.tv_nsec+=1000000000L/ui_fps;
+		while (next.tv_nsec>=1000000000L) { next.tv_sec++; next.tv_nsec-=1000000000L; }
+		clock_gettime(CLOCK_MONOTONIC,&now);
+		if ((now.tv_sec>next.tv_sec)||((now.tv_sec==next.tv_sec)&&(now.tv_nsec>next.tv_nsec))) {
+			next=now;
+		} else {
+			clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&next,NULL);
+		}
+	}
+	return(NULL);
+}
+
+#define STATUSLINES 7
+int initcur() {
+	int maxx,maxy;
+	initscr();
+	start_color();
+	cbreak();
+	noecho();
+	init_pair(1, COLOR_RED, COLOR_BLUE);
+	init_pair(2, COLOR_YELLOW, COLOR_BLUE);
+	init_pair(3, COLOR_RED, COLOR_GREEN);
+	init_pair(4, COLOR_WHITE, COLOR_GREEN);
+	init_pair(5, COLOR_BLACK, COLOR_YELLOW);
+	clear();
+	titlewin=newwin(1,COLS,0,0);
+	mainwin=newwin(LINES-STATUSLINES-1,COLS,1,0);
+	freqwin=newwin(LINES-STATUSLINES-1,COLS,1,0);
+	locwin=newwin(LINES-STATUSLINES-1,COLS,1,0);
+	ssiwin=newwin(LINES-STATUSLINES-1,COLS,1,0);
+	displayedwin=mainwin;
+	msgwin=newwin(STATUSLINES,COLS/2,LINES-STATUSLINES,0);
+	wattron(msgwin,COLOR_PAIR(2));
+	wbkgdset(msgwin,COLOR_PAIR(2));
+	wclear(msgwin);
+	wprintw(msgwin,"Message window\n");
+	scrollok(msgwin,TRUE);
+
+	statuswin=newwin(STATUSLINES,COLS/2,LINES-STATUSLINES,COLS/2+1);
+	wattron(statuswin,COLOR_PAIR(3));
+	wbkgdset(statuswin,COLOR_PAIR(3));
+	wclear(statuswin);
+	wprintw(statuswin,"####  Press ? for keystroke help  ####\n");
+	getmaxyx(stdscr,maxy,maxx);
+	if ((maxx!=203)||(maxy!=60)) {
+		wprintw(statuswin,"\nWARNING: The terminal size is %ix%i, but it should be 203x60\nThe program will still work, but the display may be mangled\n\n",maxx,maxy);
+	}
+	scrollok(statuswin,TRUE);
+
+	wattron(titlewin,A_BOLD);
+	wprintw(titlewin,"** SQ5BPF TETRA Monitor %s **",TELIVE_VERSION);
+	wattroff(titlewin,A_BOLD);
+
+	draw_idx();
+	refresh();
+	wnoutrefresh(titlewin);
+	wnoutrefresh(mainwin);
+	wnoutrefresh(msgwin);
+	wnoutrefresh(statuswin);
+	doupdate();
+	pthread_create(&ui_thread,NULL,ui_worker,NULL);
+	ref=1;
+	return(1);
+}
+
+/* when the next timeout of an usage identifier is due, 0 - nothing to time out */
+time_t usage_deadline(int idx)
+{
+	struct usi *u=getusi(net,idx);
+	struct usi_rec *r=getusr(net,idx);
+	time_t d=0;
+	time_t x;
+	int j;
+
+#define DEADLINE(t) { x=(t); if ((!d)||(x<d)) d=x; }
+	for (j=0;j<3;j++) {
+		if (u->ssi[j]) DEADLINE(u->ssi_time[j]+ssi_timeout+1);
+	}
+	if (u->active) DEADLINE(u->timeout+idx_timeout+1);
+	if (r->reclen) DEADLINE(r->recstart+1);
+	if (r->curfile) DEADLINE(u->ssi_time_rec+rec_timeout+1);
+#undef DEADLINE
+	return(d?sec_tick(d):0);
+}
+
+/* arm the timer of an usage identifier after something in it changed */
+void usage_arm(int idx)
+{
+	time_t d=usage_deadline(idx);
+	if (d) timer_arm(&getusr(net,idx)->timer,d);
+}
+
+/* remember an SSI for the call record of usage identifier idx */
+void call_addssi(int idx,unsigned int ssi)
+{
+	struct usi_rec *r=getusr(net,idx);
+	int i;
+
+	if ((!ssi)||(!r->curfile)) return;
+	for (i=0;i<r->ncallssi;i++) if (r->callssi[i]==ssi) return;
+	if (r->ncallssi<CDR_MAXSSI) r->callssi[r->ncallssi++]=ssi;
+}
+
+int addssi(int idx,int ssi)
+{
+	struct usi *u;
+	int i;
+
+	if (!ssi) return(0);
+	if ((idx<0)||(idx>=nslots(net))) { status_printf("BUG! addssi(%i,%i)\n",idx,ssi); return(0); }
+	u=getusi(net,idx);
+	for(i=0;i<3;i++) {
+		if (u->ssi[i]==ssi) {
+			u->ssi_time[i]=time(0);
+			return(1);
+		}
+	}
+	for(i=0;i<3;i++) {
+		if (!u->ssi[i]) {
+			u->ssi[i]=ssi;
+			u->filter_gen=0;
+			u->ssi_time[i]=time(0);
+			call_addssi(idx,ssi);
+			usage_arm(idx);
+			return(1);
+		}
+	}	
+
+
+
+	/* no room to add, forget one ssi */
+	u->ssi[0]=u->ssi[1];
+	u->ssi[1]=u->ssi[2];
+	u->ssi[2]=ssi;
+	u->ssi_time[2]=time(0);
+	u->filter_gen=0;
+	call_addssi(idx,ssi);
+	u->active=1;
+	usage_arm(idx);
+	return(1);
+}
+
+int addssi2(int idx,int ssi,int i)
+{
+	struct usi *u=getusi(net,idx);
+
+	if (!ssi) return(0);
+	u->ssi[i]=ssi;
+	u->filter_gen=0;
+	u->ssi_time[i]=time(0);
+	call_addssi(idx,ssi);
+	u->active=1;
+	usage_arm(idx);
+	return(0);
+}
+
+
+int releasessi(int ssi)
+{
+	struct usi *u;
+	int i,j;
+	for (i=0;i<nslots(net);i++) {
+		u=getusi(net,i);
+		for (j=0;j<3;j++) {
+			if ((u->active)&&(u->ssi[j]==ssi)) {
+				u->active=0;
+				u->play=0;
+				u->encr=0;
+				updidx(i);
+				ref=1;
+			}
+		}
+	}
+	return(0);
+}
+
+/* check if an SSI matches a wildcard expression */
+int matchpattern(char *pattern,int ssi)
+{
+	int r;
+	char ssistr[16];
+	sprintf(ssistr,"%i",ssi);
+
+#ifdef FNM_EXTMATCH
+	r=fnmatch(pattern,(char *)&ssistr,FNM_EXTMATCH);
+#else
+	/* FNM_EXTMATCH is a GNU libc extension, not present in other libcs, like the MacOS X one */
+#warning -----------    Extended match patterns for fnmatch are not supported by your libc. You will have to live with that.    ------------
+	r=fnmatch(pattern,(char *)&ssistr,0); 
+#endif
+	return(!r);
+}
+
+/* check if an SSI matches the filter expression */
+int matchssi(int ssi) 
+{
+	if (!ssi) return(0);
+	if (!compiled_filter) return(1); 
+	return(filter_match(compiled_filter,ssi));
+}
+
+/* check if any SSIs for this usage identifier match the filter expression */
+int matchidx(int idx)
+{
+	struct usi *u=getusi(net,idx);
+	int i;
+	int j=0;
+	if (!use_filter) return (1);
+	if (u->filter_gen!=filter_gen) {
+		for(i=0;i<3;i++) {
+			if (matchssi(u->ssi[i])) { 
+				j=1; 
+				break; 
+			}
+		}
+		u->filter_match=j;
+		u->filter_gen=filter_gen;
+	}
+	j=u->filter_match;
+	if (use_filter==-1) j=!j;
+	return(j);
+}
+
+/* 
+ * playback priorities from TETRA_PRIORITIES: pattern=priority[:gain],... 
+ * the patterns are like the filter, the first one that matches an SSI 
+ * counts. a call gets the best priority of its SSIs, with no match it 
+ * has priority 0 and gain 1
+ */
+#define MAXPRIOS 64
+
+struct play_prio {
+	char pattern[64];
+	int prio;
+	float gain;
+};
+
+struct play_prio prios[MAXPRIOS];
+int nprios=0;
+
+void init_priorities(char *list)
+{
+	char item[128];
+	char *c,*e;
+	int n;
+
+	while((*list)&&(nprios<MAXPRIOS)) {
+		n=strcspn(list,",");
+		snprintf(item,sizeof(item),"%.*s",n,list);
+		list+=n;
+		if (*list) list++;
+		c=strrchr(item,'=');
+		if ((!c)||(c==item)) continue;
+		*c++=0;
+		snprintf(prios[nprios].pattern,sizeof(prios[nprios].pattern),"%s",item);
+		prios[nprios].prio=strtol(c,&e,10);
+		prios[nprios].gain=(*e==':')?atof(e+1):1.0;
+		nprios++;
+	}
+}
+
+int ssi_prio(int ssi,float *gain)
+{
+	int i;
+
+	for (i=0;i<nprios;i++) {
+		if (matchpattern(prios[i].pattern,ssi)) {
+			*gain=prios[i].gain;
+			return(prios[i].prio);
+		}
+	}
+	*gain=1.0;
+	return(0);
+}
+
+/* the priority of the call on an usage identifier, and its gain in the mixer */
+int usage_prio(int idx,float *gain)
+{
+	struct usi *u=getusi(net,idx);
+	int best=0;
+	int found=0;
+	float g;
+	int i,p;
+
+	*gain=1.0;
+	if (!nprios) return(0);
+	for (i=0;i<3;i++) {
+		if (!u->ssi[i]) continue;
+		p=ssi_prio(u->ssi[i],&g);
+		if ((!found)||(p>best)) {
+			best=p;
+			*gain=g;
+			found=1;
+		}
+	}
+	return(best);
+}
+
+/* 
+ * playback arbitration. the telive instances of one machine (see rxx and 
+ * rxx2) share the speaker, and agree who plays through a small segment 
+ * of shared memory mapped from TETRA_LOCK_FILE. the instance that plays 
+ * is the owner, the others publish the priority of the best call that 
+ * they would like to play. a call with a higher priority takes over at 
+ * once, otherwise the owner hands the speaker to the best waiting 
+ * instance when it is done, equal priorities take turns. this is all 
+ * done with atomic operations on the segment, the owner only checks 
+ * that it still owns the speaker for every frame, without system calls
+ */
+#define ARB_MAGIC 0x544c4152
+#define ARB_SLOTS 16 /* instances */
+#define ARB_STALE 3 /* seconds without a sign of life from the owner, then it is taken over */
+#define ARB_WANT 1 /* seconds since a waiter last wanted to play, then it has nothing to play */
+
+struct arb_slot {
+	int32_t pid; /* 0 - free */
+	int32_t prio; /* of the call that it wants to play */
+	int64_t want; /* when it last wanted to play, 0 - it doesn't */
+};
+
+struct arb_seg {
+	uint32_t magic;
+	int32_t owner; /* pid of the instance which plays, 0 - nobody */
+	int32_t owner_prio;
+	int32_t reserved;
+	int64_t owner_beat; /* when the owner was last seen alive */
+	struct arb_slot slots[ARB_SLOTS];
+};
+
+struct arb_seg *arb=NULL;
+int arb_me=-1; /* our slot */
+int32_t arb_pid;
+
+void init_arbitration()
+{
+	struct stat st;
+	int fd,i;
+	int32_t pid;
+
+	if (!lock_file) return;
+	fd=open(lock_file,O_RDWR|O_CREAT|O_CLOEXEC,0600);
+	if (fd==-1) {
+		status_printf("can't open lock file %s\n",lock_file);
+		return;
+	}
+	/* only at start, so that two instances don't set it up at the same time */
+	flock(fd,LOCK_EX);
+	if ((fstat(fd,&st)==-1)||((st.st_size<sizeof(struct arb_seg))&&(ftruncate(fd,sizeof(struct arb_seg))==-1))) {
+		flock(fd,LOCK_UN);
+		close(fd);
+		return;
+	}
+	arb=mmap(NULL,sizeof(struct arb_seg),PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+	if (arb==MAP_FAILED) {
+		arb=NULL;
+	} else {
+		if (arb->magic!=ARB_MAGIC) {
+			memset(arb,0,sizeof(struct arb_seg));
+			arb->magic=ARB_MAGIC;
+		}
+		arb_pid=getpid();
+		for (i=0;i<ARB_SLOTS;i++) {
+			pid=arb->slots[i].pid;
+			/* free, or left behind by an instance which is gone */
+			if ((pid)&&((kill(pid,0)==0)||(errno!=ESRCH))) continue;
+			arb->slots[i].pid=arb_pid;
+			arb->slots[i].want=0;
+			arb_me=i;
+			break;
+		}
+		if (arb->owner==arb_pid) arb->owner=0; /* an old instance with the same pid */
+	}
+	flock(fd,LOCK_UN);
+	close(fd);
+	if (!arb) status_printf("can't map lock file %s\n",lock_file);
+	else if (arb_me==-1) status_printf("too many telive instances on %s\n",lock_file);
+}
+
+/* do we still have the speaker? */
+static inline int arb_held()
+{
+	return((!arb)||(__atomic_load_n(&arb->owner,__ATOMIC_ACQUIRE)==arb_pid));
+}
+
+/* get the speaker for a call with priority prio */
+int trylock(int prio) {
+	int32_t owner;
+	time_t t;
+
+	if (!arb) return(1);
+	t=time(0);
+	owner=__atomic_load_n(&arb->owner,__ATOMIC_ACQUIRE);
+	if ((owner!=arb_pid)&&((!owner)||(prio>arb->owner_prio)||(arb->owner_beat+ARB_STALE<t))) {
+		__atomic_compare_exchange_n(&arb->owner,&owner,arb_pid,0,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE);
+	}
+	if (!arb_held()) {
+		/* let the owner know that we are waiting */
+		if (arb_me!=-1) {
+			arb->slots[arb_me].prio=prio;
+			__atomic_store_n(&arb->slots[arb_me].want,t,__ATOMIC_RELEASE);
+		}
+		return(0);
+	}
+	arb->owner_prio=prio;
+	arb->owner_beat=t;
+	if (arb_me!=-1) arb->slots[arb_me].want=0;
+	if (!locked) { locked=1; updopis(); }
+	return(1);
+}
+
+/* the owner is still alive and plays something with priority prio */
+void arb_beat(int prio)
+{
+	if (!arb) return;
+	arb->owner_beat=time(0);
+	arb->owner_prio=prio;
+}
+
+/* give the speaker to the best instance that waits, or to nobody */
+void releaselock() {
+	int32_t me=arb_pid;
+	int32_t next=0;
+	int nextprio=0;
+	int i,j;
+	time_t t=time(0);
+
+	if (locked) { locked=0; updopis(); }
+	if ((!arb)||(!arb_held())) return;
+	/* start after our slot, so that equal priorities take turns */
+	for (j=1;j<=ARB_SLOTS;j++) {
+		i=(arb_me+j+ARB_SLOTS)%ARB_SLOTS;
+		if ((i==arb_me)||(!arb->slots[i].pid)) continue;
+		if (__atomic_load_n(&arb->slots[i].want,__ATOMIC_ACQUIRE)+ARB_WANT<t) continue;
+		if ((next)&&(arb->slots[i].prio<=nextprio)) continue;
+		next=arb->slots[i].pid;
+		nextprio=arb->slots[i].prio;
+	}
+	arb->owner_prio=nextprio;
+	arb->owner_beat=t;
+	__atomic_compare_exchange_n(&arb->owner,&me,next,0,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE);
+}
+
+/* we are going away, give the speaker to somebody else and free our slot */
+void arb_exit()
+{
+	if (!arb) return;
+	releaselock();
+	if (arb_me==-1) return;
+	__atomic_store_n(&arb->slots[arb_me].want,0,__ATOMIC_RELEASE);
+	__atomic_store_n(&arb->slots[arb_me].pid,0,__ATOMIC_RELEASE);
+	arb_me=-1;
+}
+
+/* receiver table functions */
+/* 
+ * object pool: the frequency and receiver entries come and go all the 
+ * time, so they are kept on a free list instead of going back to malloc
+ */
+#define POOL_CHUNK 64
+
+struct pool {
+	int size;
+	void *free;
+};
+
+struct pool freq_pool={ sizeof(struct freqinfo),NULL };
+struct pool rx_pool={ sizeof(struct receiver),NULL };
+
+void *pool_get(struct pool *p)
+{
+	char *chunk;
+	void *ptr;
+	int i;
+
+	if (!p->free) {
+		chunk=malloc(p->size*POOL_CHUNK);
+		for (i=0;i<POOL_CHUNK;i++) {
+			*(void **)(chunk+i*p->size)=p->free;
+			p->free=chunk+i*p->size;
+		}
+	}
+	ptr=p->free;
+	p->free=*(void **)ptr;
+	memset(ptr,0,p->size);
+	return(ptr);
+}
+
+void pool_put(struct pool *p,void *ptr)
+{
+	*(void **)ptr=p->free;
+	p->free=ptr;
+}
+
+static inline unsigned int rx_hashfn(unsigned int rx)
+{
+	return(rx&(RX_HASHSIZE-1));
+}
+
+static inline unsigned int freq_hashfn(uint32_t f)
+{
+	/* the frequencies are multiples of 6.25kHz */
+	return(((f/6250)*2654435761U)>>24)&(FREQ_HASHSIZE-1);
+}
+
+time_t expire_receiver(struct wtimer *t,time_t now);
+
+void update_receivers(int rx,int afc,uint32_t freq)
+{
+	struct receiver *ptr;
+	unsigned int h=rx_hashfn(rx);
+
+	/* do we know this rx? */
+	for (ptr=net->rx_hash[h];ptr;ptr=ptr->hnext) if (ptr->rxid==rx) break;
+	/* nope, new one */
+	if (!ptr) {
+		ptr=pool_get(&rx_pool);
+		ptr->rxid=rx;
+		ptr->hnext=net->rx_hash[h];
+		net->rx_hash[h]=ptr;
+		ptr->prev=net->receivers_last;
+		if (net->receivers_last) net->receivers_last->next=ptr; else net->receivers=ptr;
+		net->receivers_last=ptr;
+		timer_init(&ptr->timer,expire_receiver,net);
+		wheel_add(&sched,&ptr->timer,sec_tick(time(0)+receiver_timeout+1));
+	}
+	ptr->afc=afc;
+	if (freq)	ptr->freq=freq;
+	ptr->lastseen=time(0);
+	net->freq_changed=1;
+}
+
+void delete_receiver(struct receiver *ptr)
+{
+	struct receiver *prevptr=ptr->prev;
+	struct receiver *nextptr=ptr->next;
+	struct receiver **pp;
+
+	if (prevptr) prevptr->next=nextptr; else net->receivers=nextptr;
+	if (nextptr) nextptr->prev=prevptr; else net->receivers_last=prevptr;
+	for (pp=&net->rx_hash[rx_hashfn(ptr->rxid)];*pp!=ptr;pp=&(*pp)->hnext);
+	*pp=ptr->hnext;
+	timer_stop(&ptr->timer);
+	pool_put(&rx_pool,ptr);
+}
+
+/* time out an old receiver */
+time_t expire_receiver(struct wtimer *t,time_t now)
+{
+	struct receiver *ptr=timer_entry(t,struct receiver);
+
+	net=t->ctx;
+	if ((now/TICKS_PER_SEC-ptr->lastseen)>receiver_timeout) {
+		delete_receiver(ptr);
+		net->freq_changed=1;
+		return(0);
+	}
+	return(sec_tick(ptr->lastseen+receiver_timeout+1));
+}
+
+/* clear all known receivers */
+void clear_all_receivers() {
+	struct receiver *ptr=net->receivers;
+	struct receiver *ptr2;
+
+	while(ptr) {
+		ptr2=ptr;
+		ptr=ptr->next;
+		timer_stop(&ptr2->timer);
+		pool_put(&rx_pool,ptr2);
+
+	}
+	net->receivers=NULL;
+	net->receivers_last=NULL;
+	memset(net->rx_hash,0,sizeof(net->rx_hash));
+}
+
+
+/* frequency table functions */
+#define REASON_NETINFO 1<<0
+#define REASON_FREQINFO 1<<1
+#define REASON_DLFREQ 1<<2
+
+void freq_hash_add(struct freqinfo *ptr)
+{
+	unsigned int h;
+	if (ptr->ul_freq) {
+		h=freq_hashfn(ptr->ul_freq);
+		ptr->ulnext=net->freq_ulhash[h];
+		net->freq_ulhash[h]=ptr;
+	}
+	if (ptr->dl_freq) {
+		h=freq_hashfn(ptr->dl_freq);
+		ptr->dlnext=net->freq_dlhash[h];
+		net->freq_dlhash[h]=ptr;
+	}
+}
+
+void freq_hash_del(struct freqinfo *ptr)
+{
+	struct freqinfo **pp;
+	if (ptr->ul_freq) {
+		for (pp=&net->freq_ulhash[freq_hashfn(ptr->ul_freq)];*pp!=ptr;pp=&(*pp)->ulnext);
+		*pp=ptr->ulnext;
+	}
+	if (ptr->dl_freq) {
+		for (pp=&net->freq_dlhash[freq_hashfn(ptr->dl_freq)];*pp!=ptr;pp=&(*pp)->dlnext);
+		*pp=ptr->dlnext;
+	}
+	ptr->ulnext=NULL;
+	ptr->dlnext=NULL;
+}
+
+time_t expire_freq(struct wtimer *t,time_t now);
+
+/* insert frequency into the freq table */
+insert_freq(int reason,uint16_t mnc,uint16_t mcc,uint32_t ulf,uint32_t dlf,uint16_t la, int rx)
+{
+
+	struct freqinfo *ptr=NULL;
+
+	/* entries without any frequency would be deleted right away */
+	if ((!ulf)&&(!dlf)) return(0);
+
+	/* maybe we already know the uplink or downlink frequency */
+	if (ulf) {
+		for (ptr=net->freq_ulhash[freq_hashfn(ulf)];ptr;ptr=ptr->ulnext) if (ptr->ul_freq==ulf) break;
+	}
+	if ((!ptr)&&(dlf)) {
+		for (ptr=net->freq_dlhash[freq_hashfn(dlf)];ptr;ptr=ptr->dlnext) if (ptr->dl_freq==dlf) break;
+	}
+
+	if (!ptr) {
+		ptr=pool_get(&freq_pool);
+		ptr->prev=net->frequencies_last;
+		if (net->frequencies_last) net->frequencies_last->next=ptr; else net->frequencies=ptr;
+		net->frequencies_last=ptr;
+		timer_init(&ptr->timer,expire_freq,net);
+		wheel_add(&sched,&ptr->timer,sec_tick(time(0)+freq_timeout+1));
+	} else {
+		freq_hash_del(ptr);
+	}	
+	if ((verbose)&&(reason!=REASON_NETINFO)) {
+		status_printf("Down:%3.4fMHz Up:%3.4fMHz LA:%i MCC:%i MNC:%i reason:%i RX:%i\n",dlf/1000000.0,ulf/1000000.0,la,mcc,mnc,reason,rx);
+	}
+	ptr->last_change=time(0);
+	ptr->ul_freq=ulf;
+	ptr->dl_freq=dlf;
+	ptr->la=la;
+	ptr->mcc=mcc;
+	ptr->mnc=mnc;
+	ptr->reason=ptr->reason|reason;
+	ptr->rx=rx;
+	freq_hash_add(ptr);
+	net->freq_changed=1;
+	return(0);
+}
+
+/* delete an old frequency */
+time_t expire_freq(struct wtimer *t,time_t now)
+{
+	struct freqinfo *ptr=timer_entry(t,struct freqinfo);
+	struct freqinfo *prevptr=ptr->prev;
+	struct freqinfo *nextptr=ptr->next;
+
+	net=t->ctx;
+	if ((now/TICKS_PER_SEC-ptr->last_change)<=freq_timeout) return(sec_tick(ptr->last_change+freq_timeout+1));
+
+	if (prevptr) prevptr->next=nextptr; else net->frequencies=nextptr;
+	if (nextptr) nextptr->prev=prevptr; else net->frequencies_last=prevptr;
+	freq_hash_del(ptr);
+	pool_put(&freq_pool,ptr);
+	net->freq_changed=1;
+	return(0);
+}
+
+/* delete the whole frequency table */
+void clear_all_freqtable() {
+	struct freqinfo *ptr=net->frequencies;
+	struct freqinfo *nextptr;
+
+	while(ptr) {
+		nextptr=ptr->next;
+		timer_stop(&ptr->timer);
+		pool_put(&freq_pool,ptr);
+		ptr=nextptr;
+	}
+	net->frequencies=NULL;
+	net->frequencies_last=NULL;
+	memset(net->freq_ulhash,0,sizeof(net->freq_ulhash));
+	memset(net->freq_dlhash,0,sizeof(net->freq_dlhash));
+}
+
+/* frequency window changed */
+void display_freq() {
+	ui_pending|=UI_FREQ;
+	dispnet->freq_changed=0;
+	ref=1;
+}
+
+/* the text of the frequency window, called by refresh_scr() */
+char *format_freq() {
+	char tmpstr2[64];
+	char tmpstr[256];
+	struct freqinfo *ptr=dispnet->frequencies;
+	struct receiver *rptr=dispnet->receivers;
+	char *text=NULL;
+	int len=0,size=0;
+	strappend(&text,&len,&size,"\n***  Known frequencies:  ***\n");
+	while(ptr) {
+		tmpstr[0]=0;
+		if (ptr->dl_freq) {
+			sprintf(tmpstr2,"Downlink:%3.4fMHz\t",ptr->dl_freq/1000000.0);
+			strcat(tmpstr,tmpstr2);
+		}  else {
+			strcat(tmpstr,"                    \t");
+		}
+
+		if (ptr->ul_freq) {
+			sprintf(tmpstr2,"Uplink:%3.4fMHz\t",ptr->ul_freq/1000000.0);
+			strcat(tmpstr,tmpstr2);
+		} else {
+			strcat(tmpstr,"                  \t");
+		}
+
+		if (ptr->mcc) {
+			sprintf(tmpstr2,"MCC:%5i\t",ptr->mcc);
+			strcat(tmpstr,tmpstr2);
+		} else {
+			strcat(tmpstr,"         \t");
+		}
+
+
+		if (ptr->mnc) {
+			sprintf(tmpstr2,"MNC:%5i\t",ptr->mnc);
+			strcat(tmpstr,tmpstr2);
+		} else {
+			strcat(tmpstr,"         \t");
+		}
+
+
+		if (ptr->la) {
+			sprintf(tmpstr2,"LA:%5i\t",ptr->la);
+			strcat(tmpstr,tmpstr2);
+		} else {
+			strcat(tmpstr,"        \t");
+		}
+
+		strcat(tmpstr,"reason:[");
+		if (ptr->reason&REASON_NETINFO) strcat(tmpstr,"S");
+		if (ptr->reason&REASON_FREQINFO) strcat(tmpstr,"N");
+		if (ptr->reason&REASON_DLFREQ) strcat(tmpstr,"A");
+		strcat(tmpstr,"]\t");
+		sprintf(tmpstr2,"RX:%i",ptr->rx);
+		strcat(tmpstr,tmpstr2);
+		strcat(tmpstr,"\n");
+		strappend(&text,&len,&size,tmpstr);
+		ptr=ptr->next;
+	}
+
+	strappend(&text,&len,&size,"\n\n***    Receiver info:    ***\n\n");
+	strappend(&text,&len,&size,"RX:\tAFC:\t\t\t\tFREQUENCY\n");
+
+	while(rptr) {
+
+		char buf[24]="[..........:..........]";
+		int i;
+		i=(11+rptr->afc/10);
+		if (i<2) { buf[2]='<'; } 
+		else  if (i>21) { buf[21]='>'; } else { buf[i]='|';  }
+
+		sprintf(tmpstr,"%i\t%+3.3i %s",rptr->rxid,rptr->afc,buf);
+		if (rptr->freq) {
+			sprintf(tmpstr2,"%3.4fMHz",rptr->freq/1000000.0);
+			strcat(tmpstr,tmpstr2);
+		} 
+		strcat(tmpstr,"\n");
+		strappend(&text,&len,&size,tmpstr);
+		rptr=rptr->next;
+	}
+
+	return(text);
+}
+
+/* 
+ * playback scheduling: a call gets a free channel when its traffic comes, 
+ * or takes the channel of the call with the lowest priority if its own 
+ * priority is higher. with one channel and no priorities this is the old 
+ * behaviour, the first call that comes is played until it ends. the lock 
+ * file is held as long as anything is played
+ */
+int play_busy()
+{
+	int i,n=0;
+	for (i=0;i<mix_channels;i++) if (playchans[i].net) n++;
+	return(n);
+}
+
+/* the channel which plays usage identifier idx of n, -1 if none */
+int play_chan_of(struct tetra_net *n,int idx)
+{
+	int i;
+	for (i=0;i<mix_channels;i++) if ((playchans[i].net==n)&&(playchans[i].idx==idx)) return(i);
+	return(-1);
+}
+
+/* give channel ch to usage identifier idx of the current network */
+void play_assign(int ch,int idx,int prio,float gain)
+{
+	struct play_chan *p=&playchans[ch];
+
+	p->net=net;
+	p->idx=idx;
+	p->prio=prio;
+	p->gain=gain;
+	p->time=time(0);
+	p->call=++play_call;
+	timer_arm(&curplaying_timer,sec_tick(p->time+curplaying_timeout+1));
+	if (verbose>0) {
+		if (mix_channels>1) {
+			status_printf("NOW PLAYING %i on channel %i\n",idx,ch+1);
+		} else {
+			status_printf("NOW PLAYING %i\n",idx);
+		}
+	}
+	ref=1;
+}
+
+/* take the call off channel ch, with deactivate it is also not active anymore (stopped or timed out) */
+void play_release(int ch,int deactivate)
+{
+	struct tetra_net *savednet=net;
+	struct play_chan *p=&playchans[ch];
+	struct usi *u;
+
+	if (!p->net) return;
+	net=p->net;
+	u=getusi(net,p->idx);
+	u->play=0;
+	if (deactivate) u->active=0;
+	updidx(p->idx);
+	net=savednet;
+	p->net=NULL;
+	ref=1;
+}
+
+/* is there a call which we would play, but don't? */
+int play_waiting()
+{
+	struct tetra_net *savednet=net;
+	struct usi *u;
+	int i,k,r=0;
+
+	for (k=0;(k<nnets)&&(!r);k++) {
+		net=&nets[k];
+		for (i=0;i<nslots(net);i++) {
+			u=getusi(net,i);
+			if ((!u->active)||(u->encr)||(u->play)||(!matchidx(i))) continue;
+			r=1;
+			break;
+		}
+	}
+	net=savednet;
+	return(r);
+}
+
+void play_unlock_idle()
+{
+	if (play_busy()) return;
+	releaselock();
+	/* the other instances shouldn't hand the speaker to us now */
+	if ((arb)&&(arb_me!=-1)&&(!play_waiting())) __atomic_store_n(&arb->slots[arb_me].want,0,__ATOMIC_RELEASE);
+}
+
+/* the highest priority that is played now, what the other instances have to beat */
+int play_maxprio()
+{
+	int i,prio=0,n=0;
+	for (i=0;i<mix_channels;i++) {
+		if (!playchans[i].net) continue;
+		if ((!n++)||(playchans[i].prio>prio)) prio=playchans[i].prio;
+	}
+	return(prio);
+}
+
+/* another instance took the speaker, stop playing without forgetting the calls */
+void play_lost()
+{
+	int i;
+
+	if (verbose>0) status_printf("another telive instance took over playing\n");
+	for (i=0;i<mix_channels;i++) play_release(i,0);
+	locked=0;
+	updopis();
+}
+
+/* the channel for usage identifier idx which has a traffic frame to play, -1 if it doesn't get one */
+int play_schedule(int idx)
+{
+	struct play_chan *p;
+	int ch,low=-1;
+	int prio;
+	float gain;
+
+	ch=play_chan_of(net,idx);
+	if (ch>=0) {
+		/* the SSIs can come later than the traffic */
+		p=&playchans[ch];
+		if (nprios) p->prio=usage_prio(idx,&p->gain);
+		return(ch);
+	}
+	prio=usage_prio(idx,&gain);
+	for (ch=0;ch<mix_channels;ch++) {
+		if (!playchans[ch].net) break;
+		if ((low==-1)||(playchans[ch].prio<playchans[low].prio)) low=ch;
+	}
+	if (ch<mix_channels) {
+		if ((!play_busy())&&(!trylock(prio))) return(-1);
+		play_assign(ch,idx,prio,gain);
+		if (locked) arb_beat(play_maxprio());
+		return(ch);
+	}
+	if (prio<=playchans[low].prio) return(-1);
+	if (verbose>0) status_printf("PREEMPT %i (priority %i) for %i (priority %i)\n",playchans[low].idx,playchans[low].prio,idx,prio);
+	play_release(low,0);
+	play_assign(low,idx,prio,gain);
+	if (locked) arb_beat(play_maxprio());
+	return(low);
+}
+
+/* 
+ * fill the free channels with the best calls that are active, but not 
+ * played. used after something was stopped, so that we don't have to 
+ * wait until another call sends traffic
+ */
+void play_fill()
+{
+	struct tetra_net *savednet=net;
+	struct tetra_net *bestnet;
+	struct usi *u;
+	int ch,i,k,best,bestprio,prio;
+	float gain,bestgain=1.0;
+
+	for (ch=0;ch<mix_channels;ch++) {
+		if (playchans[ch].net) continue;
+		bestnet=NULL;
+		best=-1;
+		bestprio=0;
+		for (k=0;k<nnets;k++) {
+			net=&nets[k];
+			for (i=0;i<nslots(net);i++) {
+				u=getusi(net,i);
+				if ((!u->active)||(u->encr)||(u->play)||(!matchidx(i))) continue;
+				prio=usage_prio(i,&gain);
+				if ((bestnet)&&(prio<=bestprio)) continue;
+				bestnet=net;
+				best=i;
+				bestprio=prio;
+				bestgain=gain;
+			}
+		}
+		if (!bestnet) break;
+		if ((!play_busy())&&(!trylock(bestprio))) break;
+		net=bestnet;
+		play_assign(ch,best,bestprio,bestgain);
+		getusi(net,best)->play=1;
+	}
+	net=savednet;
+}
+
+/* stop everything that is played now, and find something else */
+void stop_playing()
+{
+	int i;
+
+	for (i=0;i<mix_channels;i++) {
+		if (!playchans[i].net) continue;
+		if (verbose>0) status_printf("STOP PLAYING %i\n",playchans[i].idx);
+		play_release(i,1);
+	}
+	play_fill();
+	play_unlock_idle();
+}
+
+void timeout_ssis(int i,time_t t)
+{
+	struct usi *u=getusi(net,i);
+	int j;
+	for (j=0;j<3;j++) {
+		if ((u->ssi[j])&&(u->ssi_time[j]+ssi_timeout<t)) {
+			u->ssi[j]=0;
+			u->ssi_time[j]=0;
+			u->filter_gen=0;
+			updidx(i);
+			ref=1;
+		}
+
+	}
+	/* move the array elements so that the indexes start at 0 */
+	for (j=0;j<2;j++) {
+		if (!u->ssi[j]) {
+			u->ssi[j]=u->ssi[j+1];
+			u->ssi_time[j]=u->ssi_time[j+1];
+			u->ssi[j+1]=0;
+			u->ssi_time[j+1]=0;
+		}
+	}
+}
+
+void timeout_idx(int i,time_t t)
+{
+	struct usi *u=getusi(net,i);
+	if ((u->active)&&(u->timeout+idx_timeout<t)) {
+		u->active=0;
+		u->play=0;
+		u->encr=0;
+		updidx(i);
+		ref=1;
+	}
+}
+
+/* stop playing the calls which didn't send anything for curplaying_timeout */
+time_t expire_curplaying(struct wtimer *tm,time_t now)
+{
+	time_t t=now/TICKS_PER_SEC;
+	time_t next=0;
+	int i,n=0;
+
+	for (i=0;i<mix_channels;i++) {
+		if (!playchans[i].net) continue;
+		if (playchans[i].time+curplaying_timeout<t) {
+			play_release(i,1);
+			n++;
+		}
+	}
+	if (n) play_fill();
+	play_unlock_idle();
+	for (i=0;i<mix_channels;i++) {
+		if (!playchans[i].net) continue;
+		if ((!next)||(playchans[i].time<next)) next=playchans[i].time;
+	}
+	return(next?sec_tick(next+curplaying_timeout+1):0);
+}
+
+/* hand the collected voice frames of an usage identifier to the recording thread */
+void rec_flush(int idx)
+{
+	struct usi_rec *r=getusr(net,idx);
+
+	if (!r->reclen) return;
+	if (!jq_put(&recq,job_new(JOB_REC_WRITE,r->curfile,NULL,r->recdata,r->reclen),0)) {
+		stats_rec_dropped+=r->reclen;
+		status_printf("recording queue full, dropped %i bytes\n",r->reclen);
+		ref=1;
+	}
+	r->recdata=NULL;
+	r->reclen=0;
+}
+
+/* add a voice frame to the recording, with the frame header of the container (see telive.h). ts is when it was received */
+void rec_write(int idx,unsigned char *data,int len,int flags,struct timespec *ts)
+{
+	struct usi_rec *r=getusr(net,idx);
+	int reclen=rec_raw?len:REC_FRAMEHDR+len;
+	unsigned char *p;
+
+	if (!r->recdata) r->recdata=malloc(rec_batch*reclen);
+	if (!r->recdata) return;
+	if (!r->reclen) {
+		/* hand it over in a second even if the batch doesn't fill up */
+		r->recstart=time(0);
+		usage_arm(idx);
+	}
+	p=r->recdata+r->reclen;
+	if (!rec_raw) {
+		p[0]='F';
+		p[1]=flags;
+		rec_putbe(p+2,net->cells[idx/MAXUS]->rxid&0xffff,2);
+		rec_putbe(p+4,(int64_t)ts->tv_sec*1000+ts->tv_nsec/1000000,8);
+		p+=REC_FRAMEHDR;
+	}
+	memcpy(p,data,len);
+	r->reclen+=reclen;
+	r->recorded=1;
+	if (r->reclen>=rec_batch*reclen) rec_flush(idx);
+}
+
+/* the call on usage identifier i ended, queue its record for the store */
+void call_record(int i,char *recfile)
+{
+	struct usi *u=getusi(net,i);
+	struct usi_rec *r=getusr(net,i);
+	struct cdr_record *c=calloc(1,sizeof(struct cdr_record));
+	char daydir[BUFLEN];
+	char out[BUFLEN];
+	int j;
+
+	for (j=0;j<3;j++) call_addssi(i,u->ssi[j]);
+	c->start=r->callstart;
+	c->end=u->ssi_time_rec;
+	memcpy(c->ssi,r->callssi,sizeof(c->ssi));
+	c->nssi=r->ncallssi;
+	c->frames=r->frames-r->callframes;
+	c->lost=r->lost-r->calllost;
+	c->rx=net->cells[i/MAXUS]->rxid;
+	c->usage=i%MAXUS;
+	c->net=net->id;
+	c->encr=r->encr;
+	if (r->recorded) {
+		if (transcode_workers) {
+			tc_outpath(recfile,daydir,out);
+			strncpy(c->path,out,sizeof(c->path)-1);
+		} else {
+			strncpy(c->path,recfile,sizeof(c->path)-1);
+		}
+	}
+	jq_put(&recq,job_new(JOB_CDR,cdr_dir,NULL,(unsigned char *)c,sizeof(struct cdr_record)),1);
+}
+
+/* timing out the recording */
+void timeout_rec(int i,time_t t)
+{
+	struct usi *u=getusi(net,i);
+	struct usi_rec *r=getusr(net,i);
+	char tmpfile[256];
+	char tag[32];
+	if ((r->curfile)&&(u->ssi_time_rec+rec_timeout<t)) {
+		/* networks can share the directory */
+		if (net->id) snprintf(tag,sizeof(tag),"n%i_",net->id); else tag[0]=0;
+		/* and so can cells with the same usage identifiers */
+		if (net->cells[i/MAXUS]->rxid!=-1) snprintf(tag+strlen(tag),sizeof(tag)-strlen(tag),"r%i_",net->cells[i/MAXUS]->rxid);
+		snprintf(tmpfile,sizeof(tmpfile),"%s/traffic_%s_%s%i_%i_%i_%i.out",net->outdir,r->curfiletime,tag,i%MAXUS,u->ssi[0],u->ssi[1],u->ssi[2]);
+		/* the recording thread flushes and closes the file before renaming it */
+		rec_flush(i);
+		jq_put(&recq,job_new(JOB_REC_CLOSE,r->curfile,tmpfile,NULL,0),1);
+		if (cdr_dir) call_record(i,tmpfile);
+		free(r->curfile);
+		r->curfile=NULL;
+		u->active=0;
+		u->encr=0;
+		updidx(i);
+		if(verbose>1) status_printf("timeout rec %s\n",tmpfile);
+		ref=1;
+	}
+}
+
+/* all the timeouts of an usage identifier, run when the first one is due */
+time_t expire_usage(struct wtimer *tm,time_t now)
+{
+	struct usi_rec *r=timer_entry(tm,struct usi_rec);
+	time_t t=now/TICKS_PER_SEC;
+	int i=r->idx;
+
+	net=tm->ctx;
+	timeout_ssis(i,t);
+	timeout_idx(i,t);
+	/* hand over whatever we have once a second */
+	if ((r->reclen)&&(r->recstart<t)) rec_flush(i);
+	timeout_rec(i,t);
+	return(usage_deadline(i));
+}
+
+/* the usage identifiers of the cell which RX rx hears, NULL if there is no room for another one */
+struct usage_cell *getcell(int rx)
+{
+	struct usage_cell *c;
+	struct usage_cell **cells;
+	int n,i;
+
+	for (i=0;i<net->ncells;i++) if (net->cells[i]->rxid==rx) return(net->cells[i]);
+	if (net->ncells==MAXCELLS) {
+		if (!net->cells_full) status_printf("too many receivers, ignoring the usage identifiers from RX %i\n",rx);
+		net->cells_full=1;
+		return(NULL);
+	}
+	if (net->ncells==net->maxcells) {
+		n=net->maxcells?net->maxcells*2:4;
+		cells=realloc(net->cells,n*sizeof(struct usage_cell *));
+		if (!cells) return(NULL);
+		net->cells=cells;
+		net->maxcells=n;
+	}
+	c=calloc(1,sizeof(struct usage_cell));
+	if (!c) return(NULL);
+	c->rxid=rx;
+	for (i=0;i<MAXUS;i++) {
+		c->rec[i].idx=net->ncells*MAXUS+i;
+		timer_init(&c->rec[i].timer,expire_usage,net);
+	}
+	net->cells[net->ncells++]=c;
+	if (net->ncells>1) {
+		if (verbose>0) status_printf("RX %i: new cell %i\n",rx,net->ncells);
+		updopis();
+	}
+	return(c);
+}
+
+/* 
+ * the slot of an usage identifier heard by RX rx, -1 if we can't keep it. 
+ * rx is -1 for traffic frames which don't say where they came from, they 
+ * go to the first cell
+ */
+int usage_slot(int rx,int usage)
+{
+	struct usage_cell *c;
+
+	if ((usage<0)||(usage>=MAXUS)) return(-1);
+	/* a message without the RX goes to the first cell, a cell made for it has RX -1 (unknown) */
+	if ((rx==-1)&&(net->ncells)) return(usage);
+	c=getcell(rx);
+	if (!c) return(-1);
+	return(c->rec[usage].idx);
+}
+
+/*************** live playback ****************/
+
+/* 
+ * live audio is played by a separate thread, so that a slow decoder 
+ * chain never blocks the main loop. parsetraffic() puts the frames into 
+ * a lock-free single producer / single consumer ring, the playback 
+ * thread takes them out and writes them to tplay. the tplay pipe stays 
+ * open all the time.
+ * 
+ * the playback thread has an adaptive jitter buffer: it estimates the 
+ * frame period and the jitter of the frame arrival times (like RFC3550 
+ * does), and at the start of each talk spurt waits until it has enough 
+ * frames buffered to ride out the jitter. then it writes the frames to 
+ * the decoder at the frame period. at the end of a talk spurt a few 
+ * fill frames are written, to push the last real frames through the 
+ * buffers in the decoder chain (this was done by restarting tplay before)
+ */
+#define PLAY_FRAMELEN 1380
+#define PLAY_RINGSIZE 256 /* must be a power of 2 */
+#define PLAY_PERIOD_US 60000 /* nominal time between traffic frames */
+
+struct play_frame {
+	uint64_t arrival; /* CLOCK_MONOTONIC in us */
+	unsigned int call; /* changes when another call is played */
+	int chan; /* mixer channel */
+	float gain;
+	unsigned char data[PLAY_FRAMELEN];
+};
+
+struct play_ring {
+	struct play_frame slots[PLAY_RINGSIZE];
+	unsigned int head; /* written by the producer */
+	unsigned int tail; /* written by the consumer */
+};
+
+struct play_ring playring;
+pthread_t play_thread;
+int play_evfd=-1; /* wakes up the playback thread */
+int play_sleeping=0; /* set by the playback thread when it waits for frames */
+int play_error=0; /* set by the playback thread, reported by the main loop */
+unsigned long play_dropped=0; /* frames that didn't fit in the ring */
+int play_mindelay=60; /* jitter buffer limits in ms */
+int play_maxdelay=600;
+int play_flushframes=2; /* fill frames written at the end of a talk spurt */
+FILE *playingfp=NULL;
+
+uint64_t now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return((uint64_t)ts.tv_sec*1000000+ts.tv_nsec/1000);
+}
+
+/* called from the main loop, never blocks */
+void play_enqueue(unsigned char *data,int chan,int call,float gain)
+{
+	unsigned int head=playring.head;
+	unsigned int tail=__atomic_load_n(&playring.tail,__ATOMIC_ACQUIRE);
+	struct play_frame *f;
+	uint64_t one=1;
+
+	if (head-tail>=PLAY_RINGSIZE) {
+		play_dropped++;
+		return;
+	}
+	f=&playring.slots[head&(PLAY_RINGSIZE-1)];
+	f->arrival=now_us();
+	f->call=call;
+	f->chan=chan;
+	f->gain=gain;
+	memcpy(f->data,data,PLAY_FRAMELEN);
+	__atomic_store_n(&playring.head,head+1,__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&play_sleeping,__ATOMIC_SEQ_CST)) write(play_evfd,&one,sizeof(one));
+}
+
+/* (re)open the pipe to tplay, called only from the playback thread */
+int do_popen() {
+	if (playingfp) pclose(playingfp);
+	playingfp=popen("tplay >/dev/null 2>&1","w");
+	if (!playingfp) {
+		__atomic_store_n(&play_error,1,__ATOMIC_RELEASE);
+		stats_add(&stats_play_errors,1);
+		return(0);
+	}
+	return(1);
+}
+
+int play_write(unsigned char *data)
+{
+	if (!playingfp) {
+		if (!do_popen()) return(0);
+	}
+	fwrite(data,1,PLAY_FRAMELEN,playingfp);
+	fflush(playingfp);
+	if (ferror(playingfp)) {
+		__atomic_store_n(&play_error,1,__ATOMIC_RELEASE);
+		stats_add(&stats_play_errors,1);
+		pclose(playingfp);
+		playingfp=NULL;
+		return(0);
+	}
+	return(1);
+}
+
+/* wait until there are frames after seen, at most until deadline (0 - forever) */
+void play_wait(unsigned int seen,uint64_t deadline)
+{
+	struct pollfd pfd;
+	uint64_t cnt;
+	uint64_t t;
+	int ms=-1;
+
+	__atomic_store_n(&play_sleeping,1,__ATOMIC_SEQ_CST);
+	if (seen==__atomic_load_n(&playring.head,__ATOMIC_SEQ_CST)) {
+		if (deadline) {
+			t=now_us();
+			ms=(deadline>t)?(deadline-t+999)/1000:0;
+		}
+		pfd.fd=play_evfd;
+		pfd.events=POLLIN;
+		poll(&pfd,1,ms);
+	}
+	__atomic_store_n(&play_sleeping,0,__ATOMIC_SEQ_CST);
+	read(play_evfd,&cnt,sizeof(cnt));
+}
+
+void *play_worker(void *arg)
+{
+	unsigned char fill[PLAY_FRAMELEN];
+	struct play_frame *f;
+	uint64_t t,next=0,last_arrival=0,spurt_start=0;
+	double period=PLAY_PERIOD_US; /* estimated frame period */
+	double jitter=0; /* estimated arrival jitter */
+	double d;
+	int playing=0; /* 0 - buffering, 1 - playing a talk spurt */
+	unsigned int call=0;
+	unsigned int head,depth,target;
+	int i;
+
+	make_fill_frame(fill);
+	do_popen();
+	while(1) {
+		head=__atomic_load_n(&playring.head,__ATOMIC_ACQUIRE);
+		depth=head-playring.tail;
+		t=now_us();
+
+		if (!depth) {
+			if ((playing)&&(t-last_arrival>(uint64_t)period*4)) {
+				/* end of the talk spurt, push it through the decoder */
+				for (i=0;i<play_flushframes;i++) play_write(fill);
+				playing=0;
+			}
+			play_wait(head,playing?last_arrival+(uint64_t)period*4:0);
+			continue;
+		}
+
+		f=&playring.slots[playring.tail&(PLAY_RINGSIZE-1)];
+
+		/* update the estimates from the arrival times */
+		if ((last_arrival)&&(f->call==call)&&(f->arrival>last_arrival)&&(f->arrival-last_arrival<1000000)) {
+			d=f->arrival-last_arrival;
+			if (d>period/4) period+=(d-period)/64;
+			jitter+=((d>period?d-period:period-d)-jitter)/16;
+		}
+		if ((f->call!=call)||(f->arrival-last_arrival>(uint64_t)period*4)) {
+			/* new talk spurt (or another call), start buffering */
+			if ((playing)&&(f->call!=call)) for (i=0;i<play_flushframes;i++) play_write(fill);
+			call=f->call;
+			playing=0;
+			spurt_start=f->arrival;
+		}
+		last_arrival=f->arrival;
+
+		if (!playing) {
+			/* how long to buffer: the period plus a few times the jitter */
+			target=(period+3*jitter)/1000;
+			if (target<play_mindelay) target=play_mindelay;
+			if (target>play_maxdelay) target=play_maxdelay;
+			if ((depth*period/1000<target)&&(t<spurt_start+target*1000)) {
+				play_wait(head,spurt_start+target*1000);
+				continue;
+			}
+			playing=1;
+			next=t;
+		}
+
+		/* pace the frames, unless we are way behind */
+		if (t<next) {
+			if (depth*period/1000<(unsigned int)play_maxdelay) {
+				play_wait(head,next);
+				/* a new frame could have started another spurt, recheck */
+				if (now_us()<next) continue;
+			} else {
+				next=t;
+			}
+		}
+		play_write(f->data);
+		__atomic_store_n(&playring.tail,playring.tail+1,__ATOMIC_RELEASE);
+		next+=period;
+		if (next<t) next=t; /* underrun, don't try to catch up */
+	}
+	return(NULL);
+}
+
+/* 
+ * the mixer, used instead of play_worker() when more than one call is 
+ * played at a time. every channel has its own decoder (mix_decoder, 
+ * ACELP frames in, 8kHz 16 bit PCM out) which gets the frames as soon as 
+ * they come. the decoded audio waits in a buffer for each channel, and 
+ * every MIX_TICK_MS the channels are added up, each with the gain of its 
+ * call, and written to one player (mix_player). a channel starts to play 
+ * after play_mindelay ms of audio are buffered, this is its jitter buffer
+ */
+#define MIX_RATE 8000
+#define MIX_TICK_MS 20
+#define MIX_TICK (MIX_RATE*MIX_TICK_MS/1000)
+#define MIX_BUFLEN (MIX_RATE*2) /* 2 seconds of audio for each channel */
+
+struct mix_chan {
+	pid_t pid; /* of the decoder, 0 if it isn't running */
+	int in; /* frames to the decoder */
+	int out; /* audio from the decoder */
+	int16_t pcm[MIX_BUFLEN];
+	unsigned int head,tail;
+	unsigned char partial; /* half of a sample from the last read */
+	int have_partial;
+	int started; /* enough was buffered, playing */
+	unsigned int call;
+	float gain;
+	uint64_t last_arrival;
+	int flushed; /* the fill frames were written after the last frame */
+};
+
+struct mix_chan mixchans[MAXMIX];
+FILE *mixfp=NULL;
+
+void mix_error()
+{
+	__atomic_store_n(&play_error,1,__ATOMIC_RELEASE);
+	stats_add(&stats_play_errors,1);
+}
+
+int mix_spawn(struct mix_chan *c)
+{
+	char *argv[]={ "sh","-c",mix_decoder,NULL };
+	extern char **environ;
+	posix_spawn_file_actions_t fa;
+	posix_spawnattr_t attr;
+	sigset_t sigs;
+	int pin[2],pout[2];
+	int r;
+
+	if (pipe2(pin,O_CLOEXEC)==-1) return(0);
+	if (pipe2(pout,O_CLOEXEC)==-1) {
+		close(pin[0]);
+		close(pin[1]);
+		return(0);
+	}
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_adddup2(&fa,pin[0],0);
+	posix_spawn_file_actions_adddup2(&fa,pout[1],1);
+	posix_spawn_file_actions_addopen(&fa,2,"/dev/null",O_WRONLY,0);
+	/* SIGPIPE is ignored by us, but the pipeline needs it */
+	sigemptyset(&sigs);
+	sigaddset(&sigs,SIGPIPE);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigdefault(&attr,&sigs);
+	posix_spawnattr_setflags(&attr,POSIX_SPAWN_SETSIGDEF);
+	r=posix_spawn(&c->pid,"/bin/sh",&fa,&attr,argv,environ);
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&fa);
+	close(pin[0]);
+	close(pout[1]);
+	if (r) {
+		close(pin[1]);
+		close(pout[0]);
+		c->pid=0;
+		return(0);
+	}
+	c->in=pin[1];
+	c->out=pout[0];
+	fcntl(c->in,F_SETFL,O_NONBLOCK);
+	fcntl(c->out,F_SETFL,O_NONBLOCK);
+	return(1);
+}
+
+void mix_close(struct mix_chan *c)
+{
+	if (!c->pid) return;
+	close(c->in);
+	close(c->out);
+	while ((waitpid(c->pid,NULL,0)==-1)&&(errno==EINTR));
+	c->pid=0;
+	c->head=c->tail=0;
+	c->have_partial=0;
+	c->started=0;
+}
+
+/* a frame to the decoder of its channel */
+void mix_frame(struct play_frame *f)
+{
+	struct mix_chan *c=&mixchans[f->chan];
+
+	if ((!c->pid)&&(!mix_spawn(c))) {
+		mix_error();
+		return;
+	}
+	if (f->call!=c->call) {
+		/* another call, what is left of the previous one can go */
+		c->call=f->call;
+		c->tail=c->head;
+		c->started=0;
+	}
+	c->gain=f->gain;
+	c->last_arrival=f->arrival;
+	c->flushed=0;
+	/* less than PIPE_BUF, so it is written completely or not at all */
+	if (write(c->in,f->data,PLAY_FRAMELEN)!=PLAY_FRAMELEN) {
+		mix_error();
+		if (errno!=EAGAIN) mix_close(c);
+	}
+}
+
+/* take what the decoder has for us */
+void mix_read(struct mix_chan *c)
+{
+	unsigned char buf[4096+1];
+	int len,i;
+
+	if (c->have_partial) buf[0]=c->partial;
+	len=read(c->out,buf+c->have_partial,sizeof(buf)-1);
+	if (len<=0) {
+		if ((len==0)||(errno!=EAGAIN)) {
+			mix_error();
+			mix_close(c);
+		}
+		return;
+	}
+	len+=c->have_partial;
+	for (i=0;i+1<len;i+=2) {
+		if (c->head-c->tail>=MIX_BUFLEN) c->tail++; /* drop the oldest */
+		c->pcm[c->head%MIX_BUFLEN]=(int16_t)(buf[i]|(buf[i+1]<<8));
+		c->head++;
+	}
+	c->have_partial=len&1;
+	if (c->have_partial) c->partial=buf[len-1];
+}
+
+/* mix MIX_TICK samples of all channels and play them */
+void mix_tick(uint64_t t)
+{
+	unsigned char fill[PLAY_FRAMELEN];
+	int32_t sum[MIX_TICK];
+	int16_t out[MIX_TICK];
+	struct mix_chan *c;
+	unsigned int avail,n,j;
+	int i,k;
+	int active=0;
+
+	memset(sum,0,sizeof(sum));
+	for (i=0;i<mix_channels;i++) {
+		c=&mixchans[i];
+		if (!c->pid) continue;
+		if ((!c->flushed)&&(t-c->last_arrival>PLAY_PERIOD_US*4)) {
+			/* end of the talk spurt, push it through the decoder */
+			make_fill_frame(fill);
+			for (k=0;k<play_flushframes;k++) write(c->in,fill,PLAY_FRAMELEN);
+			c->flushed=1;
+		}
+		avail=c->head-c->tail;
+		if ((!c->started)&&(avail<(unsigned int)play_mindelay*MIX_RATE/1000)&&(t-c->last_arrival<PLAY_PERIOD_US*4)) continue;
+		if (!avail) {
+			c->started=0;
+			continue;
+		}
+		c->started=1;
+		n=(avail<MIX_TICK)?avail:MIX_TICK;
+		for (j=0;j<n;j++) sum[j]+=c->pcm[(c->tail+j)%MIX_BUFLEN]*c->gain;
+		c->tail+=n;
+		active=1;
+	}
+	if (!active) return;
+	for (j=0;j<MIX_TICK;j++) out[j]=(sum[j]>32767)?32767:((sum[j]<-32768)?-32768:sum[j]);
+	if (!mixfp) {
+		mixfp=popen(mix_player,"w");
+		if (!mixfp) {
+			mix_error();
+			return;
+		}
+	}
+	fwrite(out,sizeof(int16_t),MIX_TICK,mixfp);
+	fflush(mixfp);
+	if (ferror(mixfp)) {
+		mix_error();
+		pclose(mixfp);
+		mixfp=NULL;
+	}
+}
+
+void *mix_worker(void *arg)
+{
+	struct pollfd pfd[MAXMIX+1];
+	int map[MAXMIX+1];
+	uint64_t next,t,cnt;
+	unsigned int head;
+	int i,n;
+
+	next=now_us()+MIX_TICK_MS*1000;
+	while(1) {
+		head=__atomic_load_n(&playring.head,__ATOMIC_ACQUIRE);
+		while(playring.tail!=head) {
+			mix_frame(&playring.slots[playring.tail&(PLAY_RINGSIZE-1)]);
+			__atomic_store_n(&playring.tail,playring.tail+1,__ATOMIC_RELEASE);
+		}
+		t=now_us();
+		if (t>=next) {
+			mix_tick(t);
+			next+=MIX_TICK_MS*1000;
+			if (next<t) next=t+MIX_TICK_MS*1000; /* don't try to catch up */
+			continue;
+		}
+		/* wait for frames, audio from the decoders or the next tick */
+		pfd[0].fd=play_evfd;
+		pfd[0].events=POLLIN;
+		n=1;
+		for (i=0;i<mix_channels;i++) {
+			if (!mixchans[i].pid) continue;
+			pfd[n].fd=mixchans[i].out;
+			pfd[n].events=POLLIN;
+			map[n++]=i;
+		}
+		__atomic_store_n(&play_sleeping,1,__ATOMIC_SEQ_CST);
+		if ((head==__atomic_load_n(&playring.head,__ATOMIC_SEQ_CST))&&(poll(pfd,n,(next-t+999)/1000)>0)) {
+			for (i=1;i<n;i++) if (pfd[i].revents) mix_read(&mixchans[map[i]]);
+		}
+		__atomic_store_n(&play_sleeping,0,__ATOMIC_SEQ_CST);
+		read(play_evfd,&cnt,sizeof(cnt));
+	}
+	return(NULL);
+}
+
+void init_playback()
+{
+	play_evfd=eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+	if (mix_channels>1) {
+		pthread_create(&play_thread,NULL,mix_worker,NULL);
+	} else {
+		pthread_create(&play_thread,NULL,play_worker,NULL);
+	}
+}
+
+
+#define BURST_TIMEOUT (TICKS_PER_SEC/2) /* signal is lost after this many ticks without bursts */
+
+time_t expire_burst(struct wtimer *tm,time_t now)
+{
+	net=tm->ctx;
+	if (now<net->last_burst_tick+BURST_TIMEOUT) return(net->last_burst_tick+BURST_TIMEOUT);
+	net->last_burst=0;
+	if (nnets>1) {
+		status_printf("NET:%i Signal lost\n",net->id+1);
+	} else {
+		status_printf("Signal lost\n");
+	}
+	updopis(); 
+	return(0);
+}
+
+/* the things that are checked every second */
+/* what was lost since the last time, at most once a second so that this doesn't flood the screen */
+void report_losses()
+{
+	struct tetra_net *n;
+	struct rxseq *r;
+	unsigned long q;
+	uint32_t d;
+	int i,j;
+
+	q=__atomic_load_n(&stats_recvq_dropped,__ATOMIC_RELAXED);
+	if (q!=recvq_dropped_shown) {
+		status_printf("receive queue full, %lu datagrams dropped (try a bigger TETRA_RECV_QUEUE)\n",q-recvq_dropped_shown);
+		recvq_dropped_shown=q;
+	}
+	for (i=0;i<nnets;i++) {
+		n=&nets[i];
+		d=__atomic_load_n(&n->kernel_dropped,__ATOMIC_RELAXED);
+		if (d!=n->kernel_dropped_shown) {
+			status_printf("port %i: %u datagrams dropped by the kernel (try a bigger TETRA_RCVBUF)\n",
+					n->port,d-n->kernel_dropped_shown);
+			n->kernel_dropped_shown=d;
+		}
+		for (j=0;j<n->nrxseq;j++) {
+			r=&n->rxseq[j];
+			if (r->lost==r->lost_shown) continue;
+			status_printf("port %i RX %i: %lu messages lost\n",n->port,r->rxid,r->lost-r->lost_shown);
+			r->lost_shown=r->lost;
+		}
+	}
+}
+
+void write_stats();
+
+void api_publish();
+
+time_t housekeeping(struct wtimer *tm,time_t now)
+{
+	if (__atomic_exchange_n(&play_error,0,__ATOMIC_ACQ_REL)) {
+		status_printf("PLAYBACK PROBLEM!! (fix tplay)\n");
+		stop_playing();
+		ref=1;
+	}
+	poll_reload();
+	if (log_dropped()!=log_dropped_shown) {
+		log_dropped_shown=log_dropped();
+		status_printf("log queue full, %lu lines dropped so far\n",log_dropped_shown);
+		updopis();
+	}
+	if (__atomic_load_n(&tc_failed,__ATOMIC_RELAXED)!=tc_failed_shown) {
+		tc_failed_shown=__atomic_load_n(&tc_failed,__ATOMIC_RELAXED);
+		status_printf("transcoding failed, %lu recordings left in place\n",tc_failed_shown);
+		updopis();
+	}
+	if (__atomic_load_n(&rec_failed,__ATOMIC_RELAXED)!=rec_failed_shown) {
+		rec_failed_shown=__atomic_load_n(&rec_failed,__ATOMIC_RELAXED);
+		status_printf("writing recordings failed, %lu times so far\n",rec_failed_shown);
+		ref=1;
+	}
+	if (reload_evfd==-1) install_reloaded();
+	if ((display_state==DISPLAY_FREQ)&&(dispnet->freq_changed)) display_freq();
+	if (locked) {
+		if (arb_held()) arb_beat(play_maxprio());
+		else play_lost();
+	} else if ((arb)&&(arb_held())) {
+		/* it was handed to us after our calls were over, pass it on */
+		if ((arb_me==-1)||(arb->slots[arb_me].want+ARB_WANT<now/TICKS_PER_SEC)) releaselock();
+	}
+	report_losses();
+	if (capture_file) capture_flush();
+	write_stats();
+	api_publish();
+	return(now+TICKS_PER_SEC);
+}
+
+void init_timers()
+{
+	int i;
+
+	sched.now=now_tick();
+	for (i=0;i<nnets;i++) {
+		timer_init(&nets[i].burst_timer,expire_burst,&nets[i]);
+		timer_init(&nets[i].kml_timer,expire_kml,&nets[i]);
+		timer_init(&nets[i].loc_timer,expire_locations,&nets[i]);
+	}
+	timer_init(&curplaying_timer,expire_curplaying,NULL);
+	timer_init(&housekeeping_timer,housekeeping,NULL);
+	timer_arm(&housekeeping_timer,sched.now+TICKS_PER_SEC);
+}
+
+/* run the timers which are due, and set up the timerfd for the next one */
+void run_timers(int tfd)
+{
+	static time_t armed=0;
+	struct itimerspec its;
+	time_t next;
+
+	wheel_run(&sched,now_tick());
+	next=wheel_next(&sched);
+	if (next==armed) return;
+	memset(&its,0,sizeof(its));
+	its.it_value.tv_sec=next/TICKS_PER_SEC;
+	its.it_value.tv_nsec=(next%TICKS_PER_SEC)*(1000000000/TICKS_PER_SEC);
+	timerfd_settime(tfd,TFD_TIMER_ABSTIME,&its,NULL);
+	armed=next;
+}
+
+int filter_input=0; /* the keys are being typed into the filter */
+char filter_buf[BUFLEN];
+int filter_len=0;
+
+/* line editing for the filter, like wgetnstr() would do it */
+void filter_key(unsigned char r)
+{
+	switch(r) {
+		case '\r':
+		case '\n':
+			filter_buf[filter_len]=0;
+			set_filter(compile_filter(filter_buf));
+			filter_input=0;
+			status_printf("\n");
+			updopis();
+			break;
+		case 27: /* escape, leave the filter as it was */
+			filter_input=0;
+			status_printf("\n");
+			break;
+		case 8:
+		case 127:
+			if (filter_len) {
+				filter_len--;
+				status_printf("\b \b");
+			}
+			break;
+		default:
+			if ((r>=' ')&&(filter_len<sizeof(ssi_filter)-1)) {
+				filter_buf[filter_len++]=r;
+				status_printf("%c",r);
+			}
+	}
+}
+
+void keyf(unsigned char r)
+{
+	int i;
+	time_t tp;
+	char tmpstr[40];
+	char tmpstr2[80];
+	if (filter_input) {
+		filter_key(r);
+		return;
+	}
+	switch (r) {
+		case 'l':
+			do_log=!do_log;
+			updopis();
+
+			tp=time(0);
+			strftime(tmpstr,sizeof(tmpstr),"%Y%m%d %H:%M:%S",localtime(&tp));
+			if (do_log)
+			{
+				sprintf(tmpstr2,"%s **** log start ****",tmpstr);
+			} else {
+
+				sprintf(tmpstr2,"%s **** log end ****",tmpstr);
+			}
+			for (i=0;i<nnets;i++) {
+				net=&nets[i];
+				appendlog(tmpstr2);
+			}
 			break;
 		case 'M':
 			ps_mute=!ps_mute;
@@ -1060,26 +4397,21 @@ void keyf(unsigned char r)
 			updopis();
 			break;
 		case 'r': /* refresh screen */
-			redrawwin(statuswin);
-			redrawwin(msgwin);
-			redrawwin(mainwin);
+			ui_pending|=UI_REDRAW;
+			ref=1;
 			break;
 		case 's': /* stop current playing, find another one */
-			if (curplayingidx)
+			if (play_busy())
 			{
-				ssis[curplayingidx].active=0;
-				ssis[curplayingidx].play=0;
-				if (verbose>0) wprintw(statuswin,"STOP PLAYING %i\n",curplayingidx);
-				updidx(curplayingidx);
-				curplayingidx=0;
-				findtoplay(curplayingidx+1);
+				stop_playing();
 				ref=1;
 			}
 			break;
 		case 'F':
-			wprintw(statuswin,"Filter: ");
-			wgetnstr(statuswin,ssi_filter,sizeof(ssi_filter)-1);
-			updopis();
+			/* the following keys go to the filter, until enter is pressed */
+			status_printf("Filter: ");
+			filter_input=1;
+			filter_len=0;
 			break;
 		case 'f':
 			switch(use_filter)
@@ -1095,11 +4427,9 @@ void keyf(unsigned char r)
 			if (display_state==DISPLAY_END) display_state=DISPLAY_IDX;
 			switch(display_state) {
 				case DISPLAY_IDX:
-					displayedwin=mainwin;
 					display_mainwin();
 					break;
 				case DISPLAY_FREQ:
-					displayedwin=freqwin;
 					display_freq();
 					break;
 				default:
@@ -1107,301 +4437,1700 @@ void keyf(unsigned char r)
 			}
 			ref=1;
 
+			break;
+		case 'c': /* show the usage identifiers of the next cell */
+			if (dispnet->ncells<2) break;
+			dispcell=(dispcell+1)%dispnet->ncells;
+			status_printf("showing cell %i/%i (RX %i)\n",dispcell+1,dispnet->ncells,dispnet->cells[dispcell]->rxid);
+			updopis();
+			display_mainwin();
+			ref=1;
+			break;
+		case 'n': /* show the next network */
+			if (nnets<2) break;
+			dispnet=&nets[(dispnet->id+1)%nnets];
+			dispcell=0;
+			status_printf("showing network %i/%i (port %i)\n",dispnet->id+1,nnets,dispnet->port);
+			updopis();
+			if (display_state==DISPLAY_FREQ) {
+				display_freq();
+			} else {
+				display_mainwin();
+			}
+			ref=1;
 			break;
 		case 'z':
-			clear_all_freqtable();
-			clear_all_receivers();
-			clear_locations();
-			if (displayedwin==freqwin) display_freq();
-			wprintw(statuswin,"cleared frequency and location info\n");
+			for (i=0;i<nnets;i++) {
+				net=&nets[i];
+				clear_all_freqtable();
+				clear_all_receivers();
+				clear_locations();
+			}
+			if (display_state==DISPLAY_FREQ) display_freq();
+			status_printf("cleared frequency and location info\n");
 			ref=1;
 			break;
 		case '?':
-			wprintw(statuswin,"HELP: ");
-			wprintw(statuswin,"m-mutessi  M-mute   R-record   a-alldump  ");
-			wprintw(statuswin,"r-refresh  s-stop play  l-log v/V-less/more verbose\n");
-			wprintw(statuswin,"f-enable/disable/invert filter F-enter filter t-toggle windows\n");
-			wprintw(statuswin,"z-forget learned info\n");
+			status_printf("HELP: ");
+			status_printf("m-mutessi  M-mute   R-record   a-alldump  ");
+			status_printf("r-refresh  s-stop play  l-log v/V-less/more verbose\n");
+			status_printf("f-enable/disable/invert filter F-enter filter t-toggle windows\n");
+			status_printf("z-forget learned info n-next network c-next cell\n");
 			ref=1;
 			break;
 		default: 
-			wprintw(statuswin,"unknown key [%c] 0x%2.2x\n",r,r);
+			status_printf("unknown key [%c] 0x%2.2x\n",r,r);
 			ref=1;
 	}
 }
 
-/*************** message parsing ****************/
+/*************** message parsing ****************/
+
+char *getptr(char *s,char *id)
+{
+	char *c;
+	c=strstr(s,id);
+	if (c) return(c+strlen(id));
+	return(0);
+}
+
+int getptrint(char *s,char *id,int base)
+{
+	char *c;
+	c=getptr(s,id);
+	if (!c) return(0); /* albo moze -1 byloby lepiej? */
+	return(strtol(c, (char **) NULL, base));
+}
+
+/* 
+ * find a marker (like TETMON_begin) in a buffer of known length. 
+ * with SSE2 we compare the first and last byte of the marker at 16 
+ * positions at once, and only check the whole marker where both match
+ */
+char *find_marker(char *buf,int len,char *marker,int mlen)
+{
+	int i=0;
+#ifdef __SSE2__
+	__m128i first=_mm_set1_epi8(marker[0]);
+	__m128i last=_mm_set1_epi8(marker[mlen-1]);
+	__m128i a,b;
+	unsigned int mask;
+	int bit;
+
+	for (;i+mlen-1+16<=len;i+=16) {
+		a=_mm_cmpeq_epi8(first,_mm_loadu_si128((__m128i *)(buf+i)));
+		b=_mm_cmpeq_epi8(last,_mm_loadu_si128((__m128i *)(buf+i+mlen-1)));
+		mask=_mm_movemask_epi8(_mm_and_si128(a,b));
+		while(mask) {
+			bit=__builtin_ctz(mask);
+			if (!memcmp(buf+i+bit+1,marker+1,mlen-2)) return(buf+i+bit);
+			mask&=mask-1;
+		}
+	}
+#endif
+	for (;i+mlen<=len;i++) {
+		if ((buf[i]==marker[0])&&(!memcmp(buf+i,marker,mlen))) return(buf+i);
+	}
+	return(NULL);
+}
+
+/* 
+ * the framing markers are almost always at the very beginning and the 
+ * very end of the datagram, so check there first (so with more than one 
+ * TETMON_end in a datagram we now take the last one). like the strstr() 
+ * that we used before, don't look past the first 0 (traffic frames 
+ * have one right after the header)
+ */
+char *tetmon_begin(char *buf,int len)
+{
+	if ((len>=12)&&(!memcmp(buf,"TETMON_begin",12))) return(buf);
+	return(find_marker(buf,strnlen(buf,len),"TETMON_begin",12));
+}
+
+char *tetmon_end(char *c,int len)
+{
+	int n=strnlen(c,len);
+	int i=n;
+
+	while((i>0)&&((unsigned char)c[i-1]<=' ')) i--;
+	if ((i>=10)&&(!memcmp(c+i-10,"TETMON_end",10))) return(c+i-10);
+	return(find_marker(c,n,"TETMON_end",10));
+}
+
+/* 
+ * event stream: local consumers connect to the events unix socket, and 
+ * get one JSON line for every call setup, connect and release, SDS, 
+ * location report, change of the network info and AFC report. they can 
+ * send a line like "type=sds,location ssi=1000,2000" at any time to 
+ * get only some of them (an empty line gets everything again). an event 
+ * is only made if someone wants its type, it is formatted once, and 
+ * handed to the events thread through a ring buffer. the events thread 
+ * queues a reference to it for every subscriber that wants it, so it is 
+ * never copied. a subscriber whose queue fills up is dropped, so a slow 
+ * one never stalls telive or the others
+ */
+#define EVT_SETUP 0
+#define EVT_CONNECT 1
+#define EVT_RELEASE 2
+#define EVT_SDS 3
+#define EVT_LOCATION 4
+#define EVT_NETINFO 5
+#define EVT_AFC 6
+#define EVT_SETUP_SSI 7 /* an SSI of a call being set up (DSETUPDEC), the setup itself is EVT_SETUP */
+#define EVT_MAX 8
+#define EVT_DEFAULT (((1<<EVT_MAX)-1)&~(1<<EVT_AFC)) /* without a type= line, afc comes too often for that */
+#define EV_RING 4096 /* events between the main loop and the events thread, must be a power of 2 */
+#define EV_SUBQUEUE 1024 /* events waiting for one subscriber, must be a power of 2 */
+#define EV_MAXSUBS 32
+#define EV_MAXSSI 64 /* SSIs in a subscription */
+
+const char *event_names[EVT_MAX]={ "setup","connect","release","sds","location","netinfo","afc","setup_ssi" };
+
+struct event {
+	int refs; /* only used by the events thread */
+	int type;
+	unsigned int ssi[2];
+	int len;
+	char data[];
+};
+
+struct subscriber {
+	int fd;
+	unsigned int types; /* bit mask of EVT_* */
+	unsigned int ssi[EV_MAXSSI];
+	int nssi; /* 0 - any SSI */
+	char req[256]; /* the subscription line being read */
+	int reqlen;
+	struct event *queue[EV_SUBQUEUE];
+	unsigned int head,tail;
+	int sent; /* bytes of the first event in the queue already sent */
+};
+
+char *events_socket=NULL;
+int events_sock=-1;
+pthread_t events_thread;
+struct event *ev_ring[EV_RING];
+unsigned int ev_head=0; /* main loop */
+unsigned int ev_tail=0; /* events thread */
+int ev_evfd=-1;
+int ev_sleeping=0; /* the events thread waits in poll() */
+unsigned int ev_types=0; /* what the subscribers want, set by the events thread */
+unsigned long stats_events=0;
+unsigned long stats_events_dropped=0; /* the ring was full, or no memory */
+unsigned long stats_subscribers_dropped=0; /* events thread */
+
+static inline int event_wanted(int type)
+{
+	return(__atomic_load_n(&ev_types,__ATOMIC_RELAXED)&(1<<type));
+}
+
+/* 
+ * format and publish an event of the current network, fmt gives the 
+ * fields after the common ones. ssi1 and ssi2 are matched against the 
+ * subscriptions, 0 if none
+ */
+void event_publish(int type,unsigned int ssi1,unsigned int ssi2,const char *fmt,...)
+{
+	char buf[BUFLEN*2];
+	struct event *e;
+	unsigned int head;
+	uint64_t one=1;
+	va_list ap;
+	int n;
+
+	if (!event_wanted(type)) return;
+	head=ev_head;
+	if (head-__atomic_load_n(&ev_tail,__ATOMIC_ACQUIRE)==EV_RING) {
+		stats_events_dropped++;
+		return;
+	}
+	n=snprintf(buf,sizeof(buf),"{\"time\":%li,\"net\":%i,\"type\":\"%s\",",(long)time(0),net->id+1,event_names[type]);
+	va_start(ap,fmt);
+	n+=vsnprintf(buf+n,sizeof(buf)-n-2,fmt,ap);
+	va_end(ap);
+	if (n>sizeof(buf)-3) n=sizeof(buf)-3;
+	buf[n++]='}';
+	buf[n++]='\n';
+	e=malloc(sizeof(struct event)+n);
+	if (!e) {
+		stats_events_dropped++;
+		return;
+	}
+	e->type=type;
+	e->ssi[0]=ssi1;
+	e->ssi[1]=ssi2;
+	e->len=n;
+	memcpy(e->data,buf,n);
+	ev_ring[head&(EV_RING-1)]=e;
+	__atomic_store_n(&ev_head,head+1,__ATOMIC_SEQ_CST);
+	stats_events++;
+	if (__atomic_load_n(&ev_sleeping,__ATOMIC_SEQ_CST)) write(ev_evfd,&one,sizeof(one));
+}
+
+void event_unref(struct event *e)
+{
+	if (!--e->refs) free(e);
+}
+
+int sub_wants(struct subscriber *s,struct event *e)
+{
+	int i;
+
+	if (!(s->types&(1<<e->type))) return(0);
+	if (!s->nssi) return(1);
+	for (i=0;i<s->nssi;i++) if ((s->ssi[i])&&((s->ssi[i]==e->ssi[0])||(s->ssi[i]==e->ssi[1]))) return(1);
+	return(0);
+}
+
+/* a subscription line: type=name,name ssi=n,n */
+void sub_parse(struct subscriber *s,char *line)
+{
+	char *tok,*c,*save1,*save2;
+	int i;
+
+	s->types=EVT_DEFAULT;
+	s->nssi=0;
+	for (tok=strtok_r(line," \t\r",&save1);tok;tok=strtok_r(NULL," \t\r",&save1)) {
+		if ((!strncmp(tok,"type=",5))||(!strncmp(tok,"types=",6))) {
+			s->types=0;
+			for (c=strtok_r(strchr(tok,'=')+1,",",&save2);c;c=strtok_r(NULL,",",&save2)) {
+				for (i=0;i<EVT_MAX;i++) if (!strcmp(c,event_names[i])) s->types|=1<<i;
+			}
+		} else if (!strncmp(tok,"ssi=",4)) {
+			for (c=strtok_r(tok+4,",",&save2);(c)&&(s->nssi<EV_MAXSSI);c=strtok_r(NULL,",",&save2)) {
+				s->ssi[s->nssi++]=strtoul(c,NULL,10);
+			}
+		}
+	}
+}
+
+void sub_close(struct subscriber *s)
+{
+	while(s->tail!=s->head) event_unref(s->queue[s->tail++&(EV_SUBQUEUE-1)]);
+	close(s->fd);
+	s->fd=-1;
+}
+
+/* read subscription lines, returns -1 if the subscriber went away */
+int sub_read(struct subscriber *s)
+{
+	char *nl;
+	int r;
+
+	while(1) {
+		r=read(s->fd,s->req+s->reqlen,sizeof(s->req)-1-s->reqlen);
+		if ((r==0)||((r<0)&&(errno!=EAGAIN))) return(-1);
+		if (r<0) return(0);
+		s->reqlen+=r;
+		s->req[s->reqlen]=0;
+		while((nl=strchr(s->req,'\n'))) {
+			*nl=0;
+			sub_parse(s,s->req);
+			s->reqlen-=nl+1-s->req;
+			memmove(s->req,nl+1,s->reqlen+1);
+		}
+		if (s->reqlen==sizeof(s->req)-1) s->reqlen=0; /* too long, forget it */
+	}
+}
+
+/* write out what is queued, returns -1 if the subscriber went away */
+int sub_write(struct subscriber *s)
+{
+	struct event *e;
+	int r;
+
+	while(s->tail!=s->head) {
+		e=s->queue[s->tail&(EV_SUBQUEUE-1)];
+		r=write(s->fd,e->data+s->sent,e->len-s->sent);
+		if (r<0) return((errno==EAGAIN)?0:-1);
+		s->sent+=r;
+		if (s->sent<e->len) return(0);
+		s->sent=0;
+		s->tail++;
+		event_unref(e);
+	}
+	return(0);
+}
+
+void *events_worker(void *arg)
+{
+	struct subscriber *subs=calloc(EV_MAXSUBS,sizeof(struct subscriber));
+	struct pollfd pfd[EV_MAXSUBS+2];
+	int pidx[EV_MAXSUBS+2];
+	struct subscriber *s;
+	struct event *e;
+	unsigned int types;
+	uint64_t cnt;
+	int i,n,fd;
+
+	for (i=0;i<EV_MAXSUBS;i++) subs[i].fd=-1;
+	while(1) {
+		pfd[0].fd=events_sock;
+		pfd[0].events=POLLIN;
+		pfd[1].fd=ev_evfd;
+		pfd[1].events=POLLIN;
+		n=2;
+		for (i=0;i<EV_MAXSUBS;i++) {
+			if (subs[i].fd==-1) continue;
+			pfd[n].fd=subs[i].fd;
+			pfd[n].events=POLLIN|((subs[i].head!=subs[i].tail)?POLLOUT:0);
+			pidx[n++]=i;
+		}
+		__atomic_store_n(&ev_sleeping,1,__ATOMIC_SEQ_CST);
+		poll(pfd,n,(__atomic_load_n(&ev_head,__ATOMIC_SEQ_CST)!=ev_tail)?0:1000);
+		__atomic_store_n(&ev_sleeping,0,__ATOMIC_SEQ_CST);
+		if (pfd[1].revents&POLLIN) read(ev_evfd,&cnt,sizeof(cnt));
+
+		/* new events go to everyone who wants them */
+		while(ev_tail!=__atomic_load_n(&ev_head,__ATOMIC_ACQUIRE)) {
+			e=ev_ring[ev_tail&(EV_RING-1)];
+			__atomic_store_n(&ev_tail,ev_tail+1,__ATOMIC_RELEASE);
+			e->refs=1;
+			for (i=0;i<EV_MAXSUBS;i++) {
+				s=&subs[i];
+				if ((s->fd==-1)||(!sub_wants(s,e))) continue;
+				if (s->head-s->tail==EV_SUBQUEUE) {
+					/* too slow */
+					sub_close(s);
+					__atomic_add_fetch(&stats_subscribers_dropped,1,__ATOMIC_RELAXED);
+					continue;
+				}
+				e->refs++;
+				s->queue[s->head++&(EV_SUBQUEUE-1)]=e;
+			}
+			event_unref(e);
+		}
+
+		for (i=2;i<n;i++) {
+			s=&subs[pidx[i]];
+			if (s->fd==-1) continue;
+			if ((pfd[i].revents&(POLLIN|POLLHUP|POLLERR))&&(sub_read(s)==-1)) {
+				sub_close(s);
+				continue;
+			}
+			if (sub_write(s)==-1) sub_close(s);
+		}
+		while((fd=accept4(events_sock,NULL,NULL,SOCK_NONBLOCK|SOCK_CLOEXEC))!=-1) {
+			for (i=0;(i<EV_MAXSUBS)&&(subs[i].fd!=-1);i++);
+			if (i==EV_MAXSUBS) {
+				close(fd);
+				continue;
+			}
+			memset(&subs[i],0,sizeof(struct subscriber));
+			subs[i].fd=fd;
+			subs[i].types=EVT_DEFAULT;
+		}
+		types=0;
+		for (i=0;i<EV_MAXSUBS;i++) if (subs[i].fd!=-1) types|=subs[i].types;
+		__atomic_store_n(&ev_types,types,__ATOMIC_RELAXED);
+	}
+	return(NULL);
+}
+
+void init_events()
+{
+	struct sockaddr_un sa;
+
+	if (!events_socket) return;
+	memset(&sa,0,sizeof(sa));
+	sa.sun_family=AF_UNIX;
+	strncpy(sa.sun_path,events_socket,sizeof(sa.sun_path)-1);
+	unlink(events_socket);
+	events_sock=socket(AF_UNIX,SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0);
+	if (events_sock==-1) diep("events socket");
+	if (bind(events_sock,(struct sockaddr *)&sa,sizeof(sa))==-1) diep("events socket bind");
+	if (listen(events_sock,EV_MAXSUBS)==-1) diep("events socket listen");
+	ev_evfd=eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+	pthread_create(&events_thread,NULL,events_worker,NULL);
+}
+
+/* 
+ * TETMON messages are a list of KEY:value tokens separated by spaces. 
+ * tetmon_tokenize() goes through the message once and remembers where 
+ * the value of each key that we care about starts (only the first 
+ * occurence counts, just like with getptr()). the keys are found with a 
+ * small hash table, and the FUNC value is also looked up in a table, 
+ * which tells parsestat() what to do with the message
+ */
+enum tetmon_field { TMF_FUNC, TMF_IDT, TMF_SSI, TMF_IDX, TMF_ENCR, TMF_RX, TMF_AFC, 
+	TMF_MCC, TMF_MNC, TMF_CCODE, TMF_DLF, TMF_ULF, TMF_LA, 
+	TMF_CALLINGSSI, TMF_CALLEDSSI, TMF_DATA, TMF_LAT, TMF_LON, TMF_SEQ, TMF_MAX };
+
+struct tetmon_msg {
+	char *msg;
+	char *val[TMF_MAX]; /* start of the value, or NULL if there was no such key */
+	int func; /* index in tetmon_funcs[], or -1 */
+	/* binary records: which fields came as numbers, msg is made only when needed */
+	unsigned int bin;
+	int num[TMF_MAX];
+	int tmb_func;
+	char *text;
+	int textlen;
+};
+
+struct tetmon_key {
+	char *name;
+	int len;
+	int id;
+	int base; /* how the value is written in the text messages */
+};
+
+struct tetmon_key tetmon_keys[]={
+	{ "FUNC",4,TMF_FUNC,10 },
+	{ "IDT",3,TMF_IDT,10 },
+	{ "SSI",3,TMF_SSI,10 },
+	{ "IDX",3,TMF_IDX,10 },
+	{ "ENCR",4,TMF_ENCR,10 },
+	{ "RX",2,TMF_RX,10 },
+	{ "AFC",3,TMF_AFC,10 },
+	{ "MCC",3,TMF_MCC,16 },
+	{ "MNC",3,TMF_MNC,16 },
+	{ "CCODE",5,TMF_CCODE,16 },
+	{ "DLF",3,TMF_DLF,10 },
+	{ "ULF",3,TMF_ULF,10 },
+	{ "LA",2,TMF_LA,10 },
+	{ "CallingSSI",10,TMF_CALLINGSSI,10 },
+	{ "CalledSSI",9,TMF_CALLEDSSI,10 },
+	{ "DATA",4,TMF_DATA,10 },
+	{ "lat",3,TMF_LAT,10 },
+	{ "lon",3,TMF_LON,10 },
+	{ "SEQ",3,TMF_SEQ,10 },
+	{ NULL,0,0,0 }
+};
+
+int parse_burst(struct tetmon_msg *m);
+int parse_afcval(struct tetmon_msg *m);
+int parse_netinfo(struct tetmon_msg *m);
+int parse_freqinfo1(struct tetmon_msg *m);
+int parse_freqinfo2(struct tetmon_msg *m);
+int parse_dsetupdec(struct tetmon_msg *m);
+int parse_sdsdec(struct tetmon_msg *m);
+int parse_dsetup(struct tetmon_msg *m);
+int parse_dconnect(struct tetmon_msg *m);
+int parse_drelease(struct tetmon_msg *m);
+
+/* 
+ * what to do for each FUNC. the handler returns the write flag: 
+ * 1 - log the message, 0 - log only with alldump, -1 - never log
+ */
+struct tetmon_func {
+	char *name;
+	int len;
+	int (*handler)(struct tetmon_msg *m);
+};
+
+struct tetmon_func tetmon_funcs[]={
+	{ "BURST",5,parse_burst },
+	{ "AFCVAL",6,parse_afcval },
+	{ "NETINFO",7,parse_netinfo },
+	{ "FREQINFO1",9,parse_freqinfo1 },
+	{ "FREQINFO2",9,parse_freqinfo2 },
+	{ "DSETUPDEC",9,parse_dsetupdec },
+	{ "SDSDEC",6,parse_sdsdec },
+	{ "D-SETUP",7,parse_dsetup },
+	{ "D-CONNECT",9,parse_dconnect },
+	{ "D-RELEASE",9,parse_drelease },
+	{ NULL,0,NULL }
+};
+
+/* messages for each FUNC, the ones not in tetmon_funcs[] are counted in the last one */
+#define STATS_OTHER_FUNC (sizeof(tetmon_funcs)/sizeof(tetmon_funcs[0])-1)
+unsigned long stats_func[STATS_OTHER_FUNC+1];
+
+#define TM_HASHSIZE 64
+signed char tm_keyhash[TM_HASHSIZE];
+signed char tm_funchash[TM_HASHSIZE];
+signed char tmb_funcidx[TMB_FUNC_MAX]; /* index in tetmon_funcs[] for each binary FUNC code */
+
+static inline unsigned int tm_hash(char *s,int len)
+{
+	return((len*7+s[0]*3+s[len-1])&(TM_HASHSIZE-1));
+}
+
+/* build the lookup tables, collisions go to the next free slot */
+void init_tetmon()
+{
+	int i,j;
+	unsigned int h;
+
+	memset(tm_keyhash,-1,sizeof(tm_keyhash));
+	memset(tm_funchash,-1,sizeof(tm_funchash));
+	for (i=0;tetmon_keys[i].name;i++) {
+		h=tm_hash(tetmon_keys[i].name,tetmon_keys[i].len);
+		while(tm_keyhash[h]!=-1) h=(h+1)&(TM_HASHSIZE-1);
+		tm_keyhash[h]=i;
+	}
+	for (i=0;tetmon_funcs[i].name;i++) {
+		h=tm_hash(tetmon_funcs[i].name,tetmon_funcs[i].len);
+		while(tm_funchash[h]!=-1) h=(h+1)&(TM_HASHSIZE-1);
+		tm_funchash[h]=i;
+	}
+	for (j=0;j<TMB_FUNC_MAX;j++) {
+		tmb_funcidx[j]=-1;
+		if (!tmb_func_names[j]) continue;
+		for (i=0;tetmon_funcs[i].name;i++) 
+			if (!strcmp(tetmon_funcs[i].name,tmb_func_names[j])) tmb_funcidx[j]=i;
+	}
+}
+
+static inline int tm_lookup_key(char *k,int len)
+{
+	unsigned int h=tm_hash(k,len);
+	struct tetmon_key *e;
+	while(tm_keyhash[h]!=-1) {
+		e=&tetmon_keys[(int)tm_keyhash[h]];
+		if ((e->len==len)&&(!memcmp(e->name,k,len))) return(e->id);
+		h=(h+1)&(TM_HASHSIZE-1);
+	}
+	return(-1);
+}
+
+static inline int tm_lookup_func(char *f,int len)
+{
+	unsigned int h=tm_hash(f,len);
+	struct tetmon_func *e;
+	while(tm_funchash[h]!=-1) {
+		e=&tetmon_funcs[(int)tm_funchash[h]];
+		if ((e->len==len)&&(!memcmp(e->name,f,len))) return(tm_funchash[h]);
+		h=(h+1)&(TM_HASHSIZE-1);
+	}
+	return(-1);
+}
+
+/* split the message into the field table, the message is not modified */
+void tetmon_tokenize(char *c,struct tetmon_msg *m)
+{
+	char *tok;
+	int id;
+
+	memset(m->val,0,sizeof(m->val));
+	m->msg=c;
+	m->func=-1;
+	m->bin=0;
+	while(1) {
+		while(*c==' ') c++;
+		if (!*c) break;
+		tok=c;
+		while((*c>' ')&&(*c!=':')) c++;
+		if ((*c==':')&&(c>tok)) {
+			id=tm_lookup_key(tok,c-tok);
+			c++;
+			tok=c;
+			while(*c>' ') c++;
+			if ((id<0)||(m->val[id])) continue;
+			m->val[id]=tok;
+			if (id==TMF_FUNC) m->func=tm_lookup_func(tok,c-tok);
+		} else {
+			while(*c>' ') c++;
+		}
+	}
+}
+
+/* the value as a number, like strtol() but without the locale and overflow handling */
+int tm_int(struct tetmon_msg *m,int field,int base)
+{
+	char *c=m->val[field];
+	int neg=0;
+	unsigned long r=0;
+	int d;
+
+	if (m->bin&(1<<field)) return(m->num[field]);
+	if (!c) return(0);
+	if (*c=='-') { neg=1; c++; } else if (*c=='+') c++;
+	if ((base==16)&&(c[0]=='0')&&((c[1]|0x20)=='x')) c+=2;
+	while(1) {
+		if ((*c>='0')&&(*c<='9')) { d=*c-'0'; }
+		else if ((base==16)&&((*c|0x20)>='a')&&((*c|0x20)<='f')) { d=(*c|0x20)-'a'+10; }
+		else break;
+		r=r*base+d;
+		c++;
+	}
+	return(neg?-(int)r:(int)r);
+}
+
+/* the RX of the message, -1 if it doesn't say */
+int tm_rx(struct tetmon_msg *m)
+{
+	if ((!(m->bin&(1<<TMF_RX)))&&(!m->val[TMF_RX])) return(-1);
+	return(tm_int(m,TMF_RX,10));
+}
+
+/* 
+ * binary records (see telive.h). the numbers go straight into num[], so 
+ * nothing has to be parsed. the text form of the message is only made 
+ * when it is logged or shown
+ */
+#define TMB_DATALEN (5+255+1)
+
+/* TMF_* for each binary field code */
+signed char tmb_fields[TMB_FIELD_MAX]={ -1, TMF_IDT, TMF_SSI, TMF_IDX, TMF_ENCR, TMF_RX, TMF_AFC, 
+	TMF_MCC, TMF_MNC, TMF_CCODE, TMF_DLF, TMF_ULF, TMF_LA, 
+	TMF_CALLINGSSI, TMF_CALLEDSSI, TMF_DATA, TMF_LAT, TMF_LON, TMF_SEQ };
+
+/* 
+ * decode the record at p into m, returns the record length or -1 if it 
+ * is broken. DATA is copied to data as DATA:text, like in the text 
+ * messages
+ */
+int tmb_decode(unsigned char *p,int len,struct tetmon_msg *m,char *data)
+{
+	int rlen,i,k,id,flen;
+	unsigned int v;
+	unsigned char *f;
+
+	if ((len<TMB_HDRLEN)||(memcmp(p,TMB_MAGIC,3))||(p[3]!=TMB_VERSION)) return(-1);
+	rlen=(p[4]<<8)|p[5];
+	if ((rlen<TMB_HDRLEN)||(rlen>len)) return(-1);
+	memset(m->val,0,sizeof(m->val));
+	m->msg=NULL;
+	m->bin=0;
+	m->tmb_func=(p[6]<TMB_FUNC_MAX)?p[6]:TMB_NONE;
+	m->func=tmb_funcidx[m->tmb_func];
+	for (i=TMB_HDRLEN;i+2<=rlen;i+=2+flen) {
+		flen=p[i+1];
+		f=p+i+2;
+		if (i+2+flen>rlen) return(-1);
+		if (p[i]>=TMB_FIELD_MAX) continue;
+		id=tmb_fields[p[i]];
+		if ((id<0)||(m->bin&(1<<id))) continue;
+		if (id==TMF_DATA) {
+			memcpy(data,"DATA:",5);
+			memcpy(data+5,f,flen);
+			data[5+flen]=0;
+			m->val[id]=data+5;
+		} else {
+			if ((flen<1)||(flen>4)) continue;
+			v=(f[0]&0x80)?~0U:0;
+			for (k=0;k<flen;k++) v=(v<<8)|f[k];
+			m->num[id]=(int)v;
+		}
+		m->bin|=1<<id;
+	}
+	if (i!=rlen) return(-1);
+	return(rlen);
+}
+
+/* the message text, for binary records it is made from the fields */
+char *tm_text(struct tetmon_msg *m)
+{
+	struct tetmon_key *k;
+	const char *func;
+	int n,v;
+
+	if (m->msg) return(m->msg);
+	func=tmb_func_names[m->tmb_func];
+	n=snprintf(m->text,m->textlen,"FUNC:%s",func?func:"UNKNOWN");
+	for (k=&tetmon_keys[1];(k->name)&&(n<m->textlen);k++) {
+		if (!(m->bin&(1<<k->id))) continue;
+		v=m->num[k->id];
+		switch(k->id) {
+			case TMF_DATA:
+				n+=snprintf(m->text+n,m->textlen-n," DATA:%s",m->val[TMF_DATA]);
+				break;
+			case TMF_LAT:
+				n+=snprintf(m->text+n,m->textlen-n," lat:%.6f%c",abs(v)/1e6,(v<0)?'S':'N');
+				break;
+			case TMF_LON:
+				n+=snprintf(m->text+n,m->textlen-n," lon:%.6f%c",abs(v)/1e6,(v<0)?'W':'E');
+				break;
+			case TMF_SEQ:
+				/* not logged, so that repeated messages are still recognized */
+				break;
+			default:
+				n+=snprintf(m->text+n,m->textlen-n,(k->base==16)?" %s:%x":" %s:%i",k->name,v);
+		}
+	}
+	m->msg=m->text;
+	return(m->msg);
+}
 
-char *getptr(char *s,char *id)
+int parse_burst(struct tetmon_msg *m)
 {
-	char *c;
-	c=strstr(s,id);
-	if (c) return(c+strlen(id));
-	return(0);
+	net->last_burst_tick=now_tick();
+	if (!net->last_burst) {
+		net->last_burst=1;
+		updopis(); 
+		status_printf("Signal found\n");
+		timer_arm(&net->burst_timer,net->last_burst_tick+BURST_TIMEOUT);
+	}
+	/* never log bursts */
+	return(-1);
 }
 
-int getptrint(char *s,char *id,int base)
+int parse_afcval(struct tetmon_msg *m)
 {
-	char *c;
-	c=getptr(s,id);
-	if (!c) return(0); /* albo moze -1 byloby lepiej? */
-	return(strtol(c, (char **) NULL, base));
+	update_receivers(tm_int(m,TMF_RX,10),tm_int(m,TMF_AFC,10),0);
+	event_publish(EVT_AFC,0,0,"\"rx\":%i,\"afc\":%i",tm_int(m,TMF_RX,10),tm_int(m,TMF_AFC,10));
+	/* never log afc values */
+	return(-1);
 }
 
-int cmpfunc(char *c,char *func)
+int parse_netinfo(struct tetmon_msg *m)
 {
-	if (!c) return(0);
-	if (strncmp(c,func,strlen(func))==0) return(1);
+	uint16_t tmpmcc;
+	uint16_t tmpmnc;
+	uint16_t tmpla;
+	uint8_t tmpcolour_code;
+	uint32_t tmpdlf,tmpulf;
+	time_t tmptime;
+	struct usage_cell *cell;
+	struct netinfo *ni=&net->netinfo;
+	int rx=tm_int(m,TMF_RX,10);
+
+	/* each RX keeps its own, so that several cells don't look like one that keeps changing */
+	cell=getcell(rx);
+	if (cell) ni=&cell->netinfo;
+	tmpmnc=tm_int(m,TMF_MNC,16);	
+	tmpmcc=tm_int(m,TMF_MCC,16);	
+	tmpcolour_code=tm_int(m,TMF_CCODE,16);	
+	tmpdlf=tm_int(m,TMF_DLF,10);
+	tmpulf=tm_int(m,TMF_ULF,10);
+	tmpla=tm_int(m,TMF_LA,10);
+	insert_freq(REASON_NETINFO,tmpmnc,tmpmcc,tmpulf,tmpdlf,tmpla,rx);
+	if ((tmpmnc!=ni->mnc)||(tmpmcc!=ni->mcc)||(tmpcolour_code!=ni->colour_code)||(tmpdlf!=ni->dl_freq)||(tmpulf!=ni->ul_freq)||(tmpla!=ni->la))
+	{
+		ni->mnc=tmpmnc;
+		ni->mcc=tmpmcc;
+		ni->colour_code=tmpcolour_code;
+		ni->dl_freq=tmpdlf;
+		ni->ul_freq=tmpulf;
+		ni->la=tmpla;
+		updopis();
+		tmptime=time(0);
+
+		if (ni->last_change==tmptime) { ni->changes++; } else { ni->changes=0; }
+		if (ni->changes>10) {
+			status_printf("Too much changes. Is RX %i hopping between cells? (enable alldump to see)\n",rx);
+			ref=1;
+		}
+		ni->last_change=tmptime;
+		/* the network wide one is the last cell that changed, for the KML header */
+		if (ni!=&net->netinfo) net->netinfo=*ni;
+		event_publish(EVT_NETINFO,0,0,"\"rx\":%i,\"mcc\":%i,\"mnc\":%i,\"colour_code\":%i,\"dl_freq\":%u,\"ul_freq\":%u,\"la\":%i",
+				rx,ni->mcc,ni->mnc,ni->colour_code,ni->dl_freq,ni->ul_freq,ni->la);
+	}
 	return(0);
 }
 
-int parsestat(char *c)
+int parse_freqinfo(struct tetmon_msg *m,int reason)
 {
-	char *func;
-	char *t,*lonptr,*latptr;
-	int idtype=0;
-	int ssi=0;
-	int usage=0;
-	int encr=0;
-	int writeflag=1;
-
-	char tmpstr[BUFLEN*2];
-	char tmpstr2[BUFLEN*2];
-	time_t tp;
 	uint16_t tmpmcc;
 	uint16_t tmpmnc;
 	uint16_t tmpla;
-	uint8_t tmpcolour_code;
 	uint32_t tmpdlf,tmpulf;
-	int rxid;
+
+	tmpmnc=tm_int(m,TMF_MNC,16);	
+	tmpmcc=tm_int(m,TMF_MCC,16);	
+	tmpdlf=tm_int(m,TMF_DLF,10);
+	tmpulf=tm_int(m,TMF_ULF,10);
+	tmpla=tm_int(m,TMF_LA,10);
+	insert_freq(reason,tmpmnc,tmpmcc,tmpulf,tmpdlf,tmpla,tm_int(m,TMF_RX,10));
+	return(0);
+}
+
+int parse_freqinfo1(struct tetmon_msg *m)
+{
+	return(parse_freqinfo(m,REASON_FREQINFO));
+}
+
+int parse_freqinfo2(struct tetmon_msg *m)
+{
+	return(parse_freqinfo(m,REASON_DLFREQ));
+}
+
+/* the fields of call events */
+void event_call(struct tetmon_msg *m,int type)
+{
+	event_publish(type,tm_int(m,TMF_SSI,10),0,"\"func\":\"%s\",\"rx\":%i,\"usage\":%i,\"idt\":%i,\"ssi\":%i,\"encr\":%i",
+			tetmon_funcs[m->func].name,tm_int(m,TMF_RX,10),tm_int(m,TMF_IDX,10),tm_int(m,TMF_IDT,10),tm_int(m,TMF_SSI,10),tm_int(m,TMF_ENCR,10));
+}
+
+int parse_dsetupdec(struct tetmon_msg *m)
+{
+	int usage=usage_slot(tm_rx(m),tm_int(m,TMF_IDX,10));
+	event_call(m,EVT_SETUP_SSI);
+	if (usage<0) return(1);
+	//addssi2(usage,ssi,0);
+	addssi(usage,tm_int(m,TMF_SSI,10));
+	getusi(net,usage)->encr=tm_int(m,TMF_ENCR,10);
+	updidx(usage);
+	return(1);
+}
+
+int parse_sdsdec(struct tetmon_msg *m)
+{
+	char *t,*lonptr,*latptr;
 	int callingssi,calledssi;
 	char *sdsbegin;
-	time_t tmptime;
 	float longtitude,lattitude;
+	char text[BUFLEN];
+	int haveloc=0;
+
+	callingssi=tm_int(m,TMF_CALLINGSSI,10);
+	calledssi=tm_int(m,TMF_CALLEDSSI,10);
+	sdsbegin=m->val[TMF_DATA]?m->val[TMF_DATA]-5:NULL; /* points at DATA: */
+	latptr=m->val[TMF_LAT];
+	lonptr=m->val[TMF_LON];
+	/* binary records only have DATA for text messages */
+	if ((m->bin)?(m->val[TMF_DATA]!=NULL):(strstr(m->msg,"Text")!=NULL))
+	{ 
+		status_printf("SDS %i->%i %s\n",callingssi,calledssi,sdsbegin);
+		ref=1;
+		if ((m->val[TMF_DATA])&&(event_wanted(EVT_SDS))) {
+			json_escape(text,sizeof(text)/2,m->val[TMF_DATA]);
+			event_publish(EVT_SDS,callingssi,calledssi,"\"calling\":%i,\"called\":%i,\"text\":\"%s\"",callingssi,calledssi,text);
+		}
 
-	func=getptr(c,"FUNC:");
-	idtype=getptrint(c,"IDT:",10);
-	ssi=getptrint(c,"SSI:",10);
-	usage=getptrint(c,"IDX:",10);
-	encr=getptrint(c,"ENCR:",10);
-	rxid=getptrint(c,"RX:",10);
-
-	if (cmpfunc(func,"BURST")) {
-		if (!last_burst) {
-			last_burst=10;
-			updopis(); 
-			wprintw(statuswin,"Signal found\n");
-		} else {
-			last_burst=10;
+	}
+	/* handle location */
+	if ((!net->kml_tmp_file)&&(!net->geojson_tmp_file)&&(!event_wanted(EVT_LOCATION))) return(1);
+	if (m->bin)
+	{
+		/* no lat/lon for an invalid position */
+		if ((m->bin&(1<<TMF_LAT))&&(m->bin&(1<<TMF_LON))) {
+			lattitude=m->num[TMF_LAT]/1e6;
+			longtitude=m->num[TMF_LON]/1e6;
+			haveloc=1;
 		}
-		/* never log bursts */
-		return(0);
+	} 
+	else if ((latptr)&&(lonptr)&&(strstr(m->msg,"INVALID_POSITION")==0))
+	{
+		lattitude=atof(latptr);
+		longtitude=atof(lonptr);
+		t=latptr;
+		while ((*t)&&(*t!=' ')) { 
+			if (*t=='S') { lattitude=-lattitude; break; }
+			t++;
+		}
+		t=lonptr;
+		while ((*t)&&(*t!=' ')) { 
+			if (*t=='W') { longtitude=-longtitude; break; }
+			t++;
+		}
+		haveloc=1;
 	}
+	if (haveloc) {
+		if ((net->kml_tmp_file)||(net->geojson_tmp_file)) add_location(callingssi,lattitude,longtitude,tm_text(m));
+		event_publish(EVT_LOCATION,callingssi,0,"\"ssi\":%i,\"lat\":%f,\"lon\":%f",callingssi,lattitude,longtitude);
+	}
+	return(1);
+}
 
-	if (cmpfunc(func,"AFCVAL")) {
-		update_receivers(rxid,getptrint(c,"AFC:",10),0);
-		/* never log afc values */
-		return(0);
+/* D-SETUP and D-CONNECT */
+int parse_call(struct tetmon_msg *m,int type)
+{
+	int usage;
+	event_call(m,type);
+	if (tm_int(m,TMF_IDT,10)==ADDR_TYPE_SSI_USAGE) {
+		usage=usage_slot(tm_rx(m),tm_int(m,TMF_IDX,10));
+		if (usage<0) return(1);
+		//addssi2(usage,ssi,0);
+		addssi(usage,tm_int(m,TMF_SSI,10));
+		getusi(net,usage)->encr=tm_int(m,TMF_ENCR,10);
+		updidx(usage);
 	}
+	return(1);
+}
 
-	if (cmpfunc(func,"NETINFO")) {
-		writeflag=0;
-		tmpmnc=getptrint(c,"MNC:",16);	
-		tmpmcc=getptrint(c,"MCC:",16);	
-		tmpcolour_code=getptrint(c,"CCODE:",16);	
-		tmpdlf=getptrint(c,"DLF:",10);
-		tmpulf=getptrint(c,"ULF:",10);
-		tmpla=getptrint(c,"LA:",10);
-		insert_freq(REASON_NETINFO,tmpmnc,tmpmcc,tmpulf,tmpdlf,tmpla,rxid);
-		if ((tmpmnc!=netinfo.mnc)||(tmpmcc!=netinfo.mcc)||(tmpcolour_code!=netinfo.colour_code)||(tmpdlf!=netinfo.dl_freq)||(tmpulf!=netinfo.ul_freq)||(tmpla!=netinfo.la))
-		{
-			netinfo.mnc=tmpmnc;
-			netinfo.mcc=tmpmcc;
-			netinfo.colour_code=tmpcolour_code;
-			netinfo.dl_freq=tmpdlf;
-			netinfo.ul_freq=tmpulf;
-			netinfo.la=tmpla;
-			updopis();
-			tmptime=time(0);
+int parse_dsetup(struct tetmon_msg *m)
+{
+	return(parse_call(m,EVT_SETUP));
+}
 
-			if (netinfo.last_change==tmptime) { netinfo.changes++; } else { netinfo.changes=0; }
-			if (netinfo.changes>10) {
-				wprintw(statuswin,"Too much changes. Are you monitoring only one cell? (enable alldump to see)\n");
-				ref=1;
-			}
-			netinfo.last_change=tmptime;
+int parse_dconnect(struct tetmon_msg *m)
+{
+	return(parse_call(m,EVT_CONNECT));
+}
+
+int parse_drelease(struct tetmon_msg *m)
+{
+	event_call(m,EVT_RELEASE);
+	/* don't use releasessi for now, as we can have the same ssi 
+	 * on different usage identifiers. one day this should be 
+	 * done properly with notif. ids */
+	//		releasessi(ssi);
+	return(1);
+}
+
+/* 
+ * sequence numbers. the signalling messages from each RX can have a 
+ * SEQ: counter, and the traffic frames a counter for each RX and usage 
+ * identifier, so that we know when something didn't reach us. going 
+ * back or jumping far ahead means that the receiver was restarted, 
+ * then we just start counting again
+ */
+#define SEQ_MAXGAP 65536
+#define SEQ_MAXFILL 50 /* at most 3 seconds of silence in a recording for one gap */
+
+int seq_gap(uint32_t last,uint32_t seq)
+{
+	int32_t d=seq-last;
+	if ((d<=0)||(d>SEQ_MAXGAP)) return(0);
+	return(d-1);
+}
+
+/* the entry for this RX, NULL if there are too many */
+struct rxseq *rxseq_get(int rx)
+{
+	int i;
+
+	for (i=0;i<net->nrxseq;i++) if (net->rxseq[i].rxid==rx) return(&net->rxseq[i]);
+	if (net->nrxseq==MAXRXSEQ) return(NULL);
+	net->rxseq[net->nrxseq].rxid=rx;
+	return(&net->rxseq[net->nrxseq++]);
+}
+
+/* a signalling message with SEQ: */
+void seq_message(int rx,uint32_t seq)
+{
+	struct rxseq *r=rxseq_get(rx);
+
+	if (!r) return;
+	if (r->seq_valid) r->lost+=seq_gap(r->seq,seq);
+	r->seq=seq;
+	r->seq_valid=1;
+}
+
+/* a traffic frame with the sequence trailer, returns how many frames are missing before it */
+int seq_traffic(int usage,unsigned char *trailer)
+{
+	struct usi *u=getusi(net,usage);
+	struct rxseq *r;
+	uint32_t seq=(trailer[4]<<24)|(trailer[5]<<16)|(trailer[6]<<8)|trailer[7];
+	int rx=trailer[2];
+	int gap=0;
+
+	if (u->seq_rx==rx+1) gap=seq_gap(u->seq,seq);
+	u->seq=seq;
+	u->seq_rx=rx+1;
+	if (!gap) return(0);
+	getusr(net,usage)->lost+=gap;
+	r=rxseq_get(rx);
+	if (r) r->lost+=gap;
+	return(gap);
+}
+
+/* copy the message msg to buf without the KEY:value token at c, msg itself is left alone */
+char *tm_strip(char *msg,char *c,char *buf,int size)
+{
+	char *d=c;
+	while(*d>' ') d++;
+	while(*d==' ') d++;
+	snprintf(buf,size,"%.*s%s",(int)(c-msg),msg,d);
+	return(buf);
+}
+
+/* run the handler for the message, and log it */
+int tetmon_dispatch(struct tetmon_msg *m)
+{
+	int writeflag=1;
+	char *c;
+
+	char tmpstr[BUFLEN*2];
+	char tmpstr2[BUFLEN*2];
+	char stripped[BUFLEN*2];
+	time_t tp;
+
+	stats_messages++;
+	stats_func[(m->func>=0)?m->func:STATS_OTHER_FUNC]++;
+	if ((m->val[TMF_SEQ])||(m->bin&(1<<TMF_SEQ))) seq_message(tm_int(m,TMF_RX,10),tm_int(m,TMF_SEQ,10));
+	if (m->func>=0) writeflag=tetmon_funcs[m->func].handler(m);
+	if (writeflag<0) return(0);
+
+	if (alldump) writeflag=1;
+	if (!writeflag) return(0);
+	c=tm_text(m);
+	/* SEQ: isn't logged, so that repeated messages are still recognized */
+	if (m->val[TMF_SEQ]) c=tm_strip(c,m->val[TMF_SEQ]-4,stripped,sizeof(stripped));
+	if (strcmp(c,net->prevtmsg))
+	{
+		tp=time(0);
+		strftime(tmpstr,40,"%Y%m%d %H:%M:%S",localtime(&tp));
+
+		snprintf(tmpstr2,sizeof(tmpstr2)-1,"%s %s",tmpstr,c);
+
+		if (nnets>1) {
+			msg_printf("%i:%s\n",net->id+1,tmpstr2);
+		} else {
+			msg_printf("%s\n",tmpstr2);
 		}
+		strncpy(net->prevtmsg,c,sizeof(net->prevtmsg)-1);
+		net->prevtmsg[sizeof(net->prevtmsg)-1]=0;
+		if (do_log) appendlog(tmpstr2);
 	}
-	if (cmpfunc(func,"FREQINFO1")) {
-		writeflag=0;
-		tmpmnc=getptrint(c,"MNC:",16);	
-		tmpmcc=getptrint(c,"MCC:",16);	
-		tmpdlf=getptrint(c,"DLF:",10);
-		tmpulf=getptrint(c,"ULF:",10);
-		tmpla=getptrint(c,"LA:",10);
-		insert_freq(REASON_FREQINFO,tmpmnc,tmpmcc,tmpulf,tmpdlf,tmpla,rxid);
 
+	return(0);
+
+}
+
+int parsestat(char *c)
+{
+	struct tetmon_msg m;
+
+	tetmon_tokenize(c,&m);
+	return(tetmon_dispatch(&m));
+}
+
+/* a datagram with one or more binary records */
+void parse_tetmon_bin(unsigned char *buf,int len)
+{
+	struct tetmon_msg m;
+	char data[TMB_DATALEN];
+	char text[BUFLEN];
+	int n;
+
+	m.text=text;
+	m.textlen=sizeof(text);
+	while(len>0) {
+		n=tmb_decode(buf,len,&m,data);
+		if (n<0) {
+			stats_bad_lines++;
+			if ((len>=TMB_HDRLEN)&&(buf[3]!=TMB_VERSION)) {
+				status_printf("binary record version %i not supported\n",buf[3]);
+			} else {
+				status_printf("bad binary record [%i bytes]\n",len);
+			}
+			break;
+		}
+		tetmon_dispatch(&m);
+		buf+=n;
+		len-=n;
 	}
-	if (cmpfunc(func,"FREQINFO2")) {
-		writeflag=0;
-		tmpmnc=getptrint(c,"MNC:",16);	
-		tmpmcc=getptrint(c,"MCC:",16);	
-		tmpdlf=getptrint(c,"DLF:",10);
-		tmpulf=getptrint(c,"ULF:",10);
-		tmpla=getptrint(c,"LA:",10);
-		insert_freq(REASON_DLFREQ,tmpmnc,tmpmcc,tmpulf,tmpdlf,tmpla,rxid);
+	ref=1;
+}
+
+/* 
+ * statistics output, in the prometheus text format. it goes to 
+ * stats_file once a second, and to everyone who connects to the 
+ * stats_socket unix socket
+ */
+void stats_counter(char **s,int *len,int *size,char *name,unsigned long v)
+{
+	char tmpstr[256];
+	snprintf(tmpstr,sizeof(tmpstr),"# TYPE %s counter\n%s %lu\n",name,name,v);
+	strappend(s,len,size,tmpstr);
+}
+
+void stats_histogram(char **s,int *len,int *size,char *name,struct histogram *h)
+{
+	char tmpstr[256];
+	unsigned long n=0;
+	int i;
 
+	snprintf(tmpstr,sizeof(tmpstr),"# TYPE %s histogram\n",name);
+	strappend(s,len,size,tmpstr);
+	for (i=0;i<HIST_BUCKETS;i++) {
+		n+=h->bucket[i];
+		snprintf(tmpstr,sizeof(tmpstr),"%s_bucket{le=\"%g\"} %lu\n",name,(1000UL<<i)/1e9,n);
+		strappend(s,len,size,tmpstr);
 	}
-	if (cmpfunc(func,"DSETUPDEC"))
-	{
-		//addssi2(usage,ssi,0);
-		addssi(usage,ssi);
-		updidx(usage);
+	snprintf(tmpstr,sizeof(tmpstr),"%s_bucket{le=\"+Inf\"} %lu\n%s_sum %.9f\n%s_count %lu\n",
+			name,h->count,name,h->sum_ns/1e9,name,h->count);
+	strappend(s,len,size,tmpstr);
+}
+
+char *format_stats(int *len)
+{
+	char *buf=NULL;
+	int size=0;
+	char tmpstr[256];
+	int i,j;
 
+	*len=0;
+	snprintf(tmpstr,sizeof(tmpstr),"# TYPE telive_start_time_seconds gauge\ntelive_start_time_seconds %li\n",(long)stats_start);
+	strappend(&buf,len,&size,tmpstr);
+	stats_counter(&buf,len,&size,"telive_datagrams_total",stats_datagrams);
+	stats_counter(&buf,len,&size,"telive_recv_queue_dropped_total",__atomic_load_n(&stats_recvq_dropped,__ATOMIC_RELAXED));
+	snprintf(tmpstr,sizeof(tmpstr),"# TYPE telive_recv_queue_depth gauge\ntelive_recv_queue_depth %u\n",stats_recvq_depth);
+	strappend(&buf,len,&size,tmpstr);
+	stats_counter(&buf,len,&size,"telive_messages_total",stats_messages);
+	strappend(&buf,len,&size,"# TYPE telive_func_messages_total counter\n");
+	for (i=0;i<=STATS_OTHER_FUNC;i++) {
+		snprintf(tmpstr,sizeof(tmpstr),"telive_func_messages_total{func=\"%s\"} %lu\n",
+				(i<STATS_OTHER_FUNC)?tetmon_funcs[i].name:"other",stats_func[i]);
+		strappend(&buf,len,&size,tmpstr);
 	}
-	if (cmpfunc(func,"SDSDEC")) {
-		callingssi=getptrint(c,"CallingSSI:",10);
-		calledssi=getptrint(c,"CalledSSI:",10);
-		sdsbegin=strstr(c,"DATA:");
-		latptr=getptr(c," lat:");
-		lonptr=getptr(c," lon:");
-		if ((strstr(c,"Text")))
-		{ 
-			wprintw(statuswin,"SDS %i->%i %s\n",callingssi,calledssi,sdsbegin);
-			ref=1;
+	stats_counter(&buf,len,&size,"telive_traffic_frames_total",stats_frames);
+	strappend(&buf,len,&size,"# TYPE telive_usage_frames_total counter\n");
+	for (i=0;i<nnets;i++) {
+		for (j=0;j<nslots(&nets[i]);j++) {
+			if (!getusr(&nets[i],j)->frames) continue;
+			snprintf(tmpstr,sizeof(tmpstr),"telive_usage_frames_total{net=\"%i\",rx=\"%i\",usage=\"%i\"} %lu\n",
+					i+1,nets[i].cells[j/MAXUS]->rxid,j%MAXUS,getusr(&nets[i],j)->frames);
+			strappend(&buf,len,&size,tmpstr);
+		}
+	}
+	strappend(&buf,len,&size,"# TYPE telive_kernel_dropped_total counter\n");
+	for (i=0;i<nnets;i++) {
+		snprintf(tmpstr,sizeof(tmpstr),"telive_kernel_dropped_total{net=\"%i\"} %u\n",i+1,__atomic_load_n(&nets[i].kernel_dropped,__ATOMIC_RELAXED));
+		strappend(&buf,len,&size,tmpstr);
+	}
+	strappend(&buf,len,&size,"# TYPE telive_rx_lost_total counter\n");
+	for (i=0;i<nnets;i++) {
+		for (j=0;j<nets[i].nrxseq;j++) {
+			snprintf(tmpstr,sizeof(tmpstr),"telive_rx_lost_total{net=\"%i\",rx=\"%i\"} %lu\n",
+					i+1,nets[i].rxseq[j].rxid,nets[i].rxseq[j].lost);
+			strappend(&buf,len,&size,tmpstr);
+		}
+	}
+	strappend(&buf,len,&size,"# TYPE telive_usage_lost_frames_total counter\n");
+	for (i=0;i<nnets;i++) {
+		for (j=0;j<nslots(&nets[i]);j++) {
+			if (!getusr(&nets[i],j)->lost) continue;
+			snprintf(tmpstr,sizeof(tmpstr),"telive_usage_lost_frames_total{net=\"%i\",rx=\"%i\",usage=\"%i\"} %lu\n",
+					i+1,nets[i].cells[j/MAXUS]->rxid,j%MAXUS,getusr(&nets[i],j)->lost);
+			strappend(&buf,len,&size,tmpstr);
+		}
+	}
+	stats_counter(&buf,len,&size,"telive_bad_lines_total",stats_bad_lines);
+	stats_counter(&buf,len,&size,"telive_small_frames_total",stats_small_frames);
+	stats_counter(&buf,len,&size,"telive_play_errors_total",__atomic_load_n(&stats_play_errors,__ATOMIC_RELAXED));
+	stats_counter(&buf,len,&size,"telive_play_dropped_total",play_dropped);
+	stats_counter(&buf,len,&size,"telive_rec_bytes_total",__atomic_load_n(&stats_rec_bytes,__ATOMIC_RELAXED));
+	stats_counter(&buf,len,&size,"telive_rec_dropped_bytes_total",stats_rec_dropped);
+	stats_counter(&buf,len,&size,"telive_log_lines_total",__atomic_load_n(&stats_log_lines,__ATOMIC_RELAXED));
+	stats_counter(&buf,len,&size,"telive_log_dropped_total",log_dropped());
+	stats_counter(&buf,len,&size,"telive_capture_bytes_total",__atomic_load_n(&stats_capture_bytes,__ATOMIC_RELAXED));
+	stats_counter(&buf,len,&size,"telive_capture_dropped_total",capture_dropped);
+	stats_counter(&buf,len,&size,"telive_kml_dumps_total",stats_kml_dumps);
+	stats_histogram(&buf,len,&size,"telive_datagram_seconds",&stats_datagram_time);
+	stats_histogram(&buf,len,&size,"telive_queue_seconds",&stats_queue_time);
+	stats_histogram(&buf,len,&size,"telive_loop_seconds",&stats_loop_time);
+	stats_histogram(&buf,len,&size,"telive_kml_dump_seconds",&stats_kml_time);
+	stats_counter(&buf,len,&size,"telive_events_total",stats_events);
+	stats_counter(&buf,len,&size,"telive_events_dropped_total",stats_events_dropped);
+	stats_counter(&buf,len,&size,"telive_subscribers_dropped_total",__atomic_load_n(&stats_subscribers_dropped,__ATOMIC_RELAXED));
+	stats_counter(&buf,len,&size,"telive_api_requests_total",__atomic_load_n(&stats_api_requests,__ATOMIC_RELAXED));
+	stats_histogram(&buf,len,&size,"telive_api_snapshot_seconds",&stats_api_time);
+	return(buf);
+}
+
+void write_stats()
+{
+	char *buf;
+	int len;
+
+	if (!stats_file) return;
+	buf=format_stats(&len);
+	jq_put(&fileq,job_new(JOB_FILE_WRITE,stats_file,stats_tmp_file,(unsigned char *)buf,len),1);
+}
 
+void init_stats_socket()
+{
+	struct sockaddr_un sa;
+
+	stats_start=time(0);
+	if (!stats_socket) return;
+	memset(&sa,0,sizeof(sa));
+	sa.sun_family=AF_UNIX;
+	strncpy(sa.sun_path,stats_socket,sizeof(sa.sun_path)-1);
+	unlink(stats_socket);
+	stats_sock=socket(AF_UNIX,SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0);
+	if (stats_sock==-1) diep("stats socket");
+	if (bind(stats_sock,(struct sockaddr *)&sa,sizeof(sa))==-1) diep("stats socket bind");
+	if (listen(stats_sock,8)==-1) diep("stats socket listen");
+}
 
+/* 
+ * someone connected to the stats socket: give them the statistics and 
+ * hang up. the text fits in the socket buffer, so this doesn't block. 
+ * a client which doesn't take it all (or has gone away) is hung up on
+ */
+void handle_stats_socket()
+{
+	char *buf;
+	int len,off,r;
+	int fd;
+
+	while((fd=accept4(stats_sock,NULL,NULL,SOCK_NONBLOCK|SOCK_CLOEXEC))!=-1) {
+		buf=format_stats(&len);
+		for (off=0;off<len;off+=r) {
+			r=write(fd,buf+off,len-off);
+			if ((r==-1)&&(errno==EINTR)) r=0;
+			else if (r<=0) break;
 		}
-		/* handle location */
-		if ((kml_tmp_file)&&(strstr(c,"INVALID_POSITION")==0)&&(latptr)&&(lonptr))
-		{
-			lattitude=atof(latptr);
-			longtitude=atof(lonptr);
-			t=latptr;
-			while ((*t)&&(*t!=' ')) { 
-				if (*t=='S') { lattitude=-lattitude; break; }
-				t++;
-			}
-			t=lonptr;
-			while ((*t)&&(*t!=' ')) { 
-				if (*t=='W') { longtitude=-longtitude; break; }
-				t++;
+		free(buf);
+		close(fd);
+	}
+}
+
+/* 
+ * query API: JSON snapshots of the usage identifiers, the network info 
+ * of the cells, the known frequencies, the receivers and the locations, 
+ * served over HTTP on a unix socket or on a localhost port (api_addr). 
+ * the main loop puts a snapshot together once a second and publishes it 
+ * with an atomic pointer swap, the API thread serves everyone from the 
+ * newest one it has. so the pollers never take a lock that the main 
+ * loop needs, and how many there are doesn't matter to the main loop. 
+ * the snapshots are reference counted by the API thread only
+ */
+#define API_USAGE 0
+#define API_NETINFO 1
+#define API_FREQS 2
+#define API_RECEIVERS 3
+#define API_LOCATIONS 4
+#define API_PARTS 5
+#define API_MAXCLIENTS 32
+#define API_REQLEN 4096
+#define API_TIMEOUT 5 /* seconds for a client to send the request and take the answer */
+
+const char *api_names[API_PARTS]={ "usage","netinfo","frequencies","receivers","locations" };
+
+struct api_snapshot {
+	int refs;
+	time_t time;
+	char *part[API_PARTS]; /* each one a JSON array */
+	int len[API_PARTS];
+};
+
+struct api_client {
+	int fd;
+	time_t start;
+	char req[API_REQLEN];
+	int reqlen;
+	struct api_snapshot *snap; /* set when the answer is being sent */
+	char head[256];
+	char top[32];
+	struct iovec iov[2*API_PARTS+3];
+	int niov; /* 0 - still reading the request */
+	int iovpos; /* what is sent already */
+};
+
+char *api_addr=NULL;
+int api_sock=-1;
+pthread_t api_thread;
+struct api_snapshot *api_pending=NULL; /* the newest snapshot, not yet seen by the API thread */
+
+void api_free(struct api_snapshot *s)
+{
+	int i;
+
+	if (!s) return;
+	for (i=0;i<API_PARTS;i++) free(s->part[i]);
+	free(s);
+}
+
+void api_usage(char **buf,int *len,int *size)
+{
+	char tmpstr[BUFLEN];
+	char opis[BUFLEN];
+	struct tetra_net *n;
+	struct usi *u;
+	int i,j,k,m,first=1;
+
+	strappend(buf,len,size,"[");
+	for (k=0;k<nnets;k++) {
+		n=&nets[k];
+		for (i=0;i<nslots(n);i++) {
+			u=getusi(n,i);
+			if ((!u->active)&&(!u->ssi[0])&&(!u->ssi[1])&&(!u->ssi[2])&&(!getusr(n,i)->curfile)) continue;
+			snprintf(tmpstr,sizeof(tmpstr),"%s\n{\"net\":%i,\"rx\":%i,\"usage\":%i,\"active\":%i,\"encr\":%i,\"play\":%i,\"recording\":%i,\"ssi\":[",
+					first?"":",",k+1,n->cells[i/MAXUS]->rxid,i%MAXUS,u->active,u->encr,u->play,getusr(n,i)->curfile!=NULL);
+			strappend(buf,len,size,tmpstr);
+			first=0;
+			for (j=0,m=0;j<3;j++) {
+				if (!u->ssi[j]) continue;
+				json_escape(opis,sizeof(opis)/2,lookupssi(u->ssi[j]));
+				snprintf(tmpstr,sizeof(tmpstr),"%s{\"ssi\":%u,\"name\":\"%s\",\"lastseen\":%li}",m++?",":"",u->ssi[j],opis,(long)u->ssi_time[j]);
+				strappend(buf,len,size,tmpstr);
 			}
-			add_location(callingssi,lattitude,longtitude,c);
+			strappend(buf,len,size,"]}");
+		}
+	}
+	strappend(buf,len,size,"]");
+}
 
+void api_netinfo(char **buf,int *len,int *size)
+{
+	char tmpstr[BUFLEN];
+	struct netinfo *ni;
+	int i,k,first=1;
+
+	strappend(buf,len,size,"[");
+	for (k=0;k<nnets;k++) {
+		for (i=0;i<nets[k].ncells;i++) {
+			ni=&nets[k].cells[i]->netinfo;
+			snprintf(tmpstr,sizeof(tmpstr),"%s\n{\"net\":%i,\"port\":%i,\"rx\":%i,\"mcc\":%i,\"mnc\":%i,\"colour_code\":%i,\"dl_freq\":%u,\"ul_freq\":%u,\"la\":%i,\"last_change\":%li,\"changes\":%u}",
+					first?"":",",k+1,nets[k].port,nets[k].cells[i]->rxid,ni->mcc,ni->mnc,ni->colour_code,ni->dl_freq,ni->ul_freq,ni->la,(long)ni->last_change,ni->changes);
+			strappend(buf,len,size,tmpstr);
+			first=0;
 		}
 	}
-	if (idtype==ADDR_TYPE_SSI_USAGE) {
-		if (cmpfunc(func,"D-SETUP"))
-		{
-			//addssi2(usage,ssi,0);
-			addssi(usage,ssi);
-			updidx(usage);
+	strappend(buf,len,size,"]");
+}
+
+void api_freqs(char **buf,int *len,int *size)
+{
+	char tmpstr[BUFLEN];
+	struct freqinfo *ptr;
+	int k,first=1;
+
+	strappend(buf,len,size,"[");
+	for (k=0;k<nnets;k++) {
+		for (ptr=nets[k].frequencies;ptr;ptr=ptr->next) {
+			snprintf(tmpstr,sizeof(tmpstr),"%s\n{\"net\":%i,\"dl_freq\":%u,\"ul_freq\":%u,\"mcc\":%i,\"mnc\":%i,\"la\":%i,\"reason\":\"%s%s%s\",\"rx\":%i,\"last_change\":%li}",
+					first?"":",",k+1,ptr->dl_freq,ptr->ul_freq,ptr->mcc,ptr->mnc,ptr->la,
+					(ptr->reason&REASON_NETINFO)?"S":"",(ptr->reason&REASON_FREQINFO)?"N":"",(ptr->reason&REASON_DLFREQ)?"A":"",
+					ptr->rx,(long)ptr->last_change);
+			strappend(buf,len,size,tmpstr);
+			first=0;
 		}
-		if (cmpfunc(func,"D-CONNECT"))
-		{
-			//addssi2(usage,ssi,1);
-			addssi(usage,ssi);
-			updidx(usage);
+	}
+	strappend(buf,len,size,"]");
+}
+
+void api_receivers(char **buf,int *len,int *size)
+{
+	char tmpstr[BUFLEN];
+	struct receiver *ptr;
+	int k,first=1;
+
+	strappend(buf,len,size,"[");
+	for (k=0;k<nnets;k++) {
+		for (ptr=nets[k].receivers;ptr;ptr=ptr->next) {
+			snprintf(tmpstr,sizeof(tmpstr),"%s\n{\"net\":%i,\"rx\":%u,\"afc\":%i,\"freq\":%u,\"lastseen\":%li}",
+					first?"":",",k+1,ptr->rxid,ptr->afc,ptr->freq,(long)ptr->lastseen);
+			strappend(buf,len,size,tmpstr);
+			first=0;
+		}
+	}
+	strappend(buf,len,size,"]");
+}
+
+/* a GeoJSON FeatureCollection for each network, from the placemarks cached for the GeoJSON file */
+void api_locations(char **buf,int *len,int *size)
+{
+	char tmpstr[BUFLEN];
+	struct tetra_net *savednet=net;
+	struct locations *ptr;
+	char *c;
+	int k,n;
+
+	strappend(buf,len,size,"[");
+	for (k=0;k<nnets;k++) {
+		net=&nets[k];
+		snprintf(tmpstr,sizeof(tmpstr),"%s\n{\"net\":%i,\"type\":\"FeatureCollection\",\"features\":[",k?",":"",k+1);
+		strappend(buf,len,size,tmpstr);
+		n=0;
+		for (ptr=net->kml_locations;ptr;ptr=ptr->next) {
+			loc_format(ptr);
+			n+=ptr->geojsonlen+2;
+		}
+		if (*len+n+1>*size) {
+			*size=*len+n+1;
+			*buf=realloc(*buf,*size);
 		}
+		c=*buf+*len;
+		for (ptr=net->kml_locations;ptr;ptr=ptr->next) {
+			*c++='\n';
+			memcpy(c,ptr->geojson,ptr->geojsonlen);
+			c+=ptr->geojsonlen;
+			if (ptr->next) *c++=',';
+		}
+		*c=0;
+		*len=c-*buf;
+		strappend(buf,len,size,"]}");
+	}
+	net=savednet;
+	strappend(buf,len,size,"]");
+}
 
+/* put a snapshot together and hand it to the API thread, called once a second */
+void api_publish()
+{
+	void (*fmt[API_PARTS])(char **,int *,int *)={ api_usage,api_netinfo,api_freqs,api_receivers,api_locations };
+	struct api_snapshot *s;
+	struct timespec t0,t1;
+	int size,i;
+
+	if (api_sock==-1) return;
+	clock_gettime(CLOCK_MONOTONIC,&t0);
+	s=calloc(1,sizeof(struct api_snapshot));
+	s->time=time(0);
+	for (i=0;i<API_PARTS;i++) {
+		size=0;
+		fmt[i](&s->part[i],&s->len[i],&size);
 	}
-	if (cmpfunc(func,"D-RELEASE"))
-	{
-		/* don't use releasessi for now, as we can have the same ssi 
-		 * on different usage identifiers. one day this should be 
-		 * done properly with notif. ids */
-		//		releasessi(ssi);
+	/* if the previous one wasn't picked up yet, nobody has seen it, so free it */
+	api_free(__atomic_exchange_n(&api_pending,s,__ATOMIC_ACQ_REL));
+	clock_gettime(CLOCK_MONOTONIC,&t1);
+	hist_add(&stats_api_time,ts_diff_ns(&t0,&t1));
+}
+
+void api_unref(struct api_snapshot *s)
+{
+	if ((s)&&(!--s->refs)) api_free(s);
+}
+
+/* the request is complete, set up the answer */
+void api_answer(struct api_client *cl,struct api_snapshot *s)
+{
+	static char sep[API_PARTS][32];
+	char path[64];
+	const char *status="200 OK";
+	int len=0;
+	int i,part=-1;
+
+	if (!sep[0][0]) for (i=0;i<API_PARTS;i++) snprintf(sep[i],sizeof(sep[i]),"%s\"%s\":",i?",\n":"",api_names[i]);
+	path[0]=0;
+	sscanf(cl->req,"GET %63s",path);
+	if (strcmp(path,"/")) {
+		for (i=0;i<API_PARTS;i++) if ((path[0]=='/')&&(!strcmp(path+1,api_names[i]))) part=i;
+		if (part==-1) status="404 Not Found";
+	}
+	cl->niov=1;
+	if (!s) {
+		status="503 Service Unavailable";
+	} else if (part!=-1) {
+		cl->iov[cl->niov].iov_base=s->part[part];
+		cl->iov[cl->niov++].iov_len=s->len[part];
+		len=s->len[part];
+	} else if (!strcmp(path,"/")) {
+		cl->iov[cl->niov].iov_base=cl->top;
+		cl->iov[cl->niov++].iov_len=snprintf(cl->top,sizeof(cl->top),"{\"time\":%li,\n",(long)s->time);
+		len+=strlen(cl->top);
+		for (i=0;i<API_PARTS;i++) {
+			cl->iov[cl->niov].iov_base=sep[i];
+			cl->iov[cl->niov++].iov_len=strlen(sep[i]);
+			cl->iov[cl->niov].iov_base=s->part[i];
+			cl->iov[cl->niov++].iov_len=s->len[i];
+			len+=strlen(sep[i])+s->len[i];
+		}
+		cl->iov[cl->niov].iov_base="}\n";
+		cl->iov[cl->niov++].iov_len=2;
+		len+=2;
 	}
+	cl->iov[0].iov_base=cl->head;
+	cl->iov[0].iov_len=snprintf(cl->head,sizeof(cl->head),"HTTP/1.0 %s\r\nContent-Type: application/json\r\nContent-Length: %i\r\nConnection: close\r\n\r\n",status,len);
+	cl->snap=s;
+	if (s) s->refs++;
+	__atomic_add_fetch(&stats_api_requests,1,__ATOMIC_RELAXED);
+}
 
+void api_close(struct api_client *cl)
+{
+	api_unref(cl->snap);
+	close(cl->fd);
+	cl->fd=-1;
+}
 
-	if (alldump) writeflag=1;
-	if ((writeflag)&&(strcmp(c,prevtmsg)))
-	{
-		tp=time(0);
-		strftime(tmpstr,40,"%Y%m%d %H:%M:%S",localtime(&tp));
+/* send as much of the answer as the socket takes, returns 1 when it is all sent */
+int api_send(struct api_client *cl)
+{
+	struct iovec *v;
+	ssize_t n;
+
+	n=writev(cl->fd,cl->iov+cl->iovpos,cl->niov-cl->iovpos);
+	if (n<0) return(errno!=EAGAIN);
+	while((n)&&(cl->iovpos<cl->niov)) {
+		v=&cl->iov[cl->iovpos];
+		if (n>=v->iov_len) {
+			n-=v->iov_len;
+			cl->iovpos++;
+		} else {
+			v->iov_base=(char *)v->iov_base+n;
+			v->iov_len-=n;
+			n=0;
+		}
+	}
+	return(cl->iovpos==cl->niov);
+}
+
+/* read what the client sent, returns -1 if it went away */
+int api_read(struct api_client *cl,struct api_snapshot *s)
+{
+	int r;
+
+	r=read(cl->fd,cl->req+cl->reqlen,API_REQLEN-1-cl->reqlen);
+	if ((r==0)||((r<0)&&(errno!=EAGAIN))) return(-1);
+	if (r<0) return(0);
+	cl->reqlen+=r;
+	cl->req[cl->reqlen]=0;
+	/* we don't care about the headers, but they have to be read, or closing the socket resets the connection */
+	if ((strstr(cl->req,"\r\n\r\n"))||(strstr(cl->req,"\n\n"))||(cl->reqlen==API_REQLEN-1)) api_answer(cl,s);
+	return(0);
+}
 
-		snprintf(tmpstr2,sizeof(tmpstr2)-1,"%s %s",tmpstr,c);
+void *api_worker(void *arg)
+{
+	struct api_client cl[API_MAXCLIENTS];
+	struct pollfd pfd[API_MAXCLIENTS+1];
+	struct api_snapshot *cur=NULL;
+	struct api_snapshot *s;
+	time_t t;
+	int i,n,fd;
+
+	for (i=0;i<API_MAXCLIENTS;i++) cl[i].fd=-1;
+	while(1) {
+		pfd[0].fd=api_sock;
+		pfd[0].events=POLLIN;
+		n=1;
+		for (i=0;i<API_MAXCLIENTS;i++) {
+			if (cl[i].fd==-1) continue;
+			pfd[n].fd=cl[i].fd;
+			pfd[n++].events=cl[i].niov?POLLOUT:POLLIN;
+		}
+		poll(pfd,n,1000);
 
-		wprintw(msgwin,"%s\n",tmpstr2);
-		strncpy(prevtmsg,c,sizeof(prevtmsg)-1);
-		prevtmsg[sizeof(prevtmsg)-1]=0;
-		if (do_log) appendlog(tmpstr2);
+		s=__atomic_exchange_n(&api_pending,NULL,__ATOMIC_ACQ_REL);
+		if (s) {
+			s->refs=1;
+			api_unref(cur);
+			cur=s;
+		}
+		t=time(0);
+		while((fd=accept4(api_sock,NULL,NULL,SOCK_NONBLOCK|SOCK_CLOEXEC))!=-1) {
+			for (i=0;(i<API_MAXCLIENTS)&&(cl[i].fd!=-1);i++);
+			if (i==API_MAXCLIENTS) {
+				close(fd);
+				continue;
+			}
+			memset(&cl[i],0,sizeof(struct api_client));
+			cl[i].fd=fd;
+			cl[i].start=t;
+		}
+		for (i=0;i<API_MAXCLIENTS;i++) {
+			if (cl[i].fd==-1) continue;
+			if ((!cl[i].niov)&&(api_read(&cl[i],cur)==-1)) {
+				api_close(&cl[i]);
+				continue;
+			}
+			if ((cl[i].niov)&&(api_send(&cl[i]))) {
+				api_close(&cl[i]);
+				continue;
+			}
+			if (cl[i].start+API_TIMEOUT<t) api_close(&cl[i]);
+		}
 	}
+	return(NULL);
+}
 
-	return(0);
-
+/* api_addr is a unix socket path, or a port on localhost */
+void init_api()
+{
+	struct sockaddr_un sa;
+	struct sockaddr_in sin;
+	int one=1;
+
+	if (!api_addr) return;
+	if (strchr(api_addr,'/')) {
+		memset(&sa,0,sizeof(sa));
+		sa.sun_family=AF_UNIX;
+		strncpy(sa.sun_path,api_addr,sizeof(sa.sun_path)-1);
+		unlink(api_addr);
+		api_sock=socket(AF_UNIX,SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0);
+		if (api_sock==-1) diep("api socket");
+		if (bind(api_sock,(struct sockaddr *)&sa,sizeof(sa))==-1) diep("api socket bind");
+	} else {
+		memset(&sin,0,sizeof(sin));
+		sin.sin_family=AF_INET;
+		sin.sin_port=htons(atoi(api_addr));
+		sin.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+		api_sock=socket(AF_INET,SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0);
+		if (api_sock==-1) diep("api socket");
+		setsockopt(api_sock,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+		if (bind(api_sock,(struct sockaddr *)&sin,sizeof(sin))==-1) diep("api socket bind");
+	}
+	if (listen(api_sock,API_MAXCLIENTS)==-1) diep("api socket listen");
+	api_publish();
+	pthread_create(&api_thread,NULL,api_worker,NULL);
 }
 
 
-int parsetraffic(unsigned char *buf)
+int parsetraffic(unsigned char *buf,int dlen,struct timespec *ts)
 {
 	unsigned char *c;
+	unsigned char fill[1380];
+	struct usi *u;
+	struct usi_rec *r;
 	int usage;
 	int len=1380;
 	time_t tt=time(0);
-	FILE *f;
 	int rxid;
+	int gap=0;
+	int newfile=0;
+	int ch;
+	int j;
 	usage=getptrint((char *)buf,"TRA",16);
-	rxid=getptrint((char *)buf,"RX",16);
+	/* the 6 byte header has no room for anything else, only the sequence trailer says which RX */
+	rxid=(dlen>1386)?buf[1386+2]:-1;
 	if ((usage<1)||(usage>63)) return(0);
+	usage=usage_slot(rxid,usage);
+	if (usage<0) return(0);
+	u=getusi(net,usage);
+	r=getusr(net,usage);
 	c=buf+6;
+	r->frames++;
+	if (dlen>1386) gap=seq_traffic(usage,buf+1386);
 
-	if (!ssis[usage].active) {
-		ssis[usage].active=1;
+	if (!u->active) {
+		u->active=1;
 		updidx(usage);
 	}
-	ssis[usage].timeout=tt;
-
-	if ((strncmp((char *)buf,"TRA",3)==0)&&(!ssis[usage].encr)) {
-		if ((mutessi)&&(!ssis[usage].ssi[0])&&(!ssis[usage].ssi[1])&&(!ssis[usage].ssi[2])) return(0); /* ignore it if we don't know any ssi for this usage identifier */
-
-		findtoplay(0);
-		if ((curplayingidx)&&(curplayingidx==usage)) {
-			if (!matchidx(usage)) {
-				ssis[curplayingidx].active=0;
-				ssis[curplayingidx].play=0;
-				if (verbose>0) wprintw(statuswin,"STOP PLAYING %i\n",curplayingidx);
-				updidx(curplayingidx);
-				curplayingidx=0;
-				findtoplay(curplayingidx+1);
-				ref=1;
+	u->timeout=tt;
+	usage_arm(usage);
+
+	if (strncmp((char *)buf,"TRA",3)==0) {
+		if ((mutessi)&&(!u->ssi[0])&&(!u->ssi[1])&&(!u->ssi[2])) return(0); /* ignore it if we don't know any ssi for this usage identifier */
+
+		/* encrypted calls are neither played nor recorded, but they get a call record */
+		if (!u->encr) {
+			if ((locked)&&(!arb_held())) play_lost();
+			ch=play_chan_of(net,usage);
+			if ((ch>=0)&&(!matchidx(usage))) {
+				/* the filter was changed while it was played */
+				if (verbose>0) status_printf("STOP PLAYING %i\n",usage);
+				play_release(ch,1);
+				play_fill();
+				play_unlock_idle();
 				return(0);
 			}
-			ssis[usage].play=1;
-			if (!ps_mute)	{
-				if (!ferror(playingfp)) {
-					fwrite(c,1,len,playingfp);
-					fflush(playingfp);
-				} else {
-					wprintw(statuswin,"PLAYBACK PROBLEM!! (fix tplay)\n");
-					playingfp=NULL;
-					curplayingidx=0;
-				}
+			if ((ch<0)&&(matchidx(usage))) ch=play_schedule(usage);
+			if (ch>=0) {
+				u->play=1;
+				if (!ps_mute) play_enqueue(c,ch,playchans[ch].call,playchans[ch].gain);
+				playchans[ch].time=time(0);
+				updidx(usage);
+				ref=1;
 			}
-			curplayingtime=time(0);
-			curplayingticks=0;
-			updidx(usage);
-			ref=1;
 		}
-		if ((strlen(ssis[usage].curfile)==0)||(ssis[usage].ssi_time_rec+rec_timeout<tt)) {
+		if ((!r->curfile)||(u->ssi_time_rec+rec_timeout<tt)) {
 			/* either it has no name, or there was a timeout, 
 			 * change the file name */
-			strftime(ssis[usage].curfiletime,32,"%Y%m%d_%H%M%S",localtime(&tt));
-			sprintf(ssis[usage].curfile,"%s/traffic_%i.tmp",outdir,usage);
-			if (verbose>1) wprintw(statuswin,"newfile %s\n",ssis[usage].curfile);
+			rec_flush(usage);
+			newfile=1;
+			strftime(r->curfiletime,32,"%Y%m%d_%H%M%S",localtime(&tt));
+			if (!r->curfile) {
+				r->curfile=malloc(strlen(net->outdir)+40);
+				/* a new call */
+				r->callstart=tt;
+				r->callframes=r->frames-1;
+				r->calllost=r->lost-gap;
+				r->ncallssi=0;
+				r->recorded=0;
+				r->encr=0;
+				for (j=0;j<3;j++) call_addssi(usage,u->ssi[j]);
+			}
+			if (net->id) {
+				sprintf(r->curfile,"%s/traffic_n%i_%i.tmp",net->outdir,net->id,usage);
+			} else {
+				sprintf(r->curfile,"%s/traffic_%i.tmp",net->outdir,usage);
+			}
+			if (verbose>1) status_printf("newfile %s\n",r->curfile);
 			ref=1;
 		}
-		if (strlen(ssis[usage].curfile))
+		if (r->curfile)
 		{
-			if (ps_record) {	
-				f=fopen(ssis[usage].curfile,"ab");
-				if (f) {
-					fwrite(c, 1, len, f);
-					fclose(f);
-				}
+			if (u->encr) r->encr=1;
+			if ((ps_record)&&(!u->encr)&&(gap)&&(!newfile)) {
+				/* mark the missing frames with silence instead of splicing the recording */
+				status_printf("usage %i: %i voice frames missing, marked in the recording\n",usage%MAXUS,gap);
+				make_fill_frame(fill);
+				if (gap>SEQ_MAXFILL) gap=SEQ_MAXFILL;
+				while(gap--) rec_write(usage,fill,len,REC_FILL,ts);
 			}
-			ssis[usage].ssi_time_rec=tt;
+			if ((ps_record)&&(!u->encr)) rec_write(usage,c,len,0,ts);
+			u->ssi_time_rec=tt;
 		}
 
 
@@ -1410,29 +6139,85 @@ int parsetraffic(unsigned char *buf)
 	return(0);
 }
 
-/* get config from env variables, maybe i should switch it to getopt() one day */
-void get_cfgenv() {
-
-	if (getenv("TETRA_OUTDIR"))
-	{
-		outdir=getenv("TETRA_OUTDIR");
-	} else {
-		outdir=def_outdir;
+/* 
+ * get the n-th element of a comma separated list from an env variable. 
+ * if the list is shorter then the last element is returned when uselast 
+ * is set, otherwise NULL. the result is malloc()ed 
+ */
+char *getenv_item(char *name,int n,int uselast)
+{
+	char *c,*d;
+	int i=0;
+
+	c=getenv(name);
+	if (!c) return(NULL);
+	while(1) {
+		d=strchr(c,',');
+		if ((i==n)||((!d)&&(uselast))) {
+			if (!d) d=c+strlen(c);
+			return(strndup(c,d-c));
+		}
+		if (!d) return(NULL);
+		c=d+1;
+		i++;
 	}
+}
 
+/* configure all networks, one for each port in TETRA_PORT */
+void get_cfgnets() {
+	char *c;
+	int i;
 
-	if (getenv("TETRA_LOGFILE"))
-	{
-		logfile=getenv("TETRA_LOGFILE");
-	} else {
-		logfile=def_logfile;
+	nnets=0;
+	while ((nnets<MAXNETS)&&((c=getenv_item("TETRA_PORT",nnets,0)))) {
+		nets[nnets].port=atoi(c);
+		free(c);
+		nnets++;
 	}
-	if (getenv("TETRA_SSI_FILTER"))
-	{
-		strncpy((char *)&ssi_filter,getenv("TETRA_SSI_FILTER"),sizeof(ssi_filter)-1);
-	} else {
-		ssi_filter[0]=0;
+	if (!nnets) {
+		nets[0].port=PORT;
+		nnets=1;
+	}
+
+	for (i=0;i<nnets;i++) {
+		net=&nets[i];
+		net->id=i;
+
+		net->outdir=getenv_item("TETRA_OUTDIR",i,1);
+		if (!net->outdir) net->outdir=def_outdir;
+
+		net->logfile=getenv_item("TETRA_LOGFILE",i,1);
+		if (!net->logfile) net->logfile=def_logfile;
+
+		/* an empty element disables KML for this network */
+		net->kml_file=getenv_item("TETRA_KML_FILE",i,0);
+		if ((net->kml_file)&&(strlen(net->kml_file))) {
+			net->kml_tmp_file=malloc(strlen(net->kml_file)+6);
+			sprintf(net->kml_tmp_file,"%s.tmp",net->kml_file);
+		} else {
+			net->kml_file=NULL;
+			net->kml_tmp_file=NULL;
+		}
+
+		net->geojson_file=getenv_item("TETRA_GEOJSON_FILE",i,0);
+		if ((net->geojson_file)&&(strlen(net->geojson_file))) {
+			net->geojson_tmp_file=malloc(strlen(net->geojson_file)+6);
+			sprintf(net->geojson_tmp_file,"%s.tmp",net->geojson_file);
+		} else {
+			net->geojson_file=NULL;
+			net->geojson_tmp_file=NULL;
+		}
 	}
+	net=&nets[0];
+	dispnet=&nets[0];
+}
+
+/* get config from env variables, maybe i should switch it to getopt() one day */
+void get_cfgenv() {
+
+	get_cfgnets();
+
+	if (getenv("TETRA_SSI_FILTER")) set_filter(compile_filter(getenv("TETRA_SSI_FILTER")));
 
 	if (getenv("TETRA_SSI_DESCRIPTIONS"))
 	{
@@ -1441,11 +6226,10 @@ void get_cfgenv() {
 		ssifile=def_ssifile;	
 	}
 
-	if (getenv("TETRA_KML_FILE"))
+	if (getenv("TETRA_SSI_FILTER_FILE")) filterfile=getenv("TETRA_SSI_FILTER_FILE");
+
+	if ((getenv("TETRA_KML_FILE"))||(getenv("TETRA_GEOJSON_FILE")))
 	{
-		kml_file=getenv("TETRA_KML_FILE");
-		kml_tmp_file=malloc(strlen(kml_file)+6);
-		sprintf(kml_tmp_file,"%s.tmp",kml_file);
 		if (getenv("TETRA_KML_INTERVAL")) {
 			kml_interval=atoi(getenv("TETRA_KML_INTERVAL"));
 		} else {
@@ -1455,12 +6239,9 @@ void get_cfgenv() {
 		kml_interval=0;
 	}
 
-	if (getenv("TETRA_LOCK_FILE"))
-	{
-		lock_file=getenv("TETRA_LOCK_FILE");
-		lockfd=open(lock_file,O_RDWR|O_CREAT,0600);
-		if (lockfd<1) lockfd=0;
-	}
+	if (getenv("TETRA_LOC_TIMEOUT")) loc_timeout=atoi(getenv("TETRA_LOC_TIMEOUT"));
+
+	if (getenv("TETRA_LOCK_FILE")) lock_file=getenv("TETRA_LOCK_FILE");
 
 	if (getenv("TETRA_REC_TIMEOUT")) rec_timeout=atoi(getenv("TETRA_REC_TIMEOUT"));
 	if (getenv("TETRA_SSI_TIMEOUT")) ssi_timeout=atoi(getenv("TETRA_SSI_TIMEOUT"));
@@ -1468,40 +6249,471 @@ void get_cfgenv() {
 	if (getenv("TETRA_CURPLAYING_TIMEOUT")) curplaying_timeout=atoi(getenv("TETRA_CURPLAYING_TIMEOUT"));
 	if (getenv("TETRA_FREQ_TIMEOUT")) freq_timeout=atoi(getenv("TETRA_FREQ_TIMEOUT"));
 
+	if (getenv("TETRA_REC_BATCH")) rec_batch=atoi(getenv("TETRA_REC_BATCH"));
+	if (rec_batch<1) rec_batch=1;
+	if (getenv("TETRA_TRANSCODE_WORKERS")) transcode_workers=atoi(getenv("TETRA_TRANSCODE_WORKERS"));
+	if (transcode_workers<0) transcode_workers=0;
+	if (transcode_workers>MAXTRANSCODERS) transcode_workers=MAXTRANSCODERS;
+	if (getenv("TETRA_CDR_DIR")) cdr_dir=getenv("TETRA_CDR_DIR");
+	if (getenv("TETRA_TRANSCODE_DIR")) strncpy(transcode_dir,getenv("TETRA_TRANSCODE_DIR"),sizeof(transcode_dir)-1);
+	if (getenv("TETRA_TRANSCODE_CMD")) strncpy(transcode_cmd,getenv("TETRA_TRANSCODE_CMD"),sizeof(transcode_cmd)-1);
+
+	if (getenv("TETRA_REC_MAXOPEN")) rec_maxopen=atoi(getenv("TETRA_REC_MAXOPEN"));
+	if (rec_maxopen<1) rec_maxopen=1;
+	if (getenv("TETRA_REC_RAW")) rec_raw=atoi(getenv("TETRA_REC_RAW"));
+	if (getenv("TETRA_REC_EXTENT")) rec_extent=(off_t)atoi(getenv("TETRA_REC_EXTENT"))<<20;
+
+	if (getenv("TETRA_LOG_QUEUE")) log_queue_max=atoi(getenv("TETRA_LOG_QUEUE"));
+	if (getenv("TETRA_LOG_SYNC")) {
+		if (!strcmp(getenv("TETRA_LOG_SYNC"),"none")) log_sync=0;
+		if (!strcmp(getenv("TETRA_LOG_SYNC"),"flush")) log_sync=1;
+		if (!strcmp(getenv("TETRA_LOG_SYNC"),"fsync")) log_sync=2;
+	}
+
+	if (getenv("TETRA_PLAY_MINDELAY")) play_mindelay=atoi(getenv("TETRA_PLAY_MINDELAY"));
+	if (getenv("TETRA_PLAY_MAXDELAY")) play_maxdelay=atoi(getenv("TETRA_PLAY_MAXDELAY"));
+	if (play_maxdelay<play_mindelay) play_maxdelay=play_mindelay;
+	if (getenv("TETRA_PLAY_FLUSH")) play_flushframes=atoi(getenv("TETRA_PLAY_FLUSH"));
+	if (getenv("TETRA_MIX_CHANNELS")) mix_channels=atoi(getenv("TETRA_MIX_CHANNELS"));
+	if (mix_channels<1) mix_channels=1;
+	if (mix_channels>MAXMIX) mix_channels=MAXMIX;
+	if (getenv("TETRA_MIX_DECODER")) strncpy(mix_decoder,getenv("TETRA_MIX_DECODER"),sizeof(mix_decoder)-1);
+	if (getenv("TETRA_MIX_PLAYER")) strncpy(mix_player,getenv("TETRA_MIX_PLAYER"),sizeof(mix_player)-1);
+	if (getenv("TETRA_PRIORITIES")) init_priorities(getenv("TETRA_PRIORITIES"));
+
+	if (getenv("TETRA_CAPTURE_FILE")) capture_file=getenv("TETRA_CAPTURE_FILE");
+	if (getenv("TETRA_STATS_FILE")) {
+		stats_file=getenv("TETRA_STATS_FILE");
+		stats_tmp_file=malloc(strlen(stats_file)+6);
+		sprintf(stats_tmp_file,"%s.tmp",stats_file);
+	}
+	if (getenv("TETRA_STATS_SOCKET")) stats_socket=getenv("TETRA_STATS_SOCKET");
+	if (getenv("TETRA_API")) api_addr=getenv("TETRA_API");
+	if (getenv("TETRA_EVENTS_SOCKET")) events_socket=getenv("TETRA_EVENTS_SOCKET");
+
+	if (getenv("TETRA_HEADLESS")) headless=atoi(getenv("TETRA_HEADLESS"));
+	if (getenv("TETRA_FPS")) ui_fps=atoi(getenv("TETRA_FPS"));
+	if (ui_fps<1) ui_fps=1;
+
+	if (getenv("TETRA_RECV_BATCH")) recv_batch=atoi(getenv("TETRA_RECV_BATCH"));
+	if (recv_batch<1) recv_batch=1;
+	if (recv_batch>RECV_MAXBATCH) recv_batch=RECV_MAXBATCH;
+	if (getenv("TETRA_RCVBUF")) recv_rcvbuf=atoi(getenv("TETRA_RCVBUF"));
+	if (getenv("TETRA_RECV_QUEUE")) recv_queue_size=atoi(getenv("TETRA_RECV_QUEUE"));
+	if (recv_queue_size<16) recv_queue_size=16;
+	if ((getenv("TETRA_RECV_POLICY"))&&(!strcmp(getenv("TETRA_RECV_POLICY"),"block"))) recv_block=1;
+
 }
 
-int main(void)
+/* handle one received datagram, buf has to be zero terminated at buf[len], ts is when it was received */
+void handle_datagram(unsigned char *buf,int len,struct timespec *ts)
 {
-	struct sockaddr_in si_me, si_other;
-	int s;
-	socklen_t slen=sizeof(si_other);
-	unsigned char buf[BUFLEN];
 	char *c,*d;
+
+	if ((len>=TMB_HDRLEN)&&(!memcmp(buf,TMB_MAGIC,3))) {
+		parse_tetmon_bin(buf,len);
+		return;
+	}
+	c=tetmon_begin((char *)buf,len);
+	if (c)
+	{
+		c=c+13;
+		d=tetmon_end(c,len-(c-(char *)buf));
+		if (d) {
+			*d=0;
+			parsestat(c);
+			ref=1;
+		} else
+		{
+			stats_bad_lines++;
+			status_printf("bad line [%80s]\n",buf);
+			ref=1;
+		}
+
+
+	} else
+	{
+		if ((len==1386)||((len==1386+TRA_SEQLEN)&&(buf[1386]=='S')&&(buf[1387]=='Q')))
+		{ 
+			stats_frames++;
+			parsetraffic(buf,len,ts);		
+		} else
+		{
+
+			stats_small_frames++;
+			status_printf("### SMALL FRAME: write %i\n",len);
+			ref=1; }
+
+	}
+}
+
+/* 
+ * batched receive: a ring of preallocated buffers which is filled with 
+ * recvmmsg(), so that one wakeup drains everything that has queued up 
+ * in the socket, instead of one datagram per wakeup 
+ */
+#define RECV_CTRLLEN (CMSG_SPACE(sizeof(uint32_t))+CMSG_SPACE(sizeof(struct timespec))) /* room for SO_RXQ_OVFL and SO_TIMESTAMPNS */
+
+struct recv_ring {
+	int n;
+	unsigned char *bufs; /* n buffers, BUFLEN+1 bytes each (room for the terminating 0) */
+	struct mmsghdr *msgs;
+	struct iovec *iovs;
+	unsigned char *ctrl; /* n control message buffers */
+};
+
+void init_recv_ring(struct recv_ring *rr,int n)
+{
+	int i;
+	rr->n=n;
+	rr->bufs=malloc(n*(BUFLEN+1));
+	rr->msgs=calloc(n,sizeof(struct mmsghdr));
+	rr->iovs=calloc(n,sizeof(struct iovec));
+	rr->ctrl=calloc(n,RECV_CTRLLEN);
+	if ((!rr->bufs)||(!rr->msgs)||(!rr->iovs)||(!rr->ctrl)) diep("init_recv_ring");
+	for (i=0;i<n;i++) {
+		rr->iovs[i].iov_base=rr->bufs+i*(BUFLEN+1);
+		rr->iovs[i].iov_len=BUFLEN;
+		rr->msgs[i].msg_hdr.msg_iov=&rr->iovs[i];
+		rr->msgs[i].msg_hdr.msg_iovlen=1;
+		rr->msgs[i].msg_hdr.msg_control=rr->ctrl+i*RECV_CTRLLEN;
+	}
+}
+
+/* the kernel drop counter of the socket, it comes with the datagrams received after a drop */
+void recv_drops(struct tetra_net *n,struct msghdr *h)
+{
+	struct cmsghdr *cm;
+	uint32_t d;
+
+	for (cm=CMSG_FIRSTHDR(h);cm;cm=CMSG_NXTHDR(h,cm)) {
+		if ((cm->cmsg_level==SOL_SOCKET)&&(cm->cmsg_type==SO_RXQ_OVFL)) {
+			memcpy(&d,CMSG_DATA(cm),sizeof(uint32_t));
+			__atomic_store_n(&n->kernel_dropped,d,__ATOMIC_RELAXED);
+		}
+	}
+}
+
+/* when the kernel received the datagram (SO_TIMESTAMPNS), or ts if it doesn't say */
+void recv_stamp(struct msghdr *h,struct timespec *ts)
+{
+	struct cmsghdr *cm;
+
+	for (cm=CMSG_FIRSTHDR(h);cm;cm=CMSG_NXTHDR(h,cm)) {
+		if ((cm->cmsg_level==SOL_SOCKET)&&(cm->cmsg_type==SO_TIMESTAMPNS)) {
+			memcpy(ts,CMSG_DATA(cm),sizeof(struct timespec));
+			return;
+		}
+	}
+}
+
+/* 
+ * the receive thread only takes the datagrams out of the sockets and 
+ * puts them into a lock-free single producer / single consumer queue, 
+ * so that it never waits for the disk or the terminal, and the kernel 
+ * buffers don't overflow during bursts. the main loop does the rest. 
+ * when the queue is full the datagram is dropped (and counted), or with 
+ * recv_block the receive thread waits until there is room, and leaves 
+ * the datagrams in the kernel buffers meanwhile
+ */
+#define RECV_SLOTLEN 1536 /* bigger datagrams are malloc()ed */
+#define RECV_MAXDRAIN 256 /* how many datagrams the main loop handles before it looks at the timers */
+
+struct recv_slot {
+	struct timespec ts; /* CLOCK_REALTIME when the kernel received it */
+	struct timespec mono; /* CLOCK_MONOTONIC when the receive thread got it, for the statistics */
+	int net;
 	int len;
-	int tport;
-	//system("resize -s 60 203"); /* this blocks on some xterms, no idea why */
+	unsigned char *big;
+	unsigned char data[RECV_SLOTLEN+1]; /* room for the terminating 0 */
+};
+
+struct recv_queue {
+	struct recv_slot *slots;
+	unsigned int size; /* a power of 2 */
+	unsigned int head; /* written by the receive thread */
+	unsigned int tail; /* written by the main loop */
+};
+
+struct recv_queue recvq;
+pthread_t recv_thread;
+int recv_evfd=-1; /* wakes up the main loop */
+int recv_space_evfd=-1; /* wakes up the receive thread when it waits for room */
+int recv_sleeping=0; /* the main loop waits in epoll_wait() */
+int recv_waiting=0; /* the receive thread waits for room */
+
+/* called only from the receive thread */
+void recvq_put(int netid,unsigned char *buf,int len,struct timespec *ts,struct timespec *mono)
+{
+	unsigned int head=recvq.head;
+	struct recv_slot *sl;
+	struct pollfd pfd;
+	uint64_t cnt;
+	uint64_t one=1;
+
+	while(head-__atomic_load_n(&recvq.tail,__ATOMIC_SEQ_CST)>=recvq.size) {
+		if (!recv_block) {
+			stats_add(&stats_recvq_dropped,1);
+			return;
+		}
+		__atomic_store_n(&recv_waiting,1,__ATOMIC_SEQ_CST);
+		if (head-__atomic_load_n(&recvq.tail,__ATOMIC_SEQ_CST)>=recvq.size) {
+			pfd.fd=recv_space_evfd;
+			pfd.events=POLLIN;
+			poll(&pfd,1,-1);
+		}
+		__atomic_store_n(&recv_waiting,0,__ATOMIC_SEQ_CST);
+		read(recv_space_evfd,&cnt,sizeof(cnt));
+	}
+	sl=&recvq.slots[head&(recvq.size-1)];
+	sl->ts=*ts;
+	sl->mono=*mono;
+	sl->net=netid;
+	sl->len=len;
+	sl->big=NULL;
+	if (len>RECV_SLOTLEN) {
+		sl->big=malloc(len+1);
+		memcpy(sl->big,buf,len+1);
+	} else {
+		memcpy(sl->data,buf,len+1);
+	}
+	__atomic_store_n(&recvq.head,head+1,__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&recv_sleeping,__ATOMIC_SEQ_CST)) write(recv_evfd,&one,sizeof(one));
+}
+
+/* drain the socket into the queue, returns the number of datagrams received */
+int recv_batched(struct tetra_net *n,struct recv_ring *rr)
+{
+	int i,r;
+	int total=0;
+	int rounds=0;
+	unsigned char *buf;
+	int len;
+	struct timespec now,ts,mono;
+
+	do {
+		for (i=0;i<rr->n;i++) rr->msgs[i].msg_hdr.msg_controllen=RECV_CTRLLEN;
+		r=recvmmsg(n->sock,rr->msgs,rr->n,MSG_DONTWAIT,NULL);
+		if (r==-1) {
+			if ((errno==EAGAIN)||(errno==EWOULDBLOCK)||(errno==EINTR)) break;
+			diep("recvmmsg()");
+		}
+		clock_gettime(CLOCK_REALTIME,&now);
+		clock_gettime(CLOCK_MONOTONIC,&mono);
+		if (r>0) recv_drops(n,&rr->msgs[r-1].msg_hdr);
+		for (i=0;i<r;i++) {
+			buf=rr->iovs[i].iov_base;
+			len=rr->msgs[i].msg_len;
+			buf[len]=0; /* instead of clearing the whole buffer */
+			ts=now;
+			recv_stamp(&rr->msgs[i].msg_hdr,&ts);
+			recvq_put(n->id,buf,len,&ts,&mono);
+		}
+		total+=r;
+		rounds++;
+		/* a full batch means that there is probably more waiting, 
+		 * but give the other sockets a chance too */
+	} while ((r==rr->n)&&(rounds<8));
+	return(total);
+}
+
+void *recv_worker(void *arg)
+{
+	struct recv_ring rxring;
+	struct epoll_event ev;
+	struct epoll_event evs[MAXNETS];
+	int epfd;
+	int i,n;
+
+	init_recv_ring(&rxring,recv_batch);
+	epfd=epoll_create1(EPOLL_CLOEXEC);
+	if (epfd==-1) diep("epoll_create1");
+	ev.events=EPOLLIN;
+	for (i=0;i<nnets;i++) {
+		ev.data.u32=i;
+		epoll_ctl(epfd,EPOLL_CTL_ADD,nets[i].sock,&ev);
+	}
+	while(1) {
+		n=epoll_wait(epfd,evs,MAXNETS,-1);
+		for (i=0;i<n;i++) recv_batched(&nets[evs[i].data.u32],&rxring);
+	}
+	return(NULL);
+}
+
+void init_receiver()
+{
+	unsigned int size=1;
+
+	while((size<recv_queue_size)&&(size<(1<<20))) size<<=1;
+	recvq.size=size;
+	recvq.slots=calloc(size,sizeof(struct recv_slot));
+	recv_evfd=eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+	recv_space_evfd=eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+	if ((!recvq.slots)||(recv_evfd==-1)||(recv_space_evfd==-1)) diep("init_receiver");
+	pthread_create(&recv_thread,NULL,recv_worker,NULL);
+}
+
+static inline int recvq_empty()
+{
+	return(recvq.tail==__atomic_load_n(&recvq.head,__ATOMIC_SEQ_CST));
+}
+
+/* 
+ * the main loop side: handle what the receive thread has queued, but at 
+ * most RECV_MAXDRAIN datagrams, so that the timers and the keyboard 
+ * still get their turn
+ */
+void recv_drain()
+{
+	unsigned int tail=recvq.tail;
+	unsigned int head=__atomic_load_n(&recvq.head,__ATOMIC_ACQUIRE);
+	struct recv_slot *sl;
+	struct timespec t0,t1,t2;
+	unsigned char *buf;
+	uint64_t one=1;
+	int n=0;
+
+	while((tail!=head)&&(n<RECV_MAXDRAIN)) {
+		sl=&recvq.slots[tail&(recvq.size-1)];
+		buf=(sl->big)?sl->big:sl->data;
+		net=&nets[sl->net];
+		clock_gettime(CLOCK_MONOTONIC,&t0);
+		hist_add(&stats_queue_time,ts_diff_ns(&sl->mono,&t0));
+		if (capture_file) capture_datagram(buf,sl->len,&sl->ts);
+		clock_gettime(CLOCK_MONOTONIC,&t1);
+		handle_datagram(buf,sl->len,&sl->ts);
+		clock_gettime(CLOCK_MONOTONIC,&t2);
+		stats_datagrams++;
+		hist_add(&stats_datagram_time,ts_diff_ns(&t1,&t2));
+		free(sl->big);
+		sl->big=NULL;
+		tail++;
+		n++;
+		__atomic_store_n(&recvq.tail,tail,__ATOMIC_SEQ_CST);
+	}
+	stats_recvq_depth=__atomic_load_n(&recvq.head,__ATOMIC_RELAXED)-tail;
+	if ((n)&&(__atomic_load_n(&recv_waiting,__ATOMIC_SEQ_CST))) write(recv_space_evfd,&one,sizeof(one));
+}
+
+/* open the udp socket for a network */
+void open_net_socket(struct tetra_net *n)
+{
+	struct sockaddr_in si_me;
+	int s;
+	int one=1;
+
 	if ((s=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP))==-1)
 		diep("socket");
 
-	get_cfgenv(); 
-	if (getenv("TETRA_PORT"))
-	{
-		tport=atoi(getenv("TETRA_PORT"));
-	} else {
-		tport=PORT;
+	if (recv_rcvbuf) {
+		/* SO_RCVBUFFORCE can go over net.core.rmem_max, but needs CAP_NET_ADMIN */
+		if (setsockopt(s,SOL_SOCKET,SO_RCVBUFFORCE,&recv_rcvbuf,sizeof(recv_rcvbuf))==-1)
+			if (setsockopt(s,SOL_SOCKET,SO_RCVBUF,&recv_rcvbuf,sizeof(recv_rcvbuf))==-1)
+				perror("setsockopt(SO_RCVBUF)");
 	}
 
+	/* count what the kernel drops when we don't keep up */
+	if (setsockopt(s,SOL_SOCKET,SO_RXQ_OVFL,&one,sizeof(one))==-1)
+		perror("setsockopt(SO_RXQ_OVFL)");
+	/* the time when a datagram arrived, not when we got to it */
+	if (setsockopt(s,SOL_SOCKET,SO_TIMESTAMPNS,&one,sizeof(one))==-1)
+		perror("setsockopt(SO_TIMESTAMPNS)");
+
 	memset((char *) &si_me, 0, sizeof(si_me));
 	si_me.sin_family = AF_INET;
-	si_me.sin_port = htons(tport);
+	si_me.sin_port = htons(n->port);
 	si_me.sin_addr.s_addr = htonl(INADDR_ANY);
 	if (bind(s, (struct sockaddr *)&si_me, sizeof(si_me))==-1)
 		diep("bind");
+	n->sock=s;
+}
 
+#ifndef TELIVE_BENCH
+enum { EV_STDIN, EV_TIMER, EV_INOTIFY, EV_RELOAD, EV_STATS, EV_RECV, EV_QUIT };
 
-	initcur();
+/* SIGINT, SIGTERM and SIGHUP end the main loop, so that we can clean up */
+volatile sig_atomic_t quit=0;
+int quit_evfd=-1; /* wakes up the main loop */
+
+void quit_signal(int sig)
+{
+	uint64_t one=1;
+	int e=errno;
+	quit=1;
+	write(quit_evfd,&one,sizeof(one));
+	errno=e;
+}
+
+void init_quit()
+{
+	struct sigaction sa;
+
+	quit_evfd=eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+	if (quit_evfd==-1) diep("init_quit");
+	memset(&sa,0,sizeof(sa));
+	sa.sa_handler=quit_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT,&sa,NULL);
+	sigaction(SIGTERM,&sa,NULL);
+	sigaction(SIGHUP,&sa,NULL);
+}
+
+/* 
+ * give the speaker and our slot back to the other instances, finish the 
+ * recordings, let the workers write out everything, then put the terminal back
+ */
+void shutdown_telive()
+{
+	struct tetra_net *savednet=net;
+	int i,j;
+
+	arb_exit();
+	for (i=0;i<nnets;i++) {
+		net=&nets[i];
+		for (j=0;j<nslots(net);j++) timeout_rec(j,time(0)+rec_timeout+1);
+	}
+	net=savednet;
+	jq_put(&recq,job_new(JOB_STOP,NULL,NULL,NULL,0),1);
+	pthread_join(rec_thread,NULL);
+	if (capture_file) capture_flush();
+	jq_put(&logq,job_new(JOB_STOP,NULL,NULL,NULL,0),1);
+	pthread_join(log_thread,NULL);
+	if (headless) return;
+	pthread_mutex_lock(&ui.mutex);
+	ui.quit=1;
+	pthread_cond_signal(&ui.cond);
+	pthread_mutex_unlock(&ui.mutex);
+	pthread_join(ui_thread,NULL);
+}
+
+int main(void)
+{
+	unsigned char buf[BUFLEN];
+	char *c;
+	int len;
+	int i;
+	//system("resize -s 60 203"); /* this blocks on some xterms, no idea why */
+
+	get_cfgenv(); 
+
+	for (i=0;i<nnets;i++) open_net_socket(&nets[i]);
+
+	if (!headless) initcur();
+	init_tetmon();
+	init_reload();
+	init_transcoders();
+	init_rec_worker();
+	init_log_worker();
+	init_file_worker();
+	init_capture();
+	init_stats_socket();
+	write_stats();
+	init_api();
+	init_events();
 	updopis();
-	do_popen();
+	init_arbitration();
+	init_playback();
+	init_receiver();
 
 	ref=0;
 
@@ -1514,77 +6726,292 @@ int main(void)
 	}
 
 	signal(SIGPIPE,SIG_IGN);
-
-	fd_set rfds;
-	int nfds;
-	int r;
-	struct timeval timeout;
-
-	while (1) {
-		FD_ZERO(&rfds);
-		FD_SET(s,&rfds);
-		FD_SET(0,&rfds);
-		nfds=max(0,s+1);
-		timeout.tv_sec=0;
-		timeout.tv_usec=50*1000; //50ms
-		r=select(nfds,&rfds,0,0,&timeout);
-
-		//timeout
-		if (r==0) tickf();
-
-		if (r==-1) {
-			wprintw(statuswin,"select ret -1\n");
-			wrefresh (statuswin);
+	init_quit();
+
+	/* 
+	 * the main loop sleeps until there is some input, or until the 
+	 * next timer is due. the timerfd is armed by run_timers()
+	 */
+	struct epoll_event ev;
+	struct epoll_event evs[6];
+	int epfd;
+	int tfd;
+	int n;
+	struct timespec t0,t1;
+
+	epfd=epoll_create1(EPOLL_CLOEXEC);
+	if (epfd==-1) diep("epoll_create1");
+	tfd=timerfd_create(CLOCK_REALTIME,TFD_NONBLOCK|TFD_CLOEXEC);
+	if (tfd==-1) diep("timerfd_create");
+
+	ev.events=EPOLLIN;
+	if (!headless) {
+		/* the keys are read here, not by the screen thread */
+		ev.data.u32=EV_STDIN;
+		epoll_ctl(epfd,EPOLL_CTL_ADD,0,&ev);
+	}
+	ev.data.u32=EV_TIMER;
+	epoll_ctl(epfd,EPOLL_CTL_ADD,tfd,&ev);
+	if (inotify_fd!=-1) {
+		ev.data.u32=EV_INOTIFY;
+		epoll_ctl(epfd,EPOLL_CTL_ADD,inotify_fd,&ev);
+	}
+	if (reload_evfd!=-1) {
+		ev.data.u32=EV_RELOAD;
+		epoll_ctl(epfd,EPOLL_CTL_ADD,reload_evfd,&ev);
+	}
+	if (stats_sock!=-1) {
+		ev.data.u32=EV_STATS;
+		epoll_ctl(epfd,EPOLL_CTL_ADD,stats_sock,&ev);
+	}
+	ev.data.u32=EV_RECV;
+	epoll_ctl(epfd,EPOLL_CTL_ADD,recv_evfd,&ev);
+	ev.data.u32=EV_QUIT;
+	epoll_ctl(epfd,EPOLL_CTL_ADD,quit_evfd,&ev);
+
+	init_timers();
+	run_timers(tfd);
+
+	while (!quit) {
+		/* the receive thread writes recv_evfd only when we sleep */
+		__atomic_store_n(&recv_sleeping,1,__ATOMIC_SEQ_CST);
+		n=epoll_wait(epfd,evs,sizeof(evs)/sizeof(evs[0]),recvq_empty()?-1:0);
+		__atomic_store_n(&recv_sleeping,0,__ATOMIC_SEQ_CST);
+		clock_gettime(CLOCK_MONOTONIC,&t0);
+
+		if ((n==-1)&&(errno!=EINTR)) {
+			status_printf("epoll_wait ret -1\n");
 		}
 
-		if ((r>0)&&(FD_ISSET(0,&rfds)))
-		{
-			len=read(0,buf,1);
-
-			if (len==1) keyf(buf[0]);
+		for (i=0;i<n;i++) {
+			switch(evs[i].data.u32) {
+				case EV_STDIN:
+					len=read(0,buf,1);
+					if (len==1) keyf(buf[0]);
+					if (len==0) epoll_ctl(epfd,EPOLL_CTL_DEL,0,NULL); /* stdin closed */
+					break;
+				case EV_TIMER:
+					read(tfd,buf,sizeof(uint64_t));
+					break;
+				case EV_INOTIFY:
+					handle_inotify();
+					break;
+				case EV_RELOAD:
+					install_reloaded();
+					break;
+				case EV_STATS:
+					handle_stats_socket();
+					break;
+				case EV_RECV:
+					read(recv_evfd,buf,sizeof(uint64_t));
+					break;
+				case EV_QUIT:
+					read(quit_evfd,buf,sizeof(uint64_t));
+					break;
+			}
 		}
+		recv_drain();
+		/* the timers run on every pass, so that traffic can't starve them */
+		run_timers(tfd);
+		if (ref) refresh_scr();
+		clock_gettime(CLOCK_MONOTONIC,&t1);
+		hist_add(&stats_loop_time,ts_diff_ns(&t0,&t1));
 
-		if ((r>0)&&(FD_ISSET(s,&rfds)))
-		{
-			bzero(buf,BUFLEN);
-			len=recvfrom(s, buf, BUFLEN, 0, (struct sockaddr *)&si_other, &slen);
+	}
+	shutdown_telive();
+	for (i=0;i<nnets;i++) close(nets[i].sock);
+	return 0;
+}
+#else
+
+/* 
+ * parser benchmark, build with make bench and run: 
+ * ./telive_bench testfile.tetmon [testfile.acelp]
+ * the corpus has one datagram per line, the acelp file is cut into 
+ * traffic frames which are mixed in. this compares the old way of 
+ * parsing (strstr() for the framing and for every key) with 
+ * find_marker() and tetmon_tokenize(). only the parsing is timed, 
+ * parsestat() is not called
+ */
+int cmpfunc(char *c,char *func)
+{
+	if (!c) return(0);
+	if (strncmp(c,func,strlen(func))==0) return(1);
+	return(0);
+}
 
-			if (len==-1)
-				diep("recvfrom()");
+/* the lookups that parsestat() used to do */
+int bench_old(char *c)
+{
+	char *func;
+	int sum=0;
 
-			c=strstr((char *)buf,"TETMON_begin");
-			if (c)
-			{
-				c=c+13;
-				d=strstr((char *)buf,"TETMON_end");
-				if (d) {
-					*d=0;
-					parsestat(c);
-					ref=1;
-				} else
-				{
-					wprintw(statuswin,"bad line [%80s]\n",buf);
-					ref=1;
-				}
+	func=getptr(c,"FUNC:");
+	sum+=getptrint(c,"IDT:",10);
+	sum+=getptrint(c,"SSI:",10);
+	sum+=getptrint(c,"IDX:",10);
+	sum+=getptrint(c,"ENCR:",10);
+	sum+=getptrint(c,"RX:",10);
+	if (cmpfunc(func,"BURST")) return(sum);
+	if (cmpfunc(func,"AFCVAL")) return(sum+getptrint(c,"AFC:",10));
+	if (cmpfunc(func,"NETINFO")) {
+		sum+=getptrint(c,"MNC:",16)+getptrint(c,"MCC:",16)+getptrint(c,"CCODE:",16);
+		sum+=getptrint(c,"DLF:",10)+getptrint(c,"ULF:",10)+getptrint(c,"LA:",10);
+	}
+	if ((cmpfunc(func,"FREQINFO1"))||(cmpfunc(func,"FREQINFO2"))) {
+		sum+=getptrint(c,"MNC:",16)+getptrint(c,"MCC:",16);
+		sum+=getptrint(c,"DLF:",10)+getptrint(c,"ULF:",10)+getptrint(c,"LA:",10);
+	}
+	cmpfunc(func,"DSETUPDEC");
+	if (cmpfunc(func,"SDSDEC")) {
+		sum+=getptrint(c,"CallingSSI:",10)+getptrint(c,"CalledSSI:",10);
+		sum+=(strstr(c,"DATA:")!=NULL)+(getptr(c," lat:")!=NULL)+(getptr(c," lon:")!=NULL);
+		sum+=(strstr(c,"Text")!=NULL)+(strstr(c,"INVALID_POSITION")!=NULL);
+	}
+	cmpfunc(func,"D-SETUP");
+	cmpfunc(func,"D-CONNECT");
+	cmpfunc(func,"D-RELEASE");
+	return(sum);
+}
 
+/* the same with the tokenizer */
+int bench_new(char *c)
+{
+	struct tetmon_msg m;
+	int sum=0;
+
+	tetmon_tokenize(c,&m);
+	sum+=tm_int(&m,TMF_IDT,10)+tm_int(&m,TMF_SSI,10)+tm_int(&m,TMF_IDX,10);
+	sum+=tm_int(&m,TMF_ENCR,10)+tm_int(&m,TMF_RX,10);
+	if (m.func<0) return(sum);
+	switch(m.func) {
+		case 0: /* BURST */
+			return(sum);
+		case 1: /* AFCVAL */
+			return(sum+tm_int(&m,TMF_AFC,10));
+		case 2: /* NETINFO */
+			sum+=tm_int(&m,TMF_CCODE,16);
+		case 3: /* FREQINFO1 */
+		case 4: /* FREQINFO2 */
+			sum+=tm_int(&m,TMF_MNC,16)+tm_int(&m,TMF_MCC,16);
+			sum+=tm_int(&m,TMF_DLF,10)+tm_int(&m,TMF_ULF,10)+tm_int(&m,TMF_LA,10);
+			break;
+		case 6: /* SDSDEC */
+			sum+=tm_int(&m,TMF_CALLINGSSI,10)+tm_int(&m,TMF_CALLEDSSI,10);
+			sum+=(m.val[TMF_DATA]!=NULL)+(m.val[TMF_LAT]!=NULL)+(m.val[TMF_LON]!=NULL);
+			sum+=(strstr(c,"Text")!=NULL)+(strstr(c,"INVALID_POSITION")!=NULL);
+			break;
+	}
+	return(sum);
+}
 
-			} else
-			{
-				if (len==1386) 
-				{ 
-					if (newopis()) initopis();
-					parsetraffic(buf);		
-				} else
-				{
+double bench_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return(ts.tv_sec+ts.tv_nsec/1e9);
+}
 
-					wprintw(statuswin,"### SMALL FRAME: write %i\n",len);
-					ref=1; }
+int main(int argc,char **argv)
+{
+	FILE *f;
+	char line[BUFLEN];
+	char **dgrams;
+	int *lens;
+	char *work;
+	int n=0,nmax=1024;
+	int ntext=0;
+	int i,k,r,rounds;
+	double t0,t1,t_old,t_new;
+	volatile int sink=0;
+	char *c,*d;
 
+	if (argc<2) {
+		fprintf(stderr,"usage: %s corpus.tetmon [frames.acelp]\n",argv[0]);
+		exit(1);
+	}
+	init_tetmon();
+	dgrams=malloc(nmax*sizeof(char *));
+	lens=malloc(nmax*sizeof(int));
+	f=fopen(argv[1],"r");
+	if (!f) { perror(argv[1]); exit(1); }
+	while(fgets(line,sizeof(line),f)) {
+		line[strcspn(line,"\r\n")]=0;
+		if (!strstr(line,"TETMON_begin")) continue;
+		if (n==nmax) {
+			nmax*=2;
+			dgrams=realloc(dgrams,nmax*sizeof(char *));
+			lens=realloc(lens,nmax*sizeof(int));
+		}
+		lens[n]=strlen(line);
+		dgrams[n]=malloc(BUFLEN+1);
+		memcpy(dgrams[n],line,lens[n]+1);
+		n++;
+	}
+	fclose(f);
+	ntext=n;
+	if (argc>2) {
+		/* one traffic frame for every 4 text messages, roughly what a busy cell looks like */
+		f=fopen(argv[2],"r");
+		if (!f) { perror(argv[2]); exit(1); }
+		for (i=0;i<ntext/4;i++) {
+			if (n==nmax) {
+				nmax*=2;
+				dgrams=realloc(dgrams,nmax*sizeof(char *));
+				lens=realloc(lens,nmax*sizeof(int));
 			}
+			dgrams[n]=calloc(1,BUFLEN+1);
+			memcpy(dgrams[n],"TRA05",5);
+			if (fread(dgrams[n]+6,1,1380,f)!=1380) { rewind(f); fread(dgrams[n]+6,1,1380,f); }
+			lens[n]=1386;
+			n++;
 		}
-		if (ref) refresh_scr();
-
+		fclose(f);
 	}
-	close(s);
-	return 0;
+	if (!ntext) { fprintf(stderr,"no TETMON messages in %s\n",argv[1]); exit(1); }
+	work=malloc(BUFLEN+1);
+	rounds=1000000/n+1;
+
+	/* best of a few runs, so that other things running on the machine don't skew it */
+	t_old=t_new=1e9;
+	for (r=0;r<5;r++) {
+		t0=bench_now();
+		for (k=0;k<rounds;k++) {
+			for (i=0;i<n;i++) {
+				memcpy(work,dgrams[i],lens[i]+1);
+				c=strstr(work,"TETMON_begin");
+				if (!c) continue;
+				c+=13;
+				d=strstr(work,"TETMON_end");
+				if (!d) continue;
+				*d=0;
+				sink+=bench_old(c);
+			}
+		}
+		t1=bench_now()-t0;
+		if (t1<t_old) t_old=t1;
+
+		t0=bench_now();
+		for (k=0;k<rounds;k++) {
+			for (i=0;i<n;i++) {
+				memcpy(work,dgrams[i],lens[i]+1);
+				c=tetmon_begin(work,lens[i]);
+				if (!c) continue;
+				c+=13;
+				d=tetmon_end(c,lens[i]-(c-work));
+				if (!d) continue;
+				*d=0;
+				sink+=bench_new(c);
+			}
+		}
+		t1=bench_now()-t0;
+		if (t1<t_new) t_new=t1;
+	}
+
+	printf("corpus: %i messages, %i traffic frames, %i rounds\n",ntext,n-ntext,rounds);
+	printf("strstr:   %8.1f ns/datagram\n",t_old*1e9/((double)rounds*n));
+	printf("tokenize: %8.1f ns/datagram\n",t_new*1e9/((double)rounds*n));
+	printf("speedup:  %8.2fx\n",t_old/t_new);
+	return(sink==42);
 }
+#endif
@@ -1,3 +1,5 @@
+#include <stdint.h>
+
 enum tetra_mac_res_addr_type {
 	ADDR_TYPE_NULL  = 0,
 	ADDR_TYPE_SSI   = 1,
@@ -9,3 +11,192 @@ enum tetra_mac_res_addr_type {
 	ADDR_TYPE_SMI_EVENT     = 7,
 };
 
+/* 
+ * binary TETMON records, an alternative to the TETMON_begin ... TETMON_end 
+ * text messages. a datagram holds one or more records, each record is:
+ *
+ * 0-2  'T' 'M' 'B'
+ * 3    version (TMB_VERSION)
+ * 4-5  record length including this header, big endian
+ * 6    FUNC code (enum tmb_func)
+ * 7    reserved, 0
+ * 8-   fields: code (enum tmb_field), value length, value
+ *
+ * numbers are big endian two's complement, 1 to 4 bytes long. MCC, MNC 
+ * and CCODE are the plain numbers (not the hex text). lat/lon are in 
+ * millionths of a degree, negative for S/W, and are left out for an 
+ * invalid position. DATA is the SDS text. SEQ is the optional sequence 
+ * number of the messages from this RX (like SEQ: in the text messages). 
+ * fields with an unknown code are skipped, so new ones can be added 
+ * without bumping the version
+ */
+#define TMB_MAGIC "TMB"
+#define TMB_VERSION 1
+#define TMB_HDRLEN 8
+#define TMB_MAXLEN 1024
+
+enum tmb_func {
+	TMB_NONE = 0,
+	TMB_BURST, TMB_AFCVAL, TMB_NETINFO, TMB_FREQINFO1, TMB_FREQINFO2,
+	TMB_DSETUPDEC, TMB_SDSDEC, TMB_DSETUP, TMB_DCONNECT, TMB_DRELEASE,
+	TMB_DSTATUS, TMB_DTX, TMB_DUPDATE,
+	TMB_FUNC_MAX
+};
+
+/* the FUNC: text for each code */
+static const char *tmb_func_names[TMB_FUNC_MAX] = {
+	NULL, "BURST", "AFCVAL", "NETINFO", "FREQINFO1", "FREQINFO2",
+	"DSETUPDEC", "SDSDEC", "D-SETUP", "D-CONNECT", "D-RELEASE",
+	"D-STATUS", "D-TX", "DUPDATE"
+};
+
+enum tmb_field {
+	TMB_IDT = 1, TMB_SSI, TMB_IDX, TMB_ENCR, TMB_RX, TMB_AFC,
+	TMB_MCC, TMB_MNC, TMB_CCODE, TMB_DLF, TMB_ULF, TMB_LA,
+	TMB_CALLINGSSI, TMB_CALLEDSSI, TMB_DATA, TMB_LAT, TMB_LON,
+	TMB_SEQ,
+	TMB_FIELD_MAX
+};
+
+/* 
+ * capture files (TETRA_CAPTURE_FILE), replayed with tetmon_replay. 
+ * the file starts with an 8 byte header: 'T' 'L' 'C' 'A' 'P', the 
+ * version (CAP_VERSION) and 2 reserved bytes. then for each received 
+ * datagram:
+ *
+ * 0-7  receive time in nanoseconds since the epoch, big endian
+ * 8-9  datagram length, big endian
+ * 10   network index (position in TETRA_PORT)
+ * 11   reserved, 0
+ * 12-  the datagram
+ */
+#define CAP_MAGIC "TLCAP"
+#define CAP_VERSION 1
+#define CAP_HDRLEN 8
+#define CAP_RECHDRLEN 12
+
+/* 
+ * traffic frames (a 6 byte TRA header and 1380 bytes of voice) can have 
+ * an 8 byte trailer: 'S' 'Q', the RX number, 0, and the sequence number 
+ * of the frames from this RX for this usage identifier, big endian. 
+ * missing frames are counted, and marked in the recording
+ */
+#define TRA_SEQLEN 8
+
+/* 
+ * call detail records (TETRA_CDR_DIR), queried with telive_cdr. when a 
+ * call ends telive appends a record to <dir>/YYYYMMDD.cdr (the local 
+ * date of the end of the call), so the records of a day are in the 
+ * order of their end time. the file starts with an 8 byte header: 'T' 
+ * 'L' 'C' 'D' 'R', the version (CDR_VERSION) and 2 reserved bytes, then 
+ * the records follow, record n is at CDR_HDRLEN+n*sizeof(struct 
+ * cdr_record). <dir>/YYYYMMDD.ssi is the SSI log of the day, a 
+ * struct cdr_ssi for every SSI of every record, in the same order. 
+ * when the day is over the log is sorted by SSI (and record number) 
+ * into <dir>/YYYYMMDD.idx, the SSI index, and removed. both are in host 
+ * byte order, the store is meant to be local
+ */
+#define CDR_MAGIC "TLCDR"
+#define CDR_VERSION 1
+#define CDR_HDRLEN 8
+#define CDR_MAXSSI 8 /* SSIs remembered for a call */
+#define CDR_PATHLEN 256
+
+struct cdr_record {
+	int64_t start; /* first traffic frame, unix time */
+	int64_t end; /* last traffic frame */
+	uint32_t ssi[CDR_MAXSSI]; /* all SSIs seen during the call, the first nssi are valid */
+	uint32_t frames; /* traffic frames received */
+	uint32_t lost; /* traffic frames missing according to the sequence numbers */
+	int32_t rx; /* the RX, -1 if unknown */
+	uint16_t usage; /* usage identifier */
+	uint8_t net; /* network index (position in TETRA_PORT) */
+	uint8_t encr; /* encrypted */
+	uint8_t nssi;
+	uint8_t reserved[7];
+	char path[CDR_PATHLEN]; /* the recording, empty if nothing was recorded */
+};
+
+struct cdr_ssi {
+	uint32_t ssi;
+	uint32_t rec; /* record number in the .cdr file */
+};
+
+/* 
+ * recordings (the traffic_*.out files), read with telive_rec. the file 
+ * starts with an 8 byte header: 'T' 'L' 'R' 'E' 'C', the version 
+ * (REC_VERSION) and 2 reserved bytes. then a record for every voice 
+ * frame, record n is at REC_HDRLEN+n*REC_RECLEN:
+ *
+ * 0     'F'
+ * 1     flags (REC_OVER, REC_FILL)
+ * 2-3   the RX, big endian, 0xffff if unknown
+ * 4-11  arrival time in milliseconds since the epoch, big endian
+ * 12-   the voice frame (1380 bytes, what cdecoder reads)
+ *
+ * an over starts with the first frame, after a pause of REC_OVER_GAP 
+ * or more, and when another RX hears the call. when the call ends the 
+ * trailer is appended: the seek index, the overs and the footer. all 
+ * numbers are big endian. the index has an entry for every 
+ * REC_INDEX_STEP-th frame:
+ *
+ * 0-3   frame number
+ * 4-7   its time in ms since the first frame
+ *
+ * an entry for each over:
+ *
+ * 0-3   the first frame
+ * 4-7   number of frames
+ * 8-11  start time in ms since the first frame
+ * 12-13 the RX
+ * 14-15 reserved, 0
+ *
+ * and the footer, the last REC_FOOTLEN bytes of the file: 'T' 'L' 'R' 
+ * 'I' 'X', the version, 2 reserved bytes, then the number of frames, of 
+ * index entries and of overs (4 bytes each), and 4 reserved bytes. a 
+ * file without the footer (telive didn't finish it) is read up to the 
+ * last complete record
+ */
+#define REC_MAGIC "TLREC"
+#define REC_VERSION 1
+#define REC_HDRLEN 8
+#define REC_FRAMEHDR 12
+#define REC_FRAMELEN 1380
+#define REC_RECLEN (REC_FRAMEHDR+REC_FRAMELEN)
+#define REC_OVER 1 /* the first frame of an over */
+#define REC_FILL 2 /* silence in place of missing frames */
+#define REC_OVER_GAP 1000 /* ms */
+#define REC_INDEX_STEP 64
+#define REC_IXLEN 8
+#define REC_OVERLEN 16
+#define REC_FOOT_MAGIC "TLRIX"
+#define REC_FOOTLEN 24
+
+/* big endian numbers of n bytes */
+static inline void rec_putbe(unsigned char *p,uint64_t v,int n)
+{
+	while(n--) { p[n]=v&0xff; v>>=8; }
+}
+
+static inline uint64_t rec_getbe(const unsigned char *p,int n)
+{
+	uint64_t v=0;
+	while(n--) v=(v<<8)|*p++;
+	return(v);
+}
+
+/* 
+ * a voice frame with the right headers, but without any information in 
+ * the soft bits, the decoder turns it into (nearly) silence. this is 
+ * what stands for missing frames in the recordings (REC_FILL) and what 
+ * flushes the decoder when playing
+ */
+static inline void make_fill_frame(unsigned char *f)
+{
+	int i;
+	memset(f,0,REC_FRAMELEN);
+	for (i=0;i<6;i++) {
+		f[i*230]=0x21+i;
+		f[i*230+1]=0x6b;
+	}
+}
@@ -0,0 +1,254 @@
+/*
+ * telive_cdr - query the call detail records written by telive (TETRA_CDR_DIR)
+ *
+ * prints the calls which ended in the given time range, optionally only
+ * the ones where an SSI was seen, one per line: start and end time,
+ * duration, network, RX, usage identifier, encryption, frames received
+ * and lost, the SSIs and the recording. the store is split into days,
+ * only the days in the range are looked at, an SSI is found with a
+ * binary search in the sorted SSI index of the day (only the SSI log of
+ * a day which isn't over yet is read through), and so is the time range,
+ * so this is fast even for a big store
+ *
+ * usage: telive_cdr [-d dir] [-f from] [-t to] [-s ssi] [-n net] [-r rx] [-u usage] [-c]
+ * -d dir    - the store, default TETRA_CDR_DIR
+ * -f from   - the start of the time range, default the beginning
+ * -t to     - the end of the time range, default now
+ *             times are YYYY-MM-DD, YYYY-MM-DD HH:MM[:SS], unix time,
+ *             or relative to now like -7d, -12h, -30m
+ * -s ssi    - only the calls where this SSI was seen
+ * -n net    - only the calls from this network (1 is the first port in TETRA_PORT)
+ * -r rx     - only the calls heard by this RX
+ * -u usage  - only the calls on this usage identifier
+ * -c        - only print how many calls there are
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "telive.h"
+
+#define CDR_SLACK 60 /* how much out of order the end times of a day can be */
+
+struct query {
+	time_t from;
+	time_t to;
+	long ssi; /* -1 - any */
+	int net; /* -1 - any */
+	int rx; /* -2 - any */
+	int usage; /* -1 - any */
+	int count;
+	unsigned long found;
+};
+
+/* parse a time, 0 if it isn't one */
+time_t parse_time(char *s)
+{
+	struct tm tm;
+	char *c;
+	long n;
+
+	if (*s=='-') {
+		n=strtol(s+1,&c,10);
+		switch(*c) {
+			case 'd': n*=24; /* fall through */
+			case 'h': n*=60; /* fall through */
+			case 'm': n*=60; /* fall through */
+			case 's': break;
+			default: return(0);
+		}
+		return(time(0)-n);
+	}
+	memset(&tm,0,sizeof(tm));
+	tm.tm_isdst=-1;
+	c=strptime(s,"%Y-%m-%d",&tm);
+	if ((c)&&(*c)) c=strptime(c," %H:%M",&tm);
+	if ((c)&&(*c==':')) c=strptime(c,":%S",&tm);
+	if ((c)&&(!*c)) return(mktime(&tm));
+	n=strtol(s,&c,10);
+	if ((!*c)&&(n>0)) return(n);
+	return(0);
+}
+
+void print_time(time_t t,char *buf,int len)
+{
+	struct tm tm;
+	localtime_r(&t,&tm);
+	strftime(buf,len,"%Y-%m-%d %H:%M:%S",&tm);
+}
+
+/* print the record if it matches the query */
+void show(struct query *q,struct cdr_record *c)
+{
+	char start[32];
+	char end[32];
+	int i;
+
+	if ((c->end<q->from)||(c->end>q->to)) return;
+	if ((q->net!=-1)&&(c->net!=q->net)) return;
+	if ((q->rx!=-2)&&(c->rx!=q->rx)) return;
+	if ((q->usage!=-1)&&(c->usage!=q->usage)) return;
+	q->found++;
+	if (q->count) return;
+	print_time(c->start,start,sizeof(start));
+	print_time(c->end,end,sizeof(end));
+	printf("%s  %s %5lis  net:%i rx:%i usage:%i%s frames:%u lost:%u ssi:",start,end+11,(long)(c->end-c->start),
+			c->net+1,c->rx,c->usage,c->encr?" ENCR":"",c->frames,c->lost);
+	for (i=0;(i<c->nssi)&&(i<CDR_MAXSSI);i++) printf("%s%u",i?",":"",c->ssi[i]);
+	printf("  %s\n",c->path[0]?c->path:"-");
+}
+
+/* map a whole file, NULL if it is empty or not there */
+void *map_file(char *path,size_t *len)
+{
+	struct stat st;
+	void *p;
+	int fd;
+
+	fd=open(path,O_RDONLY|O_CLOEXEC);
+	if (fd==-1) return(NULL);
+	if ((fstat(fd,&st)==-1)||(!st.st_size)) {
+		close(fd);
+		return(NULL);
+	}
+	p=mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+	close(fd);
+	if (p==MAP_FAILED) return(NULL);
+	*len=st.st_size;
+	return(p);
+}
+
+void query_day(struct query *q,char *dir,char *day)
+{
+	char path[4096];
+	struct cdr_record *recs;
+	struct cdr_ssi *ix;
+	unsigned char *cdr;
+	size_t len,ixlen,nix;
+	uint32_t n,lo,hi,mid,i;
+
+	snprintf(path,sizeof(path),"%s/%s.cdr",dir,day);
+	cdr=map_file(path,&len);
+	if (!cdr) return;
+	if ((len<CDR_HDRLEN)||(memcmp(cdr,CDR_MAGIC,5))||(cdr[5]!=CDR_VERSION)) {
+		fprintf(stderr,"%s is not a telive call record file\n",path);
+		munmap(cdr,len);
+		return;
+	}
+	recs=(struct cdr_record *)(cdr+CDR_HDRLEN);
+	n=(len-CDR_HDRLEN)/sizeof(struct cdr_record);
+
+	if (q->ssi!=-1) {
+		/* the index of a day which is over, sorted by SSI */
+		snprintf(path,sizeof(path),"%s/%s.idx",dir,day);
+		ix=map_file(path,&ixlen);
+		if (ix) {
+			nix=ixlen/sizeof(struct cdr_ssi);
+			lo=0;
+			hi=nix;
+			while(lo<hi) {
+				mid=lo+(hi-lo)/2;
+				if (ix[mid].ssi<(uint32_t)q->ssi) lo=mid+1; else hi=mid;
+			}
+			for (i=lo;(i<nix)&&(ix[i].ssi==(uint32_t)q->ssi);i++) if (ix[i].rec<n) show(q,&recs[ix[i].rec]);
+			munmap(ix,ixlen);
+		}
+		/* the log of a day which isn't over yet */
+		snprintf(path,sizeof(path),"%s/%s.ssi",dir,day);
+		ix=map_file(path,&ixlen);
+		if (ix) {
+			for (i=0;i<ixlen/sizeof(struct cdr_ssi);i++) {
+				if ((ix[i].ssi!=q->ssi)||(ix[i].rec>=n)) continue;
+				show(q,&recs[ix[i].rec]);
+			}
+			munmap(ix,ixlen);
+		}
+	} else {
+		/* the first record which ended at from, give or take a bit */
+		lo=0;
+		hi=n;
+		while(lo<hi) {
+			mid=lo+(hi-lo)/2;
+			if (recs[mid].end<q->from-CDR_SLACK) lo=mid+1; else hi=mid;
+		}
+		for (i=lo;(i<n)&&(recs[i].end<=q->to+CDR_SLACK);i++) show(q,&recs[i]);
+	}
+	munmap(cdr,len);
+}
+
+int cmpstr(const void *a,const void *b)
+{
+	return(strcmp(*(char **)a,*(char **)b));
+}
+
+int main(int argc,char **argv)
+{
+	struct query q;
+	char *dir=getenv("TETRA_CDR_DIR");
+	char first[16],last[16];
+	struct tm tm;
+	struct dirent *de;
+	DIR *d;
+	char **days=NULL;
+	int ndays=0;
+	int i,opt;
+
+	memset(&q,0,sizeof(q));
+	q.to=time(0);
+	q.ssi=-1;
+	q.net=-1;
+	q.rx=-2;
+	q.usage=-1;
+	while((opt=getopt(argc,argv,"d:f:t:s:n:r:u:c"))!=-1) {
+		switch(opt) {
+			case 'd': dir=optarg; break;
+			case 'f':
+			case 't':
+				if (!parse_time(optarg)) {
+					fprintf(stderr,"bad time %s\n",optarg);
+					return(1);
+				}
+				if (opt=='f') q.from=parse_time(optarg); else q.to=parse_time(optarg);
+				break;
+			case 's': q.ssi=atol(optarg); break;
+			case 'n': q.net=atoi(optarg)-1; break;
+			case 'r': q.rx=atoi(optarg); break;
+			case 'u': q.usage=atoi(optarg); break;
+			case 'c': q.count=1; break;
+			default:
+				fprintf(stderr,"usage: %s [-d dir] [-f from] [-t to] [-s ssi] [-n net] [-r rx] [-u usage] [-c]\n",argv[0]);
+				return(1);
+		}
+	}
+	if (!dir) {
+		fprintf(stderr,"no store, use -d or set TETRA_CDR_DIR\n");
+		return(1);
+	}
+	d=opendir(dir);
+	if (!d) {
+		fprintf(stderr,"can't open %s\n",dir);
+		return(1);
+	}
+	/* the days which can have calls that ended in the range */
+	localtime_r(&q.from,&tm);
+	strftime(first,sizeof(first),"%Y%m%d",&tm);
+	localtime_r(&q.to,&tm);
+	strftime(last,sizeof(last),"%Y%m%d",&tm);
+	while((de=readdir(d))) {
+		if ((strlen(de->d_name)!=12)||(strcmp(de->d_name+8,".cdr"))) continue;
+		if ((strncmp(de->d_name,first,8)<0)||(strncmp(de->d_name,last,8)>0)) continue;
+		if (!(ndays&(ndays-1))) days=realloc(days,sizeof(char *)*(ndays?ndays*2:1));
+		days[ndays++]=strndup(de->d_name,8);
+	}
+	closedir(d);
+	qsort(days,ndays,sizeof(char *),cmpstr);
+	for (i=0;i<ndays;i++) query_day(&q,dir,days[i]);
+	if (q.count) printf("%lu\n",q.found);
+	return(0);
+}
@@ -0,0 +1,368 @@
+/*
+ * telive_rec - read the recordings written by telive
+ *
+ * writes the voice frames of the recordings to stdout, as cdecoder wants
+ * them. a recording is a container (see telive.h) with the arrival time
+ * and the RX of every frame, a seek index and the list of overs, so a
+ * part of an hour long recording is found without reading all of it.
+ * recordings without the container (TETRA_REC_RAW, or older ones) are
+ * passed through as they are, seeking in them assumes 60ms per frame.
+ * without a file (or with -) it reads stdin, as it comes, so it can be
+ * put in front of cdecoder in tplay
+ *
+ * usage: telive_rec [-l] [-g] [-o over] [-s start] [-d duration] [file...]
+ * -l           - list the overs instead
+ * -g           - keep the pauses between the overs, as silence
+ * -o over      - only this over (1 is the first)
+ * -s start     - start this far into the recording (or the over)
+ * -d duration  - and stop after this long
+ *                times are seconds, MM:SS or HH:MM:SS
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "telive.h"
+
+#define RAW_PERIOD 60 /* ms between the frames of a raw recording */
+#define MAXGAP 600000 /* longer pauses are cut to this, ms */
+
+struct rec {
+	char *name;
+	int fd;
+	int container; /* 0 - bare voice frames */
+	int seekable;
+	int footer; /* the trailer was read */
+	uint32_t nframes; /* frames in the file, if seekable */
+	unsigned char *index;
+	uint32_t nindex;
+	unsigned char *overs;
+	uint32_t novers;
+	int64_t first; /* the arrival time of the first frame */
+	uint32_t n; /* the frame that rec_next() reads */
+	int have; /* bytes of it already read, for the raw ones */
+	/* the last frame read */
+	unsigned char buf[REC_RECLEN];
+	int flags;
+	int rx;
+	int64_t ms; /* since the first frame */
+};
+
+struct opts {
+	int list;
+	int gaps;
+	int over; /* 0 - all */
+	int64_t start;
+	int64_t duration; /* 0 - to the end */
+};
+
+/* read len bytes, less only at the end */
+int readfull(int fd,unsigned char *buf,int len)
+{
+	int r,n=0;
+
+	while(n<len) {
+		r=read(fd,buf+n,len-n);
+		if ((r==-1)&&(errno==EINTR)) continue;
+		if (r<=0) break;
+		n+=r;
+	}
+	return(n);
+}
+
+int writefull(int fd,unsigned char *buf,int len)
+{
+	int r,n=0;
+
+	while(n<len) {
+		r=write(fd,buf+n,len-n);
+		if ((r==-1)&&(errno==EINTR)) continue;
+		if (r<=0) return(0);
+		n+=r;
+	}
+	return(1);
+}
+
+/* the time of frame n, straight from the file */
+int64_t frame_ms(struct rec *r,uint32_t n)
+{
+	unsigned char h[REC_FRAMEHDR];
+
+	if (!r->container) return((int64_t)n*RAW_PERIOD);
+	if (pread(r->fd,h,REC_FRAMEHDR,REC_HDRLEN+(off_t)n*REC_RECLEN)!=REC_FRAMEHDR) return(-1);
+	return(rec_getbe(h+4,8)-r->first);
+}
+
+/* read the header, and the trailer if the file has one */
+int rec_open(struct rec *r,char *name)
+{
+	unsigned char h[REC_FOOTLEN];
+	struct stat st;
+	off_t len,tlen;
+	int n;
+
+	memset(r,0,sizeof(struct rec));
+	r->name=name;
+	if (strcmp(name,"-")) {
+		r->fd=open(name,O_RDONLY|O_CLOEXEC);
+		if (r->fd==-1) {
+			fprintf(stderr,"can't open %s\n",name);
+			return(0);
+		}
+	}
+	r->seekable=(fstat(r->fd,&st)==0)&&(S_ISREG(st.st_mode));
+	n=readfull(r->fd,h,REC_HDRLEN);
+	r->container=(n==REC_HDRLEN)&&(!memcmp(h,REC_MAGIC,5));
+	if ((r->container)&&(h[5]!=REC_VERSION)) {
+		fprintf(stderr,"%s: unknown recording version %i\n",name,h[5]);
+		return(0);
+	}
+	if (!r->container) {
+		/* keep what was read, it's the start of the first frame */
+		memcpy(r->buf+REC_FRAMEHDR,h,n);
+		r->have=n;
+		if (r->seekable) r->nframes=st.st_size/REC_FRAMELEN;
+		return(1);
+	}
+	if (!r->seekable) return(1);
+	len=st.st_size;
+	r->nframes=(len-REC_HDRLEN)/REC_RECLEN;
+	if ((len>=REC_HDRLEN+REC_FOOTLEN)&&(pread(r->fd,h,REC_FOOTLEN,len-REC_FOOTLEN)==REC_FOOTLEN)&&(!memcmp(h,REC_FOOT_MAGIC,5))) {
+		r->nframes=rec_getbe(h+8,4);
+		r->nindex=rec_getbe(h+12,4);
+		r->novers=rec_getbe(h+16,4);
+		tlen=(off_t)r->nindex*REC_IXLEN+(off_t)r->novers*REC_OVERLEN;
+		if (REC_HDRLEN+(off_t)r->nframes*REC_RECLEN+tlen+REC_FOOTLEN!=len) {
+			fprintf(stderr,"%s: broken trailer, reading it without\n",name);
+			r->nframes=(len-REC_HDRLEN)/REC_RECLEN;
+			r->nindex=r->novers=0;
+		} else {
+			r->index=malloc(tlen+1);
+			if (pread(r->fd,r->index,tlen,REC_HDRLEN+(off_t)r->nframes*REC_RECLEN)!=tlen) {
+				r->nindex=r->novers=0;
+			} else {
+				r->overs=r->index+r->nindex*REC_IXLEN;
+				r->footer=1;
+			}
+		}
+	}
+	if ((r->nframes)&&(pread(r->fd,h,REC_FRAMEHDR,REC_HDRLEN)==REC_FRAMEHDR)) r->first=rec_getbe(h+4,8);
+	return(1);
+}
+
+void rec_close(struct rec *r)
+{
+	if (r->fd) close(r->fd);
+	free(r->index);
+}
+
+void rec_seek(struct rec *r,uint32_t n)
+{
+	if (!r->container) {
+		lseek(r->fd,(off_t)n*REC_FRAMELEN,SEEK_SET);
+		r->have=0;
+	} else {
+		lseek(r->fd,REC_HDRLEN+(off_t)n*REC_RECLEN,SEEK_SET);
+	}
+	r->n=n;
+}
+
+/* the last frame at or before ms, with the index, or the frames themselves if there is none */
+uint32_t rec_find(struct rec *r,int64_t ms)
+{
+	uint32_t lo=0,hi,mid;
+
+	if (r->nindex) {
+		hi=r->nindex;
+		while(hi-lo>1) {
+			mid=lo+(hi-lo)/2;
+			if (rec_getbe(r->index+mid*REC_IXLEN+4,4)<=ms) lo=mid; else hi=mid;
+		}
+		return(rec_getbe(r->index+lo*REC_IXLEN,4));
+	}
+	hi=r->nframes;
+	while(hi-lo>1) {
+		mid=lo+(hi-lo)/2;
+		if (frame_ms(r,mid)<=ms) lo=mid; else hi=mid;
+	}
+	return(lo);
+}
+
+/* read the next frame, 0 at the end */
+int rec_next(struct rec *r)
+{
+	int n;
+
+	if ((r->footer)&&(r->n>=r->nframes)) return(0);
+	if (!r->container) {
+		n=r->have+readfull(r->fd,r->buf+REC_FRAMEHDR+r->have,REC_FRAMELEN-r->have);
+		r->have=0;
+		if (n<REC_FRAMELEN) return(0);
+		r->flags=(r->n==0)?REC_OVER:0;
+		r->rx=0xffff;
+		r->ms=(int64_t)r->n*RAW_PERIOD;
+		r->n++;
+		return(1);
+	}
+	if (readfull(r->fd,r->buf,REC_RECLEN)<REC_RECLEN) return(0);
+	/* the trailer comes after the frames */
+	if (r->buf[0]!='F') return(0);
+	if (!r->n) r->first=rec_getbe(r->buf+4,8);
+	r->flags=r->buf[1];
+	r->rx=rec_getbe(r->buf+2,2);
+	r->ms=rec_getbe(r->buf+4,8)-r->first;
+	r->n++;
+	return(1);
+}
+
+void print_ms(int64_t ms)
+{
+	if (ms>=3600000) printf("%i:",(int)(ms/3600000));
+	printf("%02i:%02i.%03i",(int)(ms/60000%60),(int)(ms/1000%60),(int)(ms%1000));
+}
+
+/* list the overs, from the trailer or by going through the frames */
+void list(struct rec *r)
+{
+	uint32_t i,frames=0,start=0;
+	int64_t ms=0,last=0;
+	int rx=0,n=0;
+	unsigned char *o;
+
+	printf("%s:\n",r->name);
+	if (r->footer) {
+		for (i=0;i<r->novers;i++) {
+			o=r->overs+i*REC_OVERLEN;
+			frames=rec_getbe(o+4,4);
+			ms=rec_getbe(o+8,4);
+			last=frame_ms(r,rec_getbe(o,4)+frames-1);
+			printf("%5i  ",i+1);
+			print_ms(ms);
+			printf("  %6.1fs  frames:%u rx:%i\n",(last-ms+RAW_PERIOD)/1000.0,frames,(int)rec_getbe(o+12,2));
+		}
+		return;
+	}
+	while(rec_next(r)) {
+		if ((r->flags&REC_OVER)&&(n)) {
+			printf("%5i  ",n);
+			print_ms(ms);
+			printf("  %6.1fs  frames:%u rx:%i\n",(last-ms+RAW_PERIOD)/1000.0,r->n-1-start,rx);
+		}
+		if (r->flags&REC_OVER) {
+			n++;
+			ms=r->ms;
+			start=r->n-1;
+			rx=r->rx;
+		}
+		last=r->ms;
+	}
+	if (n) {
+		printf("%5i  ",n);
+		print_ms(ms);
+		printf("  %6.1fs  frames:%u rx:%i\n",(last-ms+RAW_PERIOD)/1000.0,r->n-start,rx);
+	}
+}
+
+int play(struct rec *r,struct opts *o)
+{
+	unsigned char fill[REC_FRAMELEN];
+	int64_t base=-1; /* where the selection starts */
+	int64_t prev=-1;
+	int64_t gap;
+	int over=0;
+
+	make_fill_frame(fill);
+	if ((o->over)&&(r->footer)) {
+		if (o->over>r->novers) return(1);
+		rec_seek(r,rec_getbe(r->overs+(o->over-1)*REC_OVERLEN,4));
+		over=o->over-1;
+	} else if ((!o->over)&&(o->start)&&(r->seekable)) {
+		base=0;
+		rec_seek(r,rec_find(r,o->start));
+	}
+	while(rec_next(r)) {
+		if (r->flags&REC_OVER) over++;
+		if (o->over) {
+			if (over<o->over) continue;
+			if (over>o->over) break;
+		}
+		if (base==-1) base=o->over?r->ms:0;
+		if (r->ms-base<o->start) continue;
+		if ((o->duration)&&(r->ms-base>=o->start+o->duration)) break;
+		if ((o->gaps)&&(prev!=-1)&&(r->ms-prev>2*RAW_PERIOD)) {
+			gap=r->ms-prev;
+			if (gap>MAXGAP) gap=MAXGAP;
+			for (gap-=RAW_PERIOD;gap>=RAW_PERIOD;gap-=RAW_PERIOD) {
+				if (!writefull(1,fill,REC_FRAMELEN)) return(0);
+			}
+		}
+		prev=r->ms;
+		if (!writefull(1,r->buf+REC_FRAMEHDR,REC_FRAMELEN)) return(0);
+	}
+	return(1);
+}
+
+/* seconds, MM:SS or HH:MM:SS, -1 if it isn't one */
+int64_t parse_time(char *s)
+{
+	double v=0,f;
+	char *c=s;
+
+	while(1) {
+		f=strtod(c,&c);
+		if (f<0) return(-1);
+		v=v*60+f;
+		if (!*c) break;
+		if (*c!=':') return(-1);
+		c++;
+	}
+	return((int64_t)(v*1000));
+}
+
+int main(int argc,char **argv)
+{
+	struct opts o;
+	struct rec r;
+	char *stdin_name="-";
+	int i,opt;
+
+	memset(&o,0,sizeof(o));
+	while((opt=getopt(argc,argv,"lgo:s:d:"))!=-1) {
+		switch(opt) {
+			case 'l': o.list=1; break;
+			case 'g': o.gaps=1; break;
+			case 'o': o.over=atoi(optarg); break;
+			case 's':
+			case 'd':
+				if (parse_time(optarg)<0) {
+					fprintf(stderr,"bad time %s\n",optarg);
+					return(1);
+				}
+				if (opt=='s') o.start=parse_time(optarg); else o.duration=parse_time(optarg);
+				break;
+			default:
+				fprintf(stderr,"usage: %s [-l] [-g] [-o over] [-s start] [-d duration] [file...]\n",argv[0]);
+				return(1);
+		}
+	}
+	if (optind==argc) {
+		argv=&stdin_name;
+		argc=1;
+		optind=0;
+	}
+	for (i=optind;i<argc;i++) {
+		if (!rec_open(&r,argv[i])) continue;
+		if (o.list) {
+			list(&r);
+		} else if (!play(&r,&o)) {
+			rec_close(&r);
+			return(1);
+		}
+		rec_close(&r);
+	}
+	return(0);
+}
@@ -0,0 +1,234 @@
+/*
+ * tetmon_replay - send a capture made with TETRA_CAPTURE_FILE back to telive
+ *
+ * the datagrams are sent with the original timing (or faster), each one
+ * to the port of the network that it was received on. at the end the
+ * sustained rates are shown. if telive writes a stats file
+ * (TETRA_STATS_FILE) then it is read before and after the replay, and
+ * the number of datagrams that telive didn't get, and how long it took
+ * to handle them are shown too
+ *
+ * usage: tetmon_replay [-H host] [-p port[,port...]] [-s speed] [-S statsfile] capture
+ * -H host   - where to send, default 127.0.0.1
+ * -p ports  - udp ports for each network, default TETRA_PORT, or 7379
+ * -s speed  - 1 is real time, 2 is twice as fast etc, 0 sends as fast
+ *             as possible, default 1
+ * -S file   - telive stats file, defaults to TETRA_STATS_FILE
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "telive.h"
+
+#define MAXPORTS 8
+#define HIST_BUCKETS 25
+
+struct stats {
+	long start;
+	unsigned long datagrams;
+	unsigned long count;
+	double sum;
+	double le[HIST_BUCKETS];
+	unsigned long bucket[HIST_BUCKETS]; /* cumulative, like in the file */
+	int nbuckets;
+};
+
+int read_stats(char *file,struct stats *st)
+{
+	FILE *f;
+	char line[256];
+	char *c;
+
+	memset(st,0,sizeof(struct stats));
+	f=fopen(file,"r");
+	if (!f) return(0);
+	while(fgets(line,sizeof(line),f)) {
+		if (line[0]=='#') continue;
+		c=strrchr(line,' ');
+		if (!c) continue;
+		if (!strncmp(line,"telive_start_time_seconds ",26)) st->start=atol(c+1);
+		if (!strncmp(line,"telive_datagrams_total ",23)) st->datagrams=strtoul(c+1,0,10);
+		if (!strncmp(line,"telive_datagram_seconds_count ",30)) st->count=strtoul(c+1,0,10);
+		if (!strncmp(line,"telive_datagram_seconds_sum ",28)) st->sum=atof(c+1);
+		if ((!strncmp(line,"telive_datagram_seconds_bucket{le=\"",35))&&(st->nbuckets<HIST_BUCKETS)) {
+			st->le[st->nbuckets]=(line[35]=='+')?-1:atof(line+35);
+			st->bucket[st->nbuckets]=strtoul(c+1,0,10);
+			st->nbuckets++;
+		}
+	}
+	fclose(f);
+	return(1);
+}
+
+/* upper bound of the bucket where the quantile q of the datagrams in b-a falls */
+double quantile(struct stats *a,struct stats *b,double q)
+{
+	unsigned long n=b->count-a->count;
+	int i;
+
+	for (i=0;i<b->nbuckets;i++) {
+		if (b->bucket[i]-a->bucket[i]>=q*n) return(b->le[i]);
+	}
+	return(-1);
+}
+
+void print_bound(char *name,double v)
+{
+	if (v<0) {
+		printf("%s: above the largest bucket\n",name);
+	} else {
+		printf("%s: <= %.0f us\n",name,v*1e6);
+	}
+}
+
+/* how many TETMON messages are in the datagram */
+int count_messages(unsigned char *buf,int len)
+{
+	int n=0;
+	int i=0;
+
+	if ((len>=TMB_HDRLEN)&&(!memcmp(buf,TMB_MAGIC,3))) {
+		while((i+TMB_HDRLEN<=len)&&(!memcmp(buf+i,TMB_MAGIC,3))) {
+			if (((buf[i+4]<<8)|buf[i+5])<TMB_HDRLEN) break;
+			i+=(buf[i+4]<<8)|buf[i+5];
+			n++;
+		}
+		return(n);
+	}
+	return(memmem(buf,len,"TETMON_begin",12)!=NULL);
+}
+
+double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return(ts.tv_sec+ts.tv_nsec/1e9);
+}
+
+int main(int argc,char **argv)
+{
+	char *host="127.0.0.1";
+	char *ports=NULL;
+	char *stats_file=NULL;
+	double speed=1;
+	FILE *f;
+	unsigned char hdr[CAP_RECHDRLEN];
+	unsigned char buf[65536];
+	struct sockaddr_in sa[MAXPORTS];
+	int nports=0;
+	struct stats st0,st1;
+	int have_stats=0;
+	unsigned long long ts,ts0=0;
+	unsigned long datagrams=0,messages=0,frames=0,errors=0;
+	double start,target,t,elapsed;
+	struct timespec sl;
+	int s,opt,len,netid;
+	char *c;
+
+	if (getenv("TETRA_PORT")) ports=getenv("TETRA_PORT");
+	if (getenv("TETRA_STATS_FILE")) stats_file=getenv("TETRA_STATS_FILE");
+	while((opt=getopt(argc,argv,"H:p:s:S:"))!=-1) {
+		switch(opt) {
+			case 'H': host=optarg; break;
+			case 'p': ports=optarg; break;
+			case 's': speed=atof(optarg); break;
+			case 'S': stats_file=optarg; break;
+			default:
+				optind=argc;
+		}
+	}
+	if (optind!=argc-1) {
+		fprintf(stderr,"usage: %s [-H host] [-p port[,port...]] [-s speed] [-S statsfile] capture\n",argv[0]);
+		exit(1);
+	}
+
+	if (!ports) ports="7379";
+	c=ports;
+	while((*c)&&(nports<MAXPORTS)) {
+		memset(&sa[nports],0,sizeof(struct sockaddr_in));
+		sa[nports].sin_family=AF_INET;
+		sa[nports].sin_port=htons(atoi(c));
+		if (!inet_aton(host,&sa[nports].sin_addr)) {
+			fprintf(stderr,"bad address %s\n",host);
+			exit(1);
+		}
+		nports++;
+		c=strchr(c,',');
+		if (!c) break;
+		c++;
+	}
+
+	f=fopen(argv[optind],"r");
+	if (!f) { perror(argv[optind]); exit(1); }
+	if ((fread(buf,1,CAP_HDRLEN,f)!=CAP_HDRLEN)||(memcmp(buf,CAP_MAGIC,5))||(buf[5]!=CAP_VERSION)) {
+		fprintf(stderr,"%s is not a telive capture file\n",argv[optind]);
+		exit(1);
+	}
+	s=socket(AF_INET,SOCK_DGRAM,0);
+	if (s<0) { perror("socket"); exit(1); }
+
+	if (stats_file) have_stats=read_stats(stats_file,&st0);
+
+	start=now();
+	while(fread(hdr,1,CAP_RECHDRLEN,f)==CAP_RECHDRLEN) {
+		ts=0;
+		for (len=0;len<8;len++) ts=(ts<<8)|hdr[len];
+		len=(hdr[8]<<8)|hdr[9];
+		netid=hdr[10];
+		if (fread(buf,1,len,f)!=len) break;
+		if (!ts0) ts0=ts;
+		if (speed>0) {
+			target=start+(ts-ts0)/1e9/speed;
+			t=now();
+			if (target>t) {
+				t=target-t;
+				sl.tv_sec=t;
+				sl.tv_nsec=(t-sl.tv_sec)*1e9;
+				nanosleep(&sl,NULL);
+			}
+		}
+		if (netid>=nports) netid=0;
+		if (sendto(s,buf,len,0,(struct sockaddr *)&sa[netid],sizeof(struct sockaddr_in))<0) {
+			errors++;
+			continue;
+		}
+		datagrams++;
+		if (len==1386) {
+			frames++;
+		} else {
+			messages+=count_messages(buf,len);
+		}
+	}
+	elapsed=now()-start;
+	fclose(f);
+	if (elapsed<=0) elapsed=1e-9;
+
+	printf("sent %lu datagrams in %.3f s (%lu send errors)\n",datagrams,elapsed,errors);
+	printf("datagrams/s: %.1f\n",datagrams/elapsed);
+	printf("messages/s: %.1f\n",messages/elapsed);
+	printf("frames/s: %.1f\n",frames/elapsed);
+
+	if (!have_stats) return(0);
+	/* the stats file is written once a second */
+	sleep(2);
+	if (!read_stats(stats_file,&st1)) {
+		fprintf(stderr,"can't read %s\n",stats_file);
+		return(1);
+	}
+	/* telive was restarted, or the file was left by an older one */
+	if ((st1.start!=st0.start)||(st1.nbuckets!=st0.nbuckets)) memset(&st0,0,sizeof(st0));
+	printf("received by telive: %lu\n",st1.datagrams-st0.datagrams);
+	printf("dropped: %ld\n",(long)(datagrams-(st1.datagrams-st0.datagrams)));
+	if (st1.count==st0.count) return(0);
+	printf("processing time avg: %.1f us\n",(st1.sum-st0.sum)/(st1.count-st0.count)*1e6);
+	print_bound("processing time p50",quantile(&st0,&st1,0.5));
+	print_bound("processing time p99",quantile(&st0,&st1,0.99));
+	print_bound("processing time max",quantile(&st0,&st1,1.0));
+	return(0);
+}
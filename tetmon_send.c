@@ -0,0 +1,238 @@
+/*
+ * tetmon_send - send TETMON messages to telive as binary records
+ *
+ * reads TETMON text messages (one per line, like testfile.tetmon or the
+ * telive log), converts them to the binary record format described in
+ * telive.h and sends them over udp. this is meant for testing telive
+ * with binary feeds without a running tetra-rx
+ *
+ * usage: tetmon_send [-H host] [-p port] [-b records] [-r rate] [-l loops] [-q] [-d n] [file]
+ * -H host   - where to send, default 127.0.0.1
+ * -p port   - udp port, default the first port in TETRA_PORT, or 7379
+ * -b n      - pack n records into one datagram, default 1
+ * -r rate   - records per second, 0 sends as fast as possible, default 0
+ * -l loops  - go through the file this many times, default 1
+ * -q        - number the messages from each RX (SEQ), for testing the loss
+ *             accounting
+ * -d n      - with -q, skip every n-th message (but still count it)
+ * without a file the messages are read from stdin
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "telive.h"
+
+struct tmb_key {
+	char *name;
+	int code;
+	int base;
+};
+
+/* the text keys, as in tetra-rx messages */
+struct tmb_key tmb_keys[]={
+	{ "IDT",TMB_IDT,10 },
+	{ "SSI",TMB_SSI,10 },
+	{ "IDX",TMB_IDX,10 },
+	{ "ENCR",TMB_ENCR,10 },
+	{ "RX",TMB_RX,10 },
+	{ "AFC",TMB_AFC,10 },
+	{ "MCC",TMB_MCC,16 },
+	{ "MNC",TMB_MNC,16 },
+	{ "CCODE",TMB_CCODE,16 },
+	{ "DLF",TMB_DLF,10 },
+	{ "ULF",TMB_ULF,10 },
+	{ "LA",TMB_LA,10 },
+	{ "CallingSSI",TMB_CALLINGSSI,10 },
+	{ "CalledSSI",TMB_CALLEDSSI,10 },
+	{ "DATA",TMB_DATA,0 },
+	{ "lat",TMB_LAT,0 },
+	{ "lon",TMB_LON,0 },
+	{ "SEQ",TMB_SEQ,10 },
+	{ NULL,0,0 }
+};
+
+int put_int(unsigned char *p,int code,int v)
+{
+	p[0]=code;
+	p[1]=4;
+	p[2]=(v>>24)&0xff;
+	p[3]=(v>>16)&0xff;
+	p[4]=(v>>8)&0xff;
+	p[5]=v&0xff;
+	return(6);
+}
+
+/*
+ * convert one TETMON text message to a binary record in out, returns the
+ * record length, or 0 if this isn't a message that we know
+ */
+#define MAXRX 256
+int number=0;
+unsigned int rxseq[MAXRX];
+
+int encode(char *line,unsigned char *out)
+{
+	char *c,*tok,*val,*e;
+	struct tmb_key *k;
+	int func=TMB_NONE;
+	int len=TMB_HDRLEN;
+	int seen=0;
+	int n,nolocation;
+	int rx=0;
+	double d;
+
+	if ((c=strstr(line,"TETMON_end"))) *c=0;
+	if ((c=strstr(line,"TETMON_begin"))) line=c+12;
+	nolocation=(strstr(line,"INVALID_POSITION")!=NULL);
+	c=line;
+	while(1) {
+		while(*c==' ') c++;
+		if (!*c) break;
+		tok=c;
+		while((*c>' ')&&(*c!=':')) c++;
+		if ((*c!=':')||(c==tok)) {
+			while(*c>' ') c++;
+			continue;
+		}
+		*c++=0;
+		val=c;
+		/* the SDS text is in brackets, and can have spaces */
+		if ((!strcmp(tok,"DATA"))&&(*val=='[')&&((e=strchr(val,']')))) {
+			c=e+1;
+		} else {
+			while(*c>' ') c++;
+		}
+		n=c-val;
+		if (*c) c++;
+		if (!strcmp(tok,"FUNC")) {
+			for (func=TMB_FUNC_MAX-1;func>TMB_NONE;func--)
+				if ((strlen(tmb_func_names[func])==n)&&(!strncmp(val,tmb_func_names[func],n))) break;
+			continue;
+		}
+		for (k=tmb_keys;k->name;k++) if (!strcmp(k->name,tok)) break;
+		if ((!k->name)||(seen&(1<<k->code))) continue;
+		seen|=1<<k->code;
+		switch(k->code) {
+			case TMB_DATA:
+				if (n>255) n=255;
+				out[len]=k->code;
+				out[len+1]=n;
+				memcpy(out+len+2,val,n);
+				len+=2+n;
+				break;
+			case TMB_LAT:
+			case TMB_LON:
+				if (nolocation) break;
+				d=atof(val);
+				if (memchr(val,(k->code==TMB_LAT)?'S':'W',n)) d=-d;
+				len+=put_int(out+len,k->code,(int)(d*1e6+((d<0)?-0.5:0.5)));
+				break;
+			case TMB_RX:
+				rx=strtol(val,0,10);
+				len+=put_int(out+len,k->code,rx);
+				break;
+			default:
+				len+=put_int(out+len,k->code,strtoul(val,0,k->base));
+		}
+	}
+	if (func==TMB_NONE) return(0);
+	if ((number)&&(!(seen&(1<<TMB_SEQ)))) len+=put_int(out+len,TMB_SEQ,++rxseq[rx&(MAXRX-1)]);
+	memcpy(out,TMB_MAGIC,3);
+	out[3]=TMB_VERSION;
+	out[4]=len>>8;
+	out[5]=len&0xff;
+	out[6]=func;
+	out[7]=0;
+	return(len);
+}
+
+int main(int argc,char **argv)
+{
+	char *host="127.0.0.1";
+	int port=7379;
+	int batch=1;
+	double rate=0;
+	int loops=1;
+	FILE *f=stdin;
+	char *file=NULL;
+	char line[8192];
+	unsigned char buf[TMB_MAXLEN*16];
+	unsigned char rec[TMB_MAXLEN+512];
+	struct sockaddr_in sa;
+	struct timespec next,now;
+	int s,opt,len,n,nrec=0,sent=0,skipped=0,lines=0;
+	long step=0;
+	int drop=0;
+
+	if (getenv("TETRA_PORT")) port=atoi(getenv("TETRA_PORT"));
+	while((opt=getopt(argc,argv,"H:p:b:r:l:qd:"))!=-1) {
+		switch(opt) {
+			case 'H': host=optarg; break;
+			case 'p': port=atoi(optarg); break;
+			case 'b': batch=atoi(optarg); break;
+			case 'r': rate=atof(optarg); break;
+			case 'l': loops=atoi(optarg); break;
+			case 'q': number=1; break;
+			case 'd': drop=atoi(optarg); break;
+			default:
+				fprintf(stderr,"usage: %s [-H host] [-p port] [-b records] [-r rate] [-l loops] [-q] [-d n] [file]\n",argv[0]);
+				exit(1);
+		}
+	}
+	if (optind<argc) file=argv[optind];
+	if ((file==NULL)&&(loops>1)) loops=1;
+	if (batch<1) batch=1;
+	if (batch>16) batch=16;
+
+	memset(&sa,0,sizeof(sa));
+	sa.sin_family=AF_INET;
+	sa.sin_port=htons(port);
+	if (!inet_aton(host,&sa.sin_addr)) {
+		fprintf(stderr,"bad address %s\n",host);
+		exit(1);
+	}
+	s=socket(AF_INET,SOCK_DGRAM,0);
+	if (s<0) { perror("socket"); exit(1); }
+
+	if (rate>0) step=1e9/rate;
+	clock_gettime(CLOCK_MONOTONIC,&next);
+	len=0;
+	while(loops--) {
+		if (file) {
+			f=fopen(file,"r");
+			if (!f) { perror(file); exit(1); }
+		}
+		while(fgets(line,sizeof(line),f)) {
+			line[strcspn(line,"\r\n")]=0;
+			n=encode(line,rec);
+			if ((n<=0)||(n>TMB_MAXLEN)) { skipped++; continue; }
+			if ((drop)&&(!(++lines%drop))) { skipped++; continue; }
+			memcpy(buf+len,rec,n);
+			len+=n;
+			if (++nrec<batch) continue;
+			if (step) {
+				next.tv_nsec+=step*nrec;
+				while(next.tv_nsec>=1000000000) { next.tv_nsec-=1000000000; next.tv_sec++; }
+				clock_gettime(CLOCK_MONOTONIC,&now);
+				if ((now.tv_sec>next.tv_sec)||((now.tv_sec==next.tv_sec)&&(now.tv_nsec>next.tv_nsec))) next=now;
+				else clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&next,NULL);
+			}
+			if (sendto(s,buf,len,0,(struct sockaddr *)&sa,sizeof(sa))<0) perror("sendto");
+			sent+=nrec;
+			len=0;
+			nrec=0;
+		}
+		if (file) fclose(f);
+	}
+	if (len) {
+		if (sendto(s,buf,len,0,(struct sockaddr *)&sa,sizeof(sa))<0) perror("sendto");
+		sent+=nrec;
+	}
+	fprintf(stderr,"sent %i records, skipped %i lines\n",sent,skipped);
+	return(0);
+}